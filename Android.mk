@@ -33,7 +33,16 @@ LOCAL_SRC_FILES:= \
 	src/lib/efs/file_utils.c \
 	src/lib/efs/mount_utils.c \
 	src/lib/efs/crypto.c \
-	src/lib/efs/key_store.c
+	src/lib/efs/key_store.c \
+	src/lib/efs/work_queue.c \
+	src/lib/efs/copy_strategy.c \
+	src/lib/efs/uring_copy.c \
+	src/lib/efs/journal.c \
+	src/lib/efs/throttle.c \
+	src/lib/efs/arena.c \
+	src/lib/efs/con_table.c \
+	src/lib/efs/trash.c \
+	src/lib/efs/unlock_cache.c
 LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH)/src/include \
 	$(LOCAL_PATH)/linux_headers/include \
@@ -38,6 +38,7 @@ extern "C" {
         extern int android_get_encrypted_user_status(int user);
         extern int android_check_primary_user_encrypted();
         extern int android_restart_framework(int user);
+        extern void android_recover_trash();
 #ifdef __cplusplus
 }
 #endif
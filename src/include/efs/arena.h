@@ -0,0 +1,47 @@
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#ifndef EFS_ARENA_H
+#define EFS_ARENA_H
+
+#include <stddef.h>
+
+/* Walk results are carved out of blocks of this size */
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGN 8
+
+struct arena_block {
+        struct arena_block *next;
+        size_t size;
+        size_t used;
+        char data[0];
+};
+
+/* Bump allocator; everything is released at once by arena_destroy */
+struct arena {
+        struct arena_block *blocks;     /* current block first */
+        size_t allocated;               /* bytes of all blocks */
+};
+
+void arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+void arena_merge(struct arena *arena, struct arena *from);
+void arena_destroy(struct arena *arena);
+
+#endif /* EFS_ARENA_H */
@@ -0,0 +1,64 @@
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#ifndef EFS_CON_TABLE_H
+#define EFS_CON_TABLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <efs/arena.h>
+
+/* Extended attribute holding the SELinux context */
+#define XATTR_NAME_SELINUX "security.selinux"
+
+#define CON_TABLE_BUCKETS 64
+#define CON_MAX_LEN 256         /* read buffer, longer contexts are allocated */
+
+/* Id of an entry without a context */
+#define CON_NONE 0
+
+struct con_entry {
+        struct con_entry *next;
+        uint32_t id;
+        uint32_t len;           /* raw xattr length */
+        char value[0];
+};
+
+/*
+ * Distinct contexts of a tree, shared by the walk threads
+ * Nodes keep a context id; values are read and written as raw xattrs
+ */
+struct con_table {
+        pthread_mutex_t lock;
+        struct arena arena;
+        struct con_entry *buckets[CON_TABLE_BUCKETS];
+        struct con_entry **entries;     /* by id - 1 */
+        uint32_t nr;
+        uint32_t size;
+        int64_t get_ns;         /* time spent reading contexts */
+        int64_t set_ns;         /* time spent writing contexts */
+};
+
+void con_table_init(struct con_table *table);
+void con_table_destroy(struct con_table *table);
+int con_get_fd(struct con_table *table, int fd, uint32_t *id);
+int con_get_path(struct con_table *table, const char *path, uint32_t *id);
+int con_set_fd(struct con_table *table, int fd, uint32_t id);
+int con_set_path(struct con_table *table, const char *path, uint32_t id);
+
+#endif /* EFS_CON_TABLE_H */
@@ -0,0 +1,97 @@
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#ifndef EFS_COPY_STRATEGY_H
+#define EFS_COPY_STRATEGY_H
+
+#include <efs/work_queue.h>
+
+/* Forces a copy method by name; "auto" runs the probe */
+#define COPY_METHOD_PROPERTY "efs.copy.method"
+#define COPY_CHUNK_SIZE (1024 * 1024)
+#define MMAP_WINDOW_SIZE (8 * 1024 * 1024)
+#define PROBE_SIZE (4 * 1024 * 1024)
+#define PROBE_FILE_NAME ".efs_copy_probe"
+
+/* Copy buffer size in bytes, rounded to whole ecryptfs extents and pages */
+#define COPY_BUFFER_PROPERTY "efs.copy.buffer_size"
+#define ECRYPTFS_EXTENT_SIZE 4096
+#define MIN_COPY_BUFFER_SIZE (64 * 1024)
+#define MAX_COPY_BUFFER_SIZE (4 * 1024 * 1024)
+#define DEFAULT_COPY_BUFFER_SIZE (256 * 1024)
+
+/* Page cache policy of bulk copies: "keep", "drop" or "direct" */
+#define COPY_CACHE_PROPERTY "efs.copy.cache"
+/* Finished ranges are written back and dropped in windows of this size */
+#define CACHE_WINDOW_SIZE (8 * 1024 * 1024)
+/* O_DIRECT reads are rounded up to whole blocks of this size */
+#define DIRECT_IO_ALIGN 4096
+
+enum copy_method {
+        COPY_METHOD_AUTO = 0,
+        COPY_METHOD_RANGE,      /* copy_file_range */
+        COPY_METHOD_SPLICE,     /* splice through a pipe */
+        COPY_METHOD_SENDFILE,
+        COPY_METHOD_MMAP,       /* mmap + write, never picked by the probe */
+        COPY_METHOD_RW,         /* classic read/write loop */
+        COPY_METHOD_MAX
+};
+
+enum copy_cache {
+        COPY_CACHE_KEEP = 0,    /* leave the page cache to the kernel */
+        COPY_CACHE_DROP,        /* drop finished ranges, read ahead */
+        COPY_CACHE_DIRECT,      /* O_DIRECT source reads, drop destination */
+        COPY_CACHE_MAX
+};
+
+typedef void (*copy_progress_fn) (off64_t n, void *arg);
+
+struct copy_job {
+        int fd_src;
+        int fd_dst;
+        off64_t pos;            /* bytes already written to fd_dst */
+        off64_t end;            /* stop offset, -1 to copy until EOF */
+        char *buffer;           /* page aligned, used by read/write */
+        size_t buffer_size;
+        int sparse;             /* copy only data extents of fd_src */
+        off64_t skipped;        /* bytes of holes not copied */
+        int cache;              /* enum copy_cache */
+        int direct;             /* fd_src was opened with O_DIRECT */
+        off64_t released;       /* destination dropped up to here */
+        copy_progress_fn progress;
+        void *arg;
+};
+
+/* One lazily allocated buffer per worker thread */
+struct buffer_pool {
+        char *buffers[MAX_WORKERS];
+        size_t size;
+};
+
+size_t align_buffer_size(size_t size);
+void buffer_pool_init(struct buffer_pool *pool, size_t size);
+char *buffer_pool_get(struct buffer_pool *pool, int worker);
+void buffer_pool_destroy(struct buffer_pool *pool);
+int copy_data(int method, struct copy_job *job);
+int probe_copy_method(int fd_src, int dst_dirfd);
+int copy_method_from_name(const char *name);
+const char *copy_method_name(int method);
+int copy_cache_from_name(const char *name);
+const char *copy_cache_name(int cache);
+
+#endif /* EFS_COPY_STRATEGY_H */
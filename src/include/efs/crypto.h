@@ -19,11 +19,61 @@
 #ifndef EFS_CRYPTO_H
 #define EFS_CRYPTO_H
 
+/* PBKDF2-SHA1 iterations of headers written without KDF parameters */
 #define PBKDF2_ITERATIONS 10000
+/* Output blocks of a derivation computed at once, one thread each */
+#define PBKDF2_MAX_LANES 4
 #define SHA512_DIGEST_LENGTH 64
 
+/* KDF of new storages: pbkdf2-sha1, pbkdf2-sha256, pbkdf2-sha512 or scrypt */
+#define KDF_PROPERTY "efs.kdf"
+#define KDF_DEFAULT "pbkdf2-sha512"
+/* Time one derivation should take on this device, in ms */
+#define KDF_TARGET_PROPERTY "efs.kdf.target_ms"
+#define KDF_TARGET_MS 250
+/* Calibration never goes below the strength of the legacy headers */
+#define KDF_MIN_ITERATIONS PBKDF2_ITERATIONS
+#define KDF_MAX_ITERATIONS 10000000
+/* Shortest timed run the iteration count is scaled from */
+#define KDF_CALIBRATION_MS 20
+/* scrypt uses N * r * 128 bytes; r = 8 gives 16 MB at N = 2^14 */
+#define KDF_SCRYPT_R 8
+#define KDF_SCRYPT_P 1
+#define KDF_SCRYPT_MIN_LOG_N 12
+#define KDF_SCRYPT_MAX_LOG_N 15
+/* Salts whose derived keys are kept by one key context */
+#define KEY_CTX_SLOTS 4
+
+/*
+ * Keys derived from one password for the length of a user operation,
+ * one per salt, so storages and headers sharing a salt run PBKDF2 once
+ */
+struct key_ctx {
+        char *passwd;           /* owned by the caller */
+        int nr_keys;
+        int next;               /* slot replaced once all are used */
+        unsigned char salt[KEY_CTX_SLOTS][PASSWD_SALT_LEN];
+        struct kdf_params kdf[KEY_CTX_SLOTS];
+        unsigned char key[KEY_CTX_SLOTS][2 * ECRYPTFS_KEY_LEN];
+};
+
 void pbkdf2(char *passwd, int passwd_len, unsigned char *salt,
-                   unsigned char *key, unsigned int key_len);
+                   unsigned char *key, unsigned int key_len,
+                   unsigned int iterations);
+int kdf_derive(const struct kdf_params *kdf, char *passwd, int passwd_len,
+               unsigned char *salt, unsigned char *key, unsigned int key_len);
+int kdf_calibrate(struct kdf_params *kdf, int type, int target_ms);
+int get_kdf_params(struct kdf_params *kdf);
+void key_ctx_init(struct key_ctx *ctx, char *passwd);
+unsigned char *key_ctx_derive(struct key_ctx *ctx, unsigned char *salt,
+                              const struct kdf_params *kdf);
+void key_ctx_clear(struct key_ctx *ctx);
+int encrypt_buffer(unsigned char *plain_text, int length,
+                   unsigned char *encrypted_text,
+                   unsigned char *encryption_key, unsigned char *IV);
+int decrypt_buffer(unsigned char *encrypted_text, int length,
+                   unsigned char *plain_text,
+                   unsigned char *decryption_key, unsigned char *IV);
 int encrypt_key(unsigned char *plain_text_key,
                        unsigned char *encrypted_key,
                        unsigned char *encryption_key, unsigned char *IV);
@@ -38,9 +88,13 @@ int decrypt_crypto_header(struct crypto_header *header,
                                  unsigned char *decryption_key,
                                  unsigned char *IV);
 int write_crypto_header(struct crypto_header *header, char *path);
+int write_storage_status(char *path, int status, int progress);
+int read_storage_status(char *path, int *status, int *progress);
+void remove_storage_status(char *path);
 int read_crypto_header(struct crypto_header *header, char *path);
-int generate_crypt_info(char *storage_path, int user, char *passwd);
-int check_passwd(struct crypto_header *header, char *passwd);
-int change_passwd(char *storage_path, char *old_passwd, char *new_passwd);
+int generate_crypt_info(char *storage_path, int user, struct key_ctx *ctx);
+int check_passwd(struct crypto_header *header, struct key_ctx *ctx);
+int change_passwd(char *storage_path, struct key_ctx *old_ctx,
+                  struct key_ctx *new_ctx);
 
 #endif /* EFS_CRYPTO_H */
@@ -24,16 +24,30 @@
 #define STORAGE_ENCRYPTION_NOT_STARTED 1
 #define STORAGE_ENCRYPTION_IN_PROGRESS 2
 #define STORAGE_ENCRYPTION_COMPLETED 3
+#define STORAGE_DECRYPTION_IN_PROGRESS 4
+
+struct tree_scan;
+struct key_ctx;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
         /* EFS Storage API */
         extern int EFS_create(char *storage_path, int user, char *passwd);
+        extern int EFS_create_from_scan(char *storage_path, int user,
+                                        char *passwd,
+                                        const struct tree_scan *scan);
         extern int EFS_unlock(char *storage_path, char *passwd);
+        extern int EFS_unlock_with_keys(char *storage_path,
+                                        struct key_ctx *keys);
         extern int EFS_lock(char *storage_path);
+        extern int EFS_lock_with_token(char *storage_path, char *token);
+        extern int EFS_unlock_with_token(char *storage_path, char *token);
         extern int EFS_change_password(char *path, char *old_passwd,
                                                char *new_passwd);
+        extern int EFS_change_password_with_keys(char *path,
+                                                 struct key_ctx *old_keys,
+                                                 struct key_ctx *new_keys);
         extern int EFS_remove(char *storage_path);
         extern int EFS_recover_data_and_remove(char *storage_path,
                                                        char *password);
@@ -44,6 +58,8 @@ extern "C" {
         extern int android_encrypt_user_data(int userId, char *password);
         extern int android_unlock_user_data(int from_init, int user, char *password);
         extern int android_lock_user_data(int user);
+        extern int android_lock_user_data_with_token(int user, char *token);
+        extern int android_unlock_user_data_with_token(int user, char *token);
         extern int android_change_user_data_password(int user, char *old_password,
                                              char *new_password);
         extern int android_decrypt_user_data(int user, char *password);
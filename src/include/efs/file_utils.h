@@ -23,6 +23,9 @@
 #define MAX_PATH_LENGTH 1024
 #define MAX_FILE_LENGTH 256
 
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <utils/Log.h>
 #include <android/log.h>
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
@@ -31,9 +34,129 @@
 static const char property_prefix[] = "efs.encrypt.progress_";
 #define SHA_HEAD 10
 
-int check_space(const char *path);
-int copy_dir_content(const char *src_path, const char *dest_path);
+/* Overrides the number of copy threads; defaults to the number of CPUs */
+#define COPY_THREADS_PROPERTY "efs.copy.threads"
+
+/* Set to 1 to remove each source as soon as its copy is on disk */
+#define MIGRATE_PROPERTY "efs.migrate"
+/* Copied sources are synced and removed in batches */
+#define MIGRATE_BATCH_FILES 256
+#define MIGRATE_BATCH_BYTES (32 * 1024 * 1024)
+/* Metadata ecryptfs keeps at the start of each encrypted file */
+#define ECRYPTFS_HEADER_SIZE 8192
+
+/* getdents64 buffer of each directory being walked */
+#define DIR_BUFFER_SIZE (32 * 1024)
+
+/* Overrides the number of tree walk threads; defaults to the number of CPUs */
+#define WALK_THREADS_PROPERTY "efs.walk.threads"
+/* Subdirectories queued per walk thread before listing them in place */
+#define WALK_QUEUE_DEPTH 2
+
+/* Overrides the number of delete threads; defaults to the number of CPUs */
+#define REMOVE_THREADS_PROPERTY "efs.remove.threads"
+
+/* Buckets of the inode map used to find hard links */
+#define INODE_MAP_SIZE 1024
+
+/* Size classes: small files are copied in batches, huge ones by range */
+#define SMALL_FILE_SIZE (64 * 1024)
+#define SMALL_BATCH_FILES 64
+#define HUGE_FILE_SIZE (256 * 1024 * 1024)
+#define HUGE_CHUNK_SIZE (32 * 1024 * 1024)
+
+/* Set to 0 to walk the whole source first; unused given a full scan */
+#define COPY_STREAM_PROPERTY "efs.copy.stream"
+/* Copy tasks queued ahead of the workers by a streaming walk */
+#define STREAM_QUEUE_DEPTH 64
+/* Entries looked at for a probe sample before a streaming copy starts */
+#define STREAM_PROBE_ENTRIES 1024
+
+/* Directories a copy keeps open once none of their entries is copied */
+#define DIR_CACHE_IDLE 64
+#define DIR_CACHE_BUCKETS 256
+
+/* "sync" for the worker pool, "io_uring" for the asynchronous engine */
+#define COPY_ENGINE_PROPERTY "efs.copy.engine"
+
+enum copy_engine {
+        COPY_ENGINE_SYNC = 0,
+        COPY_ENGINE_URING,
+};
+
+/* Attributes kept for each entry of a tree walk */
+#define FILE_ATTR_SPARSE 0x1    /* fewer blocks allocated than the size */
+
+struct file_attr {
+        int64_t size;
+        int64_t atime_ns;
+        int64_t mtime_ns;
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        uint32_t flags;
+};
+
+struct file_tree;
+
+/* Flags of scan_tree */
+#define SCAN_ENTRIES 0x1        /* keep the entries, not only totals */
+#define SCAN_SKIP_TRASH 0x2     /* path is a storage; leave its trash out */
+
+/* Called with the progress in percent each time the journal is synced */
+typedef void (*copy_checkpoint_fn) (int percent, void *arg);
+
+/* One walk of a tree, shared by the space check, progress and copy */
+struct tree_scan {
+        const char *path;       /* walked path, as given */
+        off64_t size;           /* apparent size of all entries */
+        off64_t largest;        /* largest regular file */
+        int64_t files;          /* entries other than directories */
+        int64_t dirs;
+        int entries;            /* tree holds the entries, not only totals */
+        struct file_tree *tree; /* owned by the scan */
+};
+
+struct copy_stats {
+        int64_t files;
+        int64_t bytes;          /* data bytes copied */
+        int64_t holes;          /* bytes of sparse holes skipped */
+        int64_t links;          /* hard links recreated instead of copied */
+        int64_t contexts;       /* distinct SELinux contexts */
+        int64_t con_get_ns;     /* reading contexts of the sources */
+        int64_t con_set_ns;     /* restoring contexts on the copies */
+};
+
+struct copy_options {
+        int threads;
+        int method;             /* enum copy_method */
+        size_t buffer_size;     /* bytes, 0 for the default */
+        int engine;             /* enum copy_engine */
+        int cache;              /* enum copy_cache */
+        int background;         /* idle priority, rate cap, PSI backoff */
+        int64_t rate_limit;     /* background bytes per second, 0 for none */
+        int psi_limit;          /* background stall percent, 0 to ignore */
+        const char *journal_path;       /* resume journal, NULL for none */
+        int migrate;            /* unlink each source once it is copied */
+        int stream;             /* copy while walking, in bounded memory */
+        int skip_trash;         /* source is a storage; leave its trash */
+        struct copy_stats *stats;       /* filled in if not NULL */
+        copy_checkpoint_fn checkpoint;  /* NULL unless journaled */
+        void *checkpoint_arg;
+        const struct tree_scan *scan;   /* walk of the source, NULL to walk */
+};
+
+void file_attr_from_stat(struct file_attr *attr, const struct stat *st);
+void file_attr_times(const struct file_attr *attr, struct timespec *times);
+int scan_tree(const char *path, int flags, struct tree_scan *scan);
+void free_scan(struct tree_scan *scan);
+int check_space(const char *path, const struct tree_scan *scan, int migrate);
+void init_copy_options(struct copy_options *opts);
+int copy_streams(const struct copy_options *opts);
+int copy_dir_content(const char *dst_path, const char *src_path,
+                     const struct copy_options *opts);
 int remove_dir_content(const char *path);
+int remove_dir_content_at(int dirfd, const char *name);
 int remove_dir(const char *path);
 int get_dir_size(const char *path, off64_t * size);
 #endif /* EFS_FILE_UTILS_H */
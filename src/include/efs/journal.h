@@ -0,0 +1,77 @@
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#ifndef EFS_JOURNAL_H
+#define EFS_JOURNAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <efs/file_utils.h>
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_TABLE_SIZE 4096
+/* Completed entries are made durable in batches */
+#define JOURNAL_CHECKPOINT_FILES 256
+#define JOURNAL_CHECKPOINT_BYTES (64 * 1024 * 1024)
+
+/* On-disk record, followed by path_len bytes of path */
+struct journal_record {
+        uint32_t path_len;
+        uint32_t mode;
+        int64_t size;
+        int64_t mtime_ns;
+};
+
+struct journal_entry {
+        struct journal_entry *next;
+        int64_t size;
+        int64_t mtime_ns;
+        char path[0];
+};
+
+struct journal {
+        pthread_mutex_t lock;   /* pending records */
+        pthread_mutex_t checkpoint_lock;        /* held while syncing */
+        int fd;                 /* journal file */
+        int sync_fd;            /* destination directory */
+        struct journal_entry **table;
+        unsigned int table_size;
+        unsigned int nr_entries;
+        char *pending;          /* records not yet checkpointed */
+        size_t pending_len;
+        size_t pending_size;
+        int pending_files;
+        int64_t pending_bytes;
+        char *writing;          /* records of the running checkpoint */
+        size_t writing_size;
+        int error;              /* a checkpoint failed, the file is torn */
+        void (*on_checkpoint) (void *arg);      /* entries are durable */
+        void *checkpoint_arg;
+};
+
+int journal_open(struct journal *journal, const char *path,
+                 const char *dst_path);
+int journal_done(struct journal *journal, const char *path,
+                 const struct file_attr *attr);
+int journal_record(struct journal *journal, const char *path,
+                   const struct file_attr *attr);
+int journal_checkpoint(struct journal *journal);
+void journal_close(struct journal *journal);
+
+#endif /* EFS_JOURNAL_H */
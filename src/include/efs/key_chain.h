@@ -19,6 +19,8 @@
 #ifndef EFS_KEY_CHAIN_H
 #define EFS_KEY_CHAIN_H
 
+#include <stddef.h>
+
 #define PASSWD_SALT_LEN 32
 #define ECRYPTFS_KEY_LEN 32
 #define SHA512_DIGEST_LENGTH 64
@@ -36,6 +38,21 @@ typedef unsigned char u8;
 typedef signed char s8;
 #include <linux/ecryptfs.h>
 
+/* Password key derivation of a storage */
+enum kdf_type {
+        KDF_PBKDF2_SHA1 = 0,    /* headers written without KDF parameters */
+        KDF_PBKDF2_SHA256,
+        KDF_PBKDF2_SHA512,
+        KDF_SCRYPT,
+};
+
+struct kdf_params {
+        u32 type;               /* enum kdf_type */
+        u32 cost;               /* PBKDF2 iterations, log2 of N for scrypt */
+        u32 r;                  /* scrypt block size */
+        u32 p;                  /* scrypt parallelism */
+};
+
 struct crypto_header {
         unsigned char fefek[ECRYPTFS_KEY_LEN];
         unsigned char fnek[ECRYPTFS_KEY_LEN];
@@ -43,10 +60,47 @@ struct crypto_header {
         char username[MAX_USERNAME_LEN];
         unsigned char signature[SHA512_DIGEST_LENGTH];
         int stat;
+        struct kdf_params kdf;
+};
+
+/* Headers written before the KDF parameters end at the status */
+#define CRYPTO_HEADER_V1_SIZE offsetof(struct crypto_header, kdf)
+
+#define CRYPTO_HEADER_MAGIC 0x48534645  /* "EFSH" */
+#define CRYPTO_HEADER_VERSION 2
+#define CRYPTO_CHECKSUM_LEN 32  /* SHA-256 of the preceding fields */
+
+/* Key file on disk; the status is kept in a storage_status record */
+struct crypto_header_v2 {
+        u32 magic;
+        u32 version;
+        u32 size;               /* sizeof(struct crypto_header_v2) */
+        u32 reserved;
+        struct kdf_params kdf;
+        unsigned char fefek[ECRYPTFS_KEY_LEN];
+        unsigned char fnek[ECRYPTFS_KEY_LEN];
+        unsigned char salt[PASSWD_SALT_LEN];
+        char username[MAX_USERNAME_LEN];
+        unsigned char signature[SHA512_DIGEST_LENGTH];
+        unsigned char checksum[CRYPTO_CHECKSUM_LEN];
+};
+
+#define STORAGE_STATUS_MAGIC 0x53534645 /* "EFSS" */
+#define STORAGE_STATUS_VERSION 1
+#define STORAGE_STATUS_SUFFIX ".status"
+
+/* Encryption status, replaced atomically next to the key file */
+struct storage_status {
+        u32 magic;
+        u32 version;
+        s32 status;
+        s32 progress;           /* percent copied at the last change */
+        unsigned char checksum[CRYPTO_CHECKSUM_LEN];
 };
 
 int add_ecryptfs_key(unsigned char *key, char *sig_hex, unsigned char *salt);
 int remove_ecryptfs_key(char *sig);
+int read_ecryptfs_key(char *sig, unsigned char *key, unsigned char *salt);
 void convert_to_hex_format(unsigned char *src, char *dest, size_t src_len);
 
 #endif /* EFS_KEY_CHAIN_H */
@@ -27,5 +27,6 @@ int get_private_storage_path(char *path, char *storage_path);
 int get_recovery_path(char *recovery_path, char *storage_path);
 int sanitize_storage_path(char *storage_path);
 int get_key_storage_path(char *path, char *storage_path);
+int get_journal_path(char *path, char *storage_path);
 
 #endif /* EFS_KEY_STORE_H */
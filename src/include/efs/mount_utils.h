@@ -23,12 +23,16 @@
 #define MAX_LINE_LENGTH 1024
 #define MAX_OPTION_LENGTH 256
 
+struct key_ctx;
+
 int get_mount_options(const char *path, char *mount_options);
 int check_fs_mounted(const char *path);
 int get_key_hash_from_mount_options(char *mount_options,
                                            char *fefek_hash_hex,
                                     char *fnek_hash_hex);
-int mount_ecryptfs(char *path, char *mount_point, char *passwd,
+int mount_ecryptfs_keys(char *path, char *mount_point, unsigned char *fefek,
+                        unsigned char *fnek, unsigned char *salt);
+int mount_ecryptfs(char *path, char *mount_point, struct key_ctx *ctx,
                    char *key_storage_path);
 int umount_ecryptfs(char *path);
 
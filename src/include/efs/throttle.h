@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#ifndef EFS_THROTTLE_H
+#define EFS_THROTTLE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* Set to 1 to copy in the background: idle priority, rate cap, PSI backoff */
+#define BACKGROUND_PROPERTY "efs.copy.background"
+/* Background copy rate cap in bytes per second, 0 for none */
+#define RATE_LIMIT_PROPERTY "efs.copy.rate_limit"
+/* Share of stalled time, in percent, above which a background copy waits */
+#define PSI_LIMIT_PROPERTY "efs.copy.psi_limit"
+#define DEFAULT_PSI_LIMIT 10
+
+#define PSI_IO_PATH "/proc/pressure/io"
+#define PSI_MEMORY_PATH "/proc/pressure/memory"
+/* Pressure is sampled at most this often */
+#define PSI_INTERVAL_MS 250
+/* The pause doubles while the pressure lasts */
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 3200
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define BACKGROUND_NICE 19
+
+struct throttle {
+        pthread_mutex_t lock;
+        int enabled;
+        int64_t rate;           /* bytes per second, 0 for no cap */
+        int psi_limit;          /* percent, 0 to ignore pressure */
+        int64_t next_ns;        /* when the rate budget is available */
+        int64_t pause_ns;       /* copy paused until then */
+        int64_t sample_ns;      /* last pressure sample */
+        int64_t io_stall_us;    /* stall totals at the last sample */
+        int64_t mem_stall_us;
+        int backoff_ms;
+        int64_t waited_ns;      /* total time spent waiting */
+        int saved_ioprio;
+        int saved_nice;
+};
+
+int throttle_init(struct throttle *throttle, int background, int64_t rate,
+                  int psi_limit);
+void throttle_account(struct throttle *throttle, int64_t bytes);
+void throttle_destroy(struct throttle *throttle);
+
+#endif /* EFS_THROTTLE_H */
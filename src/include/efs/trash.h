@@ -0,0 +1,30 @@
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#ifndef EFS_TRASH_H
+#define EFS_TRASH_H
+
+/* Set to 0 to delete stale data under a storage before mounting it */
+#define TRASH_PROPERTY "efs.unlock.trash"
+/* Hidden directory of a storage holding data left to delete */
+#define TRASH_DIR_NAME ".efs_trash"
+
+int trash_dir_content(const char *path);
+int trash_recover(const char *path);
+
+#endif /* EFS_TRASH_H */
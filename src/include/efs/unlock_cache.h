@@ -0,0 +1,48 @@
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#ifndef EFS_UNLOCK_CACHE_H
+#define EFS_UNLOCK_CACHE_H
+
+/* Seconds a locked storage may be unlocked again with its token, 0 = off */
+#define UNLOCK_CACHE_PROPERTY "efs.unlock.cache_timeout"
+/* Keyring of the user keyring holding the wrapped keys */
+#define UNLOCK_CACHE_KEYRING "efs_unlock_cache"
+#define UNLOCK_CACHE_PREFIX "efs_unlock:"
+/* Random key of each entry, kept in a key only its possessor can read */
+#define UNLOCK_SESSION_PREFIX "efs_unlock_key:"
+#define UNLOCK_SESSION_KEY_LEN 32
+/* Tokens are secrets chosen by the caller, not passwords */
+#define UNLOCK_TOKEN_MIN_LEN 16
+
+/* Keys of a locked storage, wrapped under HMAC(session key, token) */
+struct unlock_cache_entry {
+        unsigned char salt[ECRYPTFS_SALT_SIZE];
+        char fefek_sig[ECRYPTFS_SIG_SIZE_HEX + 1];
+        char fnek_sig[ECRYPTFS_SIG_SIZE_HEX + 1];
+        unsigned char keys[2 * ECRYPTFS_KEY_LEN];       /* fefek, fnek */
+};
+
+int unlock_cache_timeout(void);
+int unlock_cache_store(const char *mount_point, const char *token);
+int unlock_cache_load(const char *mount_point, const char *token,
+                      unsigned char *fefek, unsigned char *fnek,
+                      unsigned char *salt);
+void unlock_cache_drop(const char *mount_point);
+
+#endif /* EFS_UNLOCK_CACHE_H */
@@ -0,0 +1,50 @@
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#ifndef EFS_URING_COPY_H
+#define EFS_URING_COPY_H
+
+#include <sys/stat.h>
+#include <efs/copy_strategy.h>
+#include <efs/con_table.h>
+
+/* Files copied concurrently; each one has at most two requests in flight */
+#define URING_SLOTS 32
+#define URING_ENTRIES (2 * URING_SLOTS)
+
+struct uring_file {
+        const char *name;       /* entry name in both directories */
+        int src_dirfd;          /* set by the start callback */
+        int dst_dirfd;
+        const struct file_attr *attr;
+        struct con_table *cons; /* context read from the source */
+        void *arg;              /* owner's data */
+};
+
+/* Called before a file is opened, to set its directories */
+typedef int (*uring_start_fn) (struct uring_file *file, void *arg);
+/* Called once a started file is closed with its result; returns it */
+typedef int (*uring_done_fn) (struct uring_file *file, int error, void *arg);
+
+int uring_available(void);
+int uring_copy_files(struct uring_file *files, int nr_files,
+                     size_t buffer_size, copy_progress_fn progress,
+                     void *arg, uring_start_fn start, uring_done_fn done,
+                     void *file_arg);
+
+#endif /* EFS_URING_COPY_H */
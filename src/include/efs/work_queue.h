@@ -0,0 +1,79 @@
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#ifndef EFS_WORK_QUEUE_H
+#define EFS_WORK_QUEUE_H
+
+#include <pthread.h>
+
+#define MAX_WORKERS 16
+#define DEQUE_INIT_SIZE 64
+
+/* Work callback; a negative return value aborts the whole pool */
+typedef int (*work_fn) (void *item, int worker, void *arg);
+/* Releases an item that will not be processed */
+typedef void (*work_release_fn) (void *item);
+
+struct work_deque {
+        pthread_mutex_t lock;
+        void **items;
+        int size;
+        int head;               /* thieves take from here */
+        int tail;               /* owner pushes and pops here */
+};
+
+struct work_pool;
+
+struct work_worker {
+        struct work_pool *pool;
+        int id;
+};
+
+struct work_pool {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        pthread_t threads[MAX_WORKERS];
+        struct work_worker workers[MAX_WORKERS];
+        struct work_deque deques[MAX_WORKERS];
+        int nr_workers;
+        int nr_started;
+        int next;               /* round robin push index */
+        int queued;             /* items waiting in deques */
+        int running;            /* items being processed, may push more */
+        int limit;              /* push waits while this many are queued */
+        int closed;             /* no more items will be pushed */
+        int aborted;
+        int error;
+        work_fn fn;
+        void *arg;
+};
+
+int get_nr_cpus(void);
+int work_pool_init(struct work_pool *pool, int nr_workers, work_fn fn,
+                   void *arg);
+void work_pool_set_limit(struct work_pool *pool, int limit);
+int work_pool_push(struct work_pool *pool, void *item);
+int work_pool_start(struct work_pool *pool);
+int work_pool_wait(struct work_pool *pool);
+int work_pool_queued(struct work_pool *pool);
+int work_pool_aborted(struct work_pool *pool);
+void work_pool_abort(struct work_pool *pool, int error);
+void work_pool_drain(struct work_pool *pool, work_release_fn release);
+void work_pool_destroy(struct work_pool *pool);
+
+#endif /* EFS_WORK_QUEUE_H */
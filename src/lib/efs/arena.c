@@ -0,0 +1,144 @@
+/**
+ * @file   arena.c
+ * @author Catalin Ionita <catalin.ionita@intel.com>
+ * @date   Fri Oct 16 19:10:52 2026
+ *
+ * @brief
+ * Arena allocator for tree walk results. Nodes, paths and contexts of a
+ * walk share a few large blocks, so a walk costs no per-entry malloc and
+ * is freed a block at a time.
+ *
+ */
+
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <efs/efs.h>
+#include <efs/file_utils.h>
+#include <efs/arena.h>
+
+/**
+ * Initialize an empty arena
+ *
+ * @param arena Arena
+ */
+void arena_init(struct arena *arena)
+{
+    arena->blocks = NULL;
+    arena->allocated = 0;
+}
+
+/**
+ * Allocate memory that lives until the arena is destroyed
+ * Allocations bigger than a block get a block of their own
+ *
+ * @param arena Arena
+ * @param size Number of bytes
+ *
+ * @return Memory aligned to ARENA_ALIGN; exits if memory is exhausted,
+ * like the rest of the walk
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_block *block = arena->blocks;
+    size_t block_size;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (!block || block->size - block->used < size) {
+        block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arena_block) + block_size);
+        if (!block) {
+            LOGE("insufficient memory\n");
+            exit(EXIT_FAILURE);
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->allocated += block_size;
+    }
+
+    ptr = block->data + block->used;
+    block->used += size;
+
+    return ptr;
+}
+
+/**
+ * Copy a string into an arena
+ *
+ * @param arena Arena
+ * @param str String
+ *
+ * @return Copy of str
+ */
+char *arena_strdup(struct arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    return memcpy(arena_alloc(arena, len), str, len);
+}
+
+/**
+ * Move the blocks of another arena into an arena
+ * Allocations of both stay valid until arena is destroyed
+ *
+ * @param arena Arena
+ * @param from Arena left empty
+ */
+void arena_merge(struct arena *arena, struct arena *from)
+{
+    struct arena_block *last;
+
+    if (!from->blocks)
+        return;
+
+    if (!arena->blocks) {
+        arena->blocks = from->blocks;
+    } else {
+        /* Keep the current block of arena first */
+        for (last = from->blocks; last->next; last = last->next)
+            ;
+        last->next = arena->blocks->next;
+        arena->blocks->next = from->blocks;
+    }
+    arena->allocated += from->allocated;
+
+    arena_init(from);
+}
+
+/**
+ * Release every allocation of an arena
+ *
+ * @param arena Arena
+ */
+void arena_destroy(struct arena *arena)
+{
+    struct arena_block *block, *next;
+
+    for (block = arena->blocks; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+
+    arena_init(arena);
+}
@@ -0,0 +1,292 @@
+/**
+ * @file   con_table.c
+ * @author Catalin Ionita <catalin.ionita@intel.com>
+ * @date   Fri Oct 16 21:02:17 2026
+ *
+ * @brief
+ * Intern table for SELinux contexts. A storage holds thousands of files
+ * but only a handful of distinct contexts, so walk nodes keep a small
+ * id and the context is read and restored as a raw security.selinux
+ * xattr, without going through libselinux allocations.
+ *
+ */
+
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <efs/efs.h>
+#include <efs/file_utils.h>
+#include <efs/con_table.h>
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned int hash_value(const char *value, uint32_t len)
+{
+    unsigned int hash = 5381;
+
+    while (len--)
+        hash = hash * 33 + (unsigned char)*value++;
+
+    return hash;
+}
+
+/**
+ * Initialize an empty table
+ *
+ * @param table Context table
+ */
+void con_table_init(struct con_table *table)
+{
+    memset(table, 0, sizeof(struct con_table));
+    pthread_mutex_init(&table->lock, NULL);
+    arena_init(&table->arena);
+}
+
+/**
+ * Release a table and all its contexts
+ *
+ * @param table Context table
+ */
+void con_table_destroy(struct con_table *table)
+{
+    free(table->entries);
+    arena_destroy(&table->arena);
+    pthread_mutex_destroy(&table->lock);
+}
+
+/**
+ * Find or add a context
+ *
+ * @param table Context table
+ * @param value Raw xattr value
+ * @param len Length of value
+ *
+ * @return Context id; exits if memory is exhausted, like the walk
+ */
+static uint32_t con_intern(struct con_table *table, const char *value,
+               uint32_t len)
+{
+    unsigned int i = hash_value(value, len) % CON_TABLE_BUCKETS;
+    struct con_entry *entry, **entries;
+    uint32_t size;
+
+    pthread_mutex_lock(&table->lock);
+
+    for (entry = table->buckets[i]; entry; entry = entry->next) {
+        if (entry->len == len && !memcmp(entry->value, value, len)) {
+            pthread_mutex_unlock(&table->lock);
+            return entry->id;
+        }
+    }
+
+    if (table->nr == table->size) {
+        size = table->size ? 2 * table->size : CON_TABLE_BUCKETS;
+        entries = realloc(table->entries, size * sizeof(struct con_entry *));
+        if (!entries) {
+            LOGE("insufficient memory\n");
+            exit(EXIT_FAILURE);
+        }
+        table->entries = entries;
+        table->size = size;
+    }
+
+    entry = arena_alloc(&table->arena, sizeof(struct con_entry) + len);
+    memcpy(entry->value, value, len);
+    entry->len = len;
+    entry->id = ++table->nr;
+    table->entries[entry->id - 1] = entry;
+    entry->next = table->buckets[i];
+    table->buckets[i] = entry;
+
+    pthread_mutex_unlock(&table->lock);
+    return entry->id;
+}
+
+/**
+ * Get the context of an id
+ *
+ * @param table Context table
+ * @param id Context id
+ *
+ * @return Context, NULL for CON_NONE
+ */
+static struct con_entry *con_lookup(struct con_table *table, uint32_t id)
+{
+    struct con_entry *entry = NULL;
+
+    pthread_mutex_lock(&table->lock);
+    if (id != CON_NONE && id <= table->nr)
+        entry = table->entries[id - 1];
+    pthread_mutex_unlock(&table->lock);
+
+    return entry;
+}
+
+static ssize_t con_read(int fd, const char *path, void *value, size_t size)
+{
+    if (fd >= 0)
+        return fgetxattr(fd, XATTR_NAME_SELINUX, value, size);
+
+    return lgetxattr(path, XATTR_NAME_SELINUX, value, size);
+}
+
+/**
+ * Read the context of an open file or of a path, not following links
+ * Entries without a label get CON_NONE
+ *
+ * @param table Context table
+ * @param fd Open file, negative to use path
+ * @param path Path
+ * @param id Context id
+ *
+ * @return 0 on success, negative value on error
+ */
+static int con_get(struct con_table *table, int fd, const char *path,
+           uint32_t *id)
+{
+    char buf[CON_MAX_LEN], *value = buf;
+    int64_t start = now_ns();
+    ssize_t len;
+    int ret = 0;
+
+    len = con_read(fd, path, buf, sizeof(buf));
+    if (len < 0 && errno == ERANGE) {
+        len = con_read(fd, path, NULL, 0);
+        if (len > 0) {
+            value = malloc(len);
+            if (!value) {
+                LOGE("insufficient memory\n");
+                return -1;
+            }
+            len = con_read(fd, path, value, len);
+        }
+    }
+
+    *id = CON_NONE;
+    if (len > 0)
+        *id = con_intern(table, value, len);
+    else if (len < 0 && errno != ENODATA && errno != ENOTSUP)
+        ret = -1;
+
+    if (value != buf)
+        free(value);
+    __sync_fetch_and_add(&table->get_ns, now_ns() - start);
+
+    return ret;
+}
+
+/**
+ * Read the context of an open file
+ *
+ * @param table Context table
+ * @param fd Open file
+ * @param id Context id
+ *
+ * @return 0 on success, negative value on error
+ */
+int con_get_fd(struct con_table *table, int fd, uint32_t *id)
+{
+    return con_get(table, fd, NULL, id);
+}
+
+/**
+ * Read the context of a path, not following symbolic links
+ *
+ * @param table Context table
+ * @param path Path
+ * @param id Context id
+ *
+ * @return 0 on success, negative value on error
+ */
+int con_get_path(struct con_table *table, const char *path, uint32_t *id)
+{
+    return con_get(table, -1, path, id);
+}
+
+/**
+ * Write a context to an open file or to a path, not following links
+ * Nothing is written for CON_NONE
+ *
+ * @param table Context table
+ * @param fd Open file, negative to use path
+ * @param path Path
+ * @param id Context id
+ *
+ * @return 0 on success, negative value on error
+ */
+static int con_set(struct con_table *table, int fd, const char *path,
+           uint32_t id)
+{
+    struct con_entry *entry;
+    int64_t start;
+    int ret;
+
+    entry = con_lookup(table, id);
+    if (!entry)
+        return 0;
+
+    start = now_ns();
+    if (fd >= 0)
+        ret = fsetxattr(fd, XATTR_NAME_SELINUX, entry->value, entry->len, 0);
+    else
+        ret = lsetxattr(path, XATTR_NAME_SELINUX, entry->value, entry->len,
+                        0);
+    __sync_fetch_and_add(&table->set_ns, now_ns() - start);
+
+    return ret;
+}
+
+/**
+ * Write a context to an open file
+ *
+ * @param table Context table
+ * @param fd Open file
+ * @param id Context id
+ *
+ * @return 0 on success, negative value on error
+ */
+int con_set_fd(struct con_table *table, int fd, uint32_t id)
+{
+    return con_set(table, fd, NULL, id);
+}
+
+/**
+ * Write a context to a path, not following symbolic links
+ *
+ * @param table Context table
+ * @param path Path
+ * @param id Context id
+ *
+ * @return 0 on success, negative value on error
+ */
+int con_set_path(struct con_table *table, const char *path, uint32_t id)
+{
+    return con_set(table, -1, path, id);
+}
@@ -0,0 +1,793 @@
+/**
+ * @file   copy_strategy.c
+ * @author Catalin Ionita <catalin.ionita@intel.com>
+ * @date   Fri Oct 16 11:20:41 2026
+ *
+ * @brief
+ * Data copy backends (copy_file_range, splice, sendfile, mmap, read/write)
+ * and a probe that selects the fastest one for a source/destination pair
+ *
+ */
+
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <efs/efs.h>
+#include <efs/file_utils.h>
+#include <efs/copy_strategy.h>
+
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+static const char *cache_names[COPY_CACHE_MAX] = {
+    "keep",
+    "drop",
+    "direct",
+};
+
+/**
+ * Compute the size of the next chunk to copy
+ *
+ * @param job Copy job
+ * @param max Maximum chunk size
+ *
+ * @return Number of bytes to request, 0 if the job end was reached
+ */
+static size_t next_chunk(struct copy_job *job, size_t max)
+{
+    if (job->end < 0)
+        return max;
+    if (job->pos >= job->end)
+        return 0;
+    if (job->end - job->pos < (off64_t)max)
+        return job->end - job->pos;
+
+    return max;
+}
+
+/**
+ * Account bytes written to the destination
+ *
+ * @param job Copy job
+ * @param n Number of bytes
+ */
+static void job_advance(struct copy_job *job, off64_t n)
+{
+    job->pos += n;
+    if (job->progress)
+        job->progress(n, job->arg);
+}
+
+/**
+ * Write a whole buffer at a given offset
+ *
+ * @param fd File descriptor
+ * @param buf Buffer
+ * @param len Buffer length
+ * @param off File offset
+ *
+ * @return 0 on success, negative errno on error
+ */
+static int write_all(int fd, const char *buf, size_t len, off64_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite64(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (n == 0)
+            return -EIO;
+        buf += n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Classic read/write loop; works for any pair of files
+ *
+ * @param job Copy job
+ *
+ * @return 0 on success, negative errno on error
+ */
+static int copy_rw(struct copy_job *job)
+{
+    ssize_t n;
+    size_t len, want;
+    int flags, ret;
+
+    if (!job->buffer || !job->buffer_size)
+        return -EINVAL;
+
+    while ((len = next_chunk(job, job->buffer_size)) > 0) {
+        want = len;
+        /* O_DIRECT needs whole blocks; the read still stops at EOF */
+        if (job->direct)
+            want = (len + DIRECT_IO_ALIGN - 1) & ~(DIRECT_IO_ALIGN - 1);
+        n = pread64(job->fd_src, job->buffer, want, job->pos);
+        if (n < 0 && errno == EINVAL && job->direct) {
+            /* Unaligned offset or unsupported here, use the page cache */
+            flags = fcntl(job->fd_src, F_GETFL);
+            if (flags < 0 ||
+                fcntl(job->fd_src, F_SETFL, flags & ~O_DIRECT) < 0)
+                return -errno;
+            job->direct = 0;
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("Error reading from file\n");
+            return -errno;
+        }
+        if (n == 0)
+            break;
+        if ((size_t)n > len)
+            n = len;
+
+        ret = write_all(job->fd_dst, job->buffer, n, job->pos);
+        if (ret < 0)
+            return ret;
+        job_advance(job, n);
+    }
+
+    return 0;
+}
+
+/**
+ * In-kernel copy with copy_file_range(2)
+ *
+ * @param job Copy job
+ *
+ * @return 0 on success, negative errno on error
+ */
+static int copy_range(struct copy_job *job)
+{
+#ifdef __NR_copy_file_range
+    off64_t off_in, off_out;
+    ssize_t n;
+    size_t len;
+
+    while ((len = next_chunk(job, COPY_CHUNK_SIZE)) > 0) {
+        off_in = off_out = job->pos;
+        n = syscall(__NR_copy_file_range, job->fd_src, &off_in,
+                job->fd_dst, &off_out, len, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (n == 0)
+            break;
+        job_advance(job, n);
+    }
+
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+/**
+ * Zero-copy transfer through a pipe with splice(2)
+ *
+ * @param job Copy job
+ *
+ * @return 0 on success, negative errno on error
+ */
+static int copy_splice(struct copy_job *job)
+{
+    int pipefd[2], ret = 0;
+    off64_t off_in, off_out;
+    ssize_t n, m;
+    size_t len;
+
+    if (pipe(pipefd) < 0)
+        return -errno;
+#ifdef F_SETPIPE_SZ
+    /* Best effort; the default pipe only holds 64 KB */
+    fcntl(pipefd[1], F_SETPIPE_SZ, COPY_CHUNK_SIZE);
+#endif
+
+    while ((len = next_chunk(job, COPY_CHUNK_SIZE)) > 0) {
+        off_in = job->pos;
+        n = splice(job->fd_src, &off_in, pipefd[1], NULL, len,
+               SPLICE_F_MOVE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = -errno;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        /* Drain the pipe; the job position only follows written data */
+        while (n > 0) {
+            off_out = job->pos;
+            m = splice(pipefd[0], NULL, job->fd_dst, &off_out, n,
+                   SPLICE_F_MOVE);
+            if (m < 0) {
+                if (errno == EINTR)
+                    continue;
+                ret = -errno;
+                goto out;
+            }
+            if (m == 0) {
+                ret = -EIO;
+                goto out;
+            }
+            job_advance(job, m);
+            n -= m;
+        }
+    }
+
+out:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return ret;
+}
+
+/**
+ * In-kernel copy with sendfile(2)
+ *
+ * @param job Copy job
+ *
+ * @return 0 on success, negative errno on error
+ */
+static int copy_sendfile(struct copy_job *job)
+{
+    off_t off;
+    ssize_t n;
+    size_t len;
+
+    /* sendfile writes at the current destination offset */
+    if (lseek64(job->fd_dst, job->pos, SEEK_SET) < 0)
+        return -errno;
+
+    while ((len = next_chunk(job, COPY_CHUNK_SIZE)) > 0) {
+        off = job->pos;
+        if (off != job->pos)
+            return -EOVERFLOW;
+        n = sendfile(job->fd_dst, job->fd_src, &off, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (n == 0)
+            break;
+        job_advance(job, n);
+    }
+
+    return 0;
+}
+
+/**
+ * Map the source in windows and write them to the destination
+ *
+ * @param job Copy job
+ *
+ * @return 0 on success, negative errno on error
+ */
+static int copy_mmap(struct copy_job *job)
+{
+    struct stat st;
+    off64_t end, map_off;
+    size_t map_len, delta;
+    long page = sysconf(_SC_PAGESIZE);
+    char *map;
+    int ret;
+
+    if (fstat(job->fd_src, &st) < 0)
+        return -errno;
+
+    end = st.st_size;
+    if (job->end >= 0 && job->end < end)
+        end = job->end;
+
+    while (job->pos < end) {
+        map_off = job->pos & ~((off64_t) page - 1);
+        delta = job->pos - map_off;
+        map_len = end - map_off;
+        if (map_len > MMAP_WINDOW_SIZE)
+            map_len = MMAP_WINDOW_SIZE;
+
+        map = mmap64(NULL, map_len, PROT_READ, MAP_SHARED, job->fd_src,
+                 map_off);
+        if (map == MAP_FAILED)
+            return -errno;
+        madvise(map, map_len, MADV_SEQUENTIAL);
+
+        ret = write_all(job->fd_dst, map + delta, map_len - delta,
+                job->pos);
+        munmap(map, map_len);
+        if (ret < 0)
+            return ret;
+        job_advance(job, map_len - delta);
+    }
+
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*copy) (struct copy_job * job);
+} backends[COPY_METHOD_MAX] = {
+    [COPY_METHOD_AUTO] = {"auto", NULL},
+    [COPY_METHOD_RANGE] = {"copy_file_range", copy_range},
+    [COPY_METHOD_SPLICE] = {"splice", copy_splice},
+    [COPY_METHOD_SENDFILE] = {"sendfile", copy_sendfile},
+    [COPY_METHOD_MMAP] = {"mmap", copy_mmap},
+    [COPY_METHOD_RW] = {"rw", copy_rw},
+};
+
+/**
+ * Errors meaning that a backend does not support this pair of files
+ *
+ * @param error Negative errno
+ *
+ * @return 1 if the copy can be retried with another backend, 0 otherwise
+ */
+static int is_fallback_error(int error)
+{
+    switch (-error) {
+    case EXDEV:
+    case EINVAL:
+    case ENOSYS:
+    case EOPNOTSUPP:
+    case ENODEV:
+    case EOVERFLOW:
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Round a copy buffer size to whole ecryptfs extents and pages
+ * Writes smaller than an extent force ecryptfs to encrypt partial pages
+ *
+ * @param size Requested size in bytes, 0 for the default size
+ *
+ * @return Buffer size between MIN_COPY_BUFFER_SIZE and MAX_COPY_BUFFER_SIZE
+ */
+size_t align_buffer_size(size_t size)
+{
+    size_t unit = sysconf(_SC_PAGESIZE);
+
+    if (unit < ECRYPTFS_EXTENT_SIZE)
+        unit = ECRYPTFS_EXTENT_SIZE;
+
+    if (size == 0)
+        size = DEFAULT_COPY_BUFFER_SIZE;
+    if (size < MIN_COPY_BUFFER_SIZE)
+        size = MIN_COPY_BUFFER_SIZE;
+    if (size > MAX_COPY_BUFFER_SIZE)
+        size = MAX_COPY_BUFFER_SIZE;
+
+    return (size + unit - 1) / unit * unit;
+}
+
+/**
+ * Initialize a pool of per-worker copy buffers
+ *
+ * @param pool Buffer pool
+ * @param size Buffer size, rounded with align_buffer_size
+ */
+void buffer_pool_init(struct buffer_pool *pool, size_t size)
+{
+    memset(pool, 0, sizeof(struct buffer_pool));
+    pool->size = align_buffer_size(size);
+}
+
+/**
+ * Get the buffer owned by a worker, allocating it on first use
+ * Only the owner worker may call this for a given index
+ *
+ * @param pool Buffer pool
+ * @param worker Worker index
+ *
+ * @return Page aligned buffer or NULL on error
+ */
+char *buffer_pool_get(struct buffer_pool *pool, int worker)
+{
+    void *buffer;
+    int ret;
+
+    if (worker < 0 || worker >= MAX_WORKERS)
+        return NULL;
+
+    if (!pool->buffers[worker]) {
+        ret = posix_memalign(&buffer, sysconf(_SC_PAGESIZE), pool->size);
+        if (ret != 0) {
+            LOGE("insufficient memory\n");
+            return NULL;
+        }
+        pool->buffers[worker] = buffer;
+    }
+
+    return pool->buffers[worker];
+}
+
+/**
+ * Free all buffers of a pool
+ *
+ * @param pool Buffer pool
+ */
+void buffer_pool_destroy(struct buffer_pool *pool)
+{
+    int i;
+
+    for (i = 0; i < MAX_WORKERS; i++) {
+        free(pool->buffers[i]);
+        pool->buffers[i] = NULL;
+    }
+}
+
+/**
+ * Run the selected method on a dense range
+ * If the kernel refuses the method for this file, the copy continues
+ * from the current position with the read/write loop
+ *
+ * @param method Copy method
+ * @param job Copy job
+ *
+ * @return 0 on success, negative errno on error
+ */
+static int copy_backend(int method, struct copy_job *job)
+{
+    int ret;
+
+    ret = backends[method].copy(job);
+    if (ret < 0 && method != COPY_METHOD_RW && is_fallback_error(ret))
+        ret = copy_rw(job);
+
+    return ret;
+}
+
+/**
+ * Release the page cache of a finished range
+ * Source pages are clean and dropped at once. Destination pages are
+ * dirty: writeback of the range is started, and the previous range,
+ * started one window ago, is waited for and dropped, so the copy rarely
+ * stalls on its own writes
+ *
+ * @param job Copy job
+ * @param start Range start
+ * @param end Range end
+ */
+static void release_range(struct copy_job *job, off64_t start, off64_t end)
+{
+    if (!job->direct)
+        posix_fadvise64(job->fd_src, start, end - start,
+                        POSIX_FADV_DONTNEED);
+
+    /* Small files are left to the normal writeback */
+    if (job->released == start && end - start < CACHE_WINDOW_SIZE)
+        return;
+
+    if (job->released < start) {
+        sync_file_range(job->fd_dst, job->released, start - job->released,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise64(job->fd_dst, job->released, start - job->released,
+                        POSIX_FADV_DONTNEED);
+        job->released = start;
+    }
+    sync_file_range(job->fd_dst, start, end - start, SYNC_FILE_RANGE_WRITE);
+}
+
+/**
+ * Copy a dense range with the selected method
+ * Unless the page cache is kept, the range is copied window by window
+ * and every finished window is released
+ *
+ * @param method Copy method
+ * @param job Copy job
+ *
+ * @return 0 on success, negative errno on error
+ */
+static int copy_dense(int method, struct copy_job *job)
+{
+    off64_t end = job->end, start;
+    int ret;
+
+    if (job->cache == COPY_CACHE_KEEP)
+        return copy_backend(method, job);
+
+    do {
+        start = job->pos;
+        job->end = start + CACHE_WINDOW_SIZE;
+        if (end >= 0 && end < job->end)
+            job->end = end;
+
+        ret = copy_backend(method, job);
+        job->end = end;
+        if (ret < 0)
+            return ret;
+        /* End of file */
+        if (job->pos == start)
+            break;
+
+        release_range(job, start, job->pos);
+    } while (end < 0 || job->pos < end);
+
+    return 0;
+}
+
+/**
+ * Copy only the data extents of a sparse file
+ * Holes are skipped; the caller sets the final destination size so
+ * they are recreated
+ *
+ * @param method Copy method
+ * @param job Copy job
+ *
+ * @return 0 on success, negative errno on error
+ */
+static int copy_extents(int method, struct copy_job *job)
+{
+    off64_t end = job->end, data, hole;
+    struct stat st;
+    int ret = 0;
+
+    if (end < 0) {
+        if (fstat(job->fd_src, &st) < 0)
+            return -errno;
+        end = st.st_size;
+    }
+
+    while (job->pos < end) {
+        data = lseek64(job->fd_src, job->pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            /* Only a hole is left, up to the end of the file */
+            if (fstat(job->fd_src, &st) < 0)
+                return -errno;
+            if (st.st_size < end)
+                end = st.st_size;
+            data = end;
+        } else if (data < 0) {
+            /* SEEK_DATA not supported here, copy everything */
+            if (is_fallback_error(-errno))
+                break;
+            return -errno;
+        }
+        if (data > end)
+            data = end;
+
+        if (data > job->pos) {
+            job->skipped += data - job->pos;
+            if (job->progress)
+                job->progress(data - job->pos, job->arg);
+            job->pos = data;
+        }
+        if (data == end)
+            break;
+
+        hole = lseek64(job->fd_src, data, SEEK_HOLE);
+        if (hole < 0 || hole > end)
+            hole = end;
+
+        job->end = hole;
+        ret = copy_dense(method, job);
+        job->end = end;
+        if (ret < 0)
+            break;
+    }
+
+    /* Anything left after a SEEK_DATA failure is copied densely */
+    if (ret == 0 && job->pos < end)
+        ret = copy_dense(method, job);
+
+    return ret;
+}
+
+/**
+ * Copy data between two open files
+ *
+ * @param method Copy method
+ * @param job Copy job
+ *
+ * @return 0 on success, negative errno on error
+ */
+int copy_data(int method, struct copy_job *job)
+{
+    off64_t end = job->end;
+    int ret;
+
+    if (method <= COPY_METHOD_AUTO || method >= COPY_METHOD_MAX)
+        method = COPY_METHOD_RW;
+    /* Only the read/write loop uses an aligned buffer */
+    if (job->direct)
+        method = COPY_METHOD_RW;
+    job->released = job->pos;
+
+    if (!job->sparse)
+        return copy_dense(method, job);
+
+    ret = copy_extents(method, job);
+    job->end = end;
+    return ret;
+}
+
+/**
+ * Time every copy method on a sample file and pick the fastest one
+ * mmap is left out: user data may shrink while it is copied, and a
+ * mapping past the new end kills the process
+ * The sample is written to a temporary file in the destination directory
+ * and synced, so the cost of the destination filesystem is included
+ *
+ * @param fd_src Sample file from the source tree
+ * @param dst_dirfd Destination directory
+ *
+ * @return Fastest working copy method
+ */
+int probe_copy_method(int fd_src, int dst_dirfd)
+{
+    struct copy_job job;
+    struct timespec start, stop;
+    long long elapsed, best_time = -1;
+    int method, best = COPY_METHOD_RW;
+    int fd_dst, ret;
+    struct buffer_pool buffers;
+
+    buffer_pool_init(&buffers, DEFAULT_COPY_BUFFER_SIZE);
+    if (!buffer_pool_get(&buffers, 0))
+        return best;
+
+    for (method = COPY_METHOD_AUTO; method < COPY_METHOD_MAX; method++) {
+        /* A source truncated while mapped raises SIGBUS; only on demand */
+        if (method == COPY_METHOD_MMAP)
+            continue;
+
+        fd_dst = openat(dst_dirfd, PROBE_FILE_NAME,
+                        O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd_dst < 0) {
+            LOGE("open %s failed\n", PROBE_FILE_NAME);
+            break;
+        }
+
+        memset(&job, 0, sizeof(job));
+        job.fd_src = fd_src;
+        job.fd_dst = fd_dst;
+        job.end = PROBE_SIZE;
+        job.buffer = buffer_pool_get(&buffers, 0);
+        job.buffer_size = buffers.size;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        /* The first pass only brings the sample into the page cache */
+        if (method == COPY_METHOD_AUTO)
+            ret = copy_rw(&job);
+        else
+            ret = backends[method].copy(&job);
+        if (ret == 0 && fsync(fd_dst) < 0)
+            ret = -errno;
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        close(fd_dst);
+
+        if (method == COPY_METHOD_AUTO)
+            continue;
+        if (ret < 0) {
+            LOGI("Copy method %s unavailable (%s)",
+                 backends[method].name, strerror(-ret));
+            continue;
+        }
+
+        elapsed = (stop.tv_sec - start.tv_sec) * 1000000000LL +
+            (stop.tv_nsec - start.tv_nsec);
+        LOGI("Copy method %s: %lld bytes in %lld us",
+             backends[method].name, (long long)job.pos, elapsed / 1000);
+        if (best_time < 0 || elapsed < best_time) {
+            best_time = elapsed;
+            best = method;
+        }
+    }
+
+    unlinkat(dst_dirfd, PROBE_FILE_NAME, 0);
+    buffer_pool_destroy(&buffers);
+
+    LOGI("Copy method %s selected", backends[best].name);
+    return best;
+}
+
+/**
+ * Convert a copy method name to its value
+ *
+ * @param name Method name
+ *
+ * @return Copy method, negative value if the name is unknown
+ */
+int copy_method_from_name(const char *name)
+{
+    int method;
+
+    for (method = COPY_METHOD_AUTO; method < COPY_METHOD_MAX; method++)
+        if (!strcmp(name, backends[method].name))
+            return method;
+
+    return -1;
+}
+
+/**
+ * Get the name of a copy method
+ *
+ * @param method Copy method
+ *
+ * @return Method name
+ */
+const char *copy_method_name(int method)
+{
+    if (method < COPY_METHOD_AUTO || method >= COPY_METHOD_MAX)
+        return "unknown";
+
+    return backends[method].name;
+}
+
+/**
+ * Convert a page cache policy name to its value
+ *
+ * @param name Policy name
+ *
+ * @return Cache policy, negative value if the name is unknown
+ */
+int copy_cache_from_name(const char *name)
+{
+    int cache;
+
+    for (cache = COPY_CACHE_KEEP; cache < COPY_CACHE_MAX; cache++)
+        if (!strcmp(name, cache_names[cache]))
+            return cache;
+
+    return -1;
+}
+
+/**
+ * Get the name of a page cache policy
+ *
+ * @param cache Cache policy
+ *
+ * @return Policy name
+ */
+const char *copy_cache_name(int cache)
+{
+    if (cache < COPY_CACHE_KEEP || cache >= COPY_CACHE_MAX)
+        return "unknown";
+
+    return cache_names[cache];
+}
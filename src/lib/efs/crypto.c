@@ -28,30 +28,466 @@
 
 #include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <openssl/crypto.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/properties.h>
 #include <efs/efs.h>
 #include <efs/file_utils.h>
 #include <efs/key_chain.h>
 #include <efs/key_store.h>
 #include <efs/crypto.h>
+#include <efs/work_queue.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_SCRYPT)
+#define HAVE_SCRYPT
+#endif
+
+/* Values of KDF_PROPERTY, indexed by enum kdf_type */
+static const char *kdf_names[] = {
+    "pbkdf2-sha1",
+    "pbkdf2-sha256",
+    "pbkdf2-sha512",
+    "scrypt",
+};
+
+/* One PBKDF2 output block; blocks are independent and derived in parallel */
+struct pbkdf2_lane {
+    const SHA_CTX *inner;       /* HMAC key pads, hashed once for all */
+    const SHA_CTX *outer;
+    const unsigned char *salt;
+    unsigned int index;         /* block number, from 1 */
+    unsigned int iterations;
+    unsigned char out[SHA_DIGEST_LENGTH];
+};
+
+/**
+ * Hash the HMAC-SHA1 key pads of a password
+ *
+ * @param passwd Password
+ * @param passwd_len Password length
+ * @param inner State after the inner pad
+ * @param outer State after the outer pad
+ */
+static void hmac_sha1_pads(const char *passwd, int passwd_len,
+               SHA_CTX *inner, SHA_CTX *outer)
+{
+    unsigned char key[SHA_CBLOCK], pad[SHA_CBLOCK];
+    int i;
+
+    memset(key, 0, sizeof(key));
+    if (passwd_len > SHA_CBLOCK)
+        SHA1((const unsigned char *)passwd, passwd_len, key);
+    else
+        memcpy(key, passwd, passwd_len);
+
+    for (i = 0; i < SHA_CBLOCK; i++)
+        pad[i] = key[i] ^ 0x36;
+    SHA1_Init(inner);
+    SHA1_Update(inner, pad, SHA_CBLOCK);
+
+    for (i = 0; i < SHA_CBLOCK; i++)
+        pad[i] = key[i] ^ 0x5c;
+    SHA1_Init(outer);
+    SHA1_Update(outer, pad, SHA_CBLOCK);
+
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(pad, sizeof(pad));
+}
+
+/**
+ * Finish a hash whose message is one pad block and a 20 byte digest
+ * The block already holds the SHA-1 padding, so the digest takes a
+ * single compression instead of an update and a final
+ *
+ * @param pad State after the pad block
+ * @param block Digest followed by its padding; the digest is replaced
+ */
+static void sha1_digest_block(const SHA_CTX *pad, unsigned char *block)
+{
+    SHA_CTX ctx = *pad;
+    SHA_LONG h[5];
+    int i;
+
+    SHA1_Transform(&ctx, block);
+    h[0] = ctx.h0;
+    h[1] = ctx.h1;
+    h[2] = ctx.h2;
+    h[3] = ctx.h3;
+    h[4] = ctx.h4;
+    for (i = 0; i < 5; i++) {
+        block[4 * i] = h[i] >> 24;
+        block[4 * i + 1] = h[i] >> 16;
+        block[4 * i + 2] = h[i] >> 8;
+        block[4 * i + 3] = h[i];
+    }
+    OPENSSL_cleanse(&ctx, sizeof(ctx));
+}
+
+/**
+ * Derive one output block: the XOR of the whole HMAC chain
+ *
+ * @param arg PBKDF2 lane
+ *
+ * @return NULL
+ */
+static void *pbkdf2_block(void *arg)
+{
+    struct pbkdf2_lane *lane = arg;
+    unsigned char block[SHA_CBLOCK], count[4];
+    unsigned int i, j;
+    SHA_CTX ctx;
+
+    count[0] = lane->index >> 24;
+    count[1] = lane->index >> 16;
+    count[2] = lane->index >> 8;
+    count[3] = lane->index;
+
+    /* U1 = HMAC(passwd, salt || index) */
+    ctx = *lane->inner;
+    SHA1_Update(&ctx, lane->salt, PASSWD_SALT_LEN);
+    SHA1_Update(&ctx, count, sizeof(count));
+    SHA1_Final(block, &ctx);
+    ctx = *lane->outer;
+    SHA1_Update(&ctx, block, SHA_DIGEST_LENGTH);
+    SHA1_Final(block, &ctx);
+    memcpy(lane->out, block, SHA_DIGEST_LENGTH);
+
+    /* Pad and length of a 20 byte message after a 64 byte key block */
+    memset(block + SHA_DIGEST_LENGTH, 0, SHA_CBLOCK - SHA_DIGEST_LENGTH);
+    block[SHA_DIGEST_LENGTH] = 0x80;
+    block[SHA_CBLOCK - 2] = ((SHA_CBLOCK + SHA_DIGEST_LENGTH) * 8) >> 8;
+    block[SHA_CBLOCK - 1] = ((SHA_CBLOCK + SHA_DIGEST_LENGTH) * 8) & 0xff;
+
+    for (i = 1; i < lane->iterations; i++) {
+        sha1_digest_block(lane->inner, block);
+        sha1_digest_block(lane->outer, block);
+        for (j = 0; j < SHA_DIGEST_LENGTH; j++)
+            lane->out[j] ^= block[j];
+    }
+
+    OPENSSL_cleanse(block, sizeof(block));
+    OPENSSL_cleanse(&ctx, sizeof(ctx));
+    return NULL;
+}
 
 /**
  * Password-Based Key Derivation Function 2
+ * PBKDF2-HMAC-SHA1 as PKCS5_PBKDF2_HMAC_SHA1 computes it; the output
+ * blocks are independent, so each one is derived by its own thread
  *
  * @param passwd Password
  * @param passwd_len Password length
  * @param salt Salt
  * @param key Key resulted after derivation
  * @param key_len Key length
+ * @param iterations Iteration count
  */
 void pbkdf2(char *passwd, int passwd_len, unsigned char *salt,
-        unsigned char *key, unsigned int key_len)
+        unsigned char *key, unsigned int key_len, unsigned int iterations)
 {
-    PKCS5_PBKDF2_HMAC_SHA1(passwd, passwd_len, salt, PASSWD_SALT_LEN,
-                   PBKDF2_ITERATIONS, key_len, key);
+    struct pbkdf2_lane lanes[PBKDF2_MAX_LANES];
+    pthread_t threads[PBKDF2_MAX_LANES];
+    int started[PBKDF2_MAX_LANES];
+    SHA_CTX inner, outer;
+    unsigned int nr, i, n, done = 0;
+    int parallel = get_nr_cpus() > 1;
+
+    hmac_sha1_pads(passwd, passwd_len, &inner, &outer);
+
+    while (done < key_len) {
+        nr = (key_len - done + SHA_DIGEST_LENGTH - 1) / SHA_DIGEST_LENGTH;
+        if (nr > PBKDF2_MAX_LANES)
+            nr = PBKDF2_MAX_LANES;
+
+        for (i = 0; i < nr; i++) {
+            lanes[i].inner = &inner;
+            lanes[i].outer = &outer;
+            lanes[i].salt = salt;
+            lanes[i].index = done / SHA_DIGEST_LENGTH + i + 1;
+            lanes[i].iterations = iterations;
+            /* The caller derives the first block itself */
+            started[i] = parallel && i > 0 &&
+                pthread_create(&threads[i], NULL, pbkdf2_block,
+                               &lanes[i]) == 0;
+        }
+
+        for (i = 0; i < nr; i++) {
+            if (started[i])
+                pthread_join(threads[i], NULL);
+            else
+                pbkdf2_block(&lanes[i]);
+
+            n = key_len - done < SHA_DIGEST_LENGTH ?
+                key_len - done : SHA_DIGEST_LENGTH;
+            memcpy(key + done, lanes[i].out, n);
+            done += n;
+        }
+    }
+
+    OPENSSL_cleanse(lanes, sizeof(lanes));
+    OPENSSL_cleanse(&inner, sizeof(inner));
+    OPENSSL_cleanse(&outer, sizeof(outer));
+}
+
+/**
+ * Derive a key from a password with the KDF of a storage
+ *
+ * @param kdf KDF parameters
+ * @param passwd Password
+ * @param passwd_len Password length
+ * @param salt Salt of PASSWD_SALT_LEN bytes
+ * @param key Key resulted after derivation
+ * @param key_len Key length
+ *
+ * @return 0 on success, negative value on error
+ */
+int kdf_derive(const struct kdf_params *kdf, char *passwd, int passwd_len,
+               unsigned char *salt, unsigned char *key, unsigned int key_len)
+{
+    const EVP_MD *md = NULL;
+
+    switch (kdf->type) {
+    case KDF_PBKDF2_SHA1:
+        if (kdf->cost == 0 || kdf->cost > KDF_MAX_ITERATIONS)
+            break;
+        pbkdf2(passwd, passwd_len, salt, key, key_len, kdf->cost);
+        return 0;
+    case KDF_PBKDF2_SHA256:
+        md = EVP_sha256();
+        /* fall through */
+    case KDF_PBKDF2_SHA512:
+        if (!md)
+            md = EVP_sha512();
+        if (kdf->cost == 0 || kdf->cost > KDF_MAX_ITERATIONS)
+            break;
+        if (PKCS5_PBKDF2_HMAC(passwd, passwd_len, salt, PASSWD_SALT_LEN,
+                              kdf->cost, md, key_len, key) != 1)
+            break;
+        return 0;
+    case KDF_SCRYPT:
+#ifdef HAVE_SCRYPT
+        if (kdf->cost == 0 || kdf->cost > KDF_SCRYPT_MAX_LOG_N ||
+            kdf->r == 0 || kdf->r > 4 * KDF_SCRYPT_R ||
+            kdf->p == 0 || kdf->p > 4 * KDF_SCRYPT_P)
+            break;
+        if (EVP_PBE_scrypt(passwd, passwd_len, salt, PASSWD_SALT_LEN,
+                           1ULL << kdf->cost, kdf->r, kdf->p,
+                           256ULL * kdf->r * ((1ULL << kdf->cost) + kdf->p),
+                           key, key_len) != 1)
+            break;
+        return 0;
+#else
+        LOGE("scrypt is not supported by this OpenSSL");
+        return -1;
+#endif
+    }
+
+    LOGE("Invalid KDF %u, cost %u", kdf->type, kdf->cost);
+    return -1;
+}
+
+/**
+ * Time one derivation with the given parameters
+ *
+ * @param kdf KDF parameters
+ *
+ * @return elapsed ms, negative value on error
+ */
+static double kdf_time_ms(const struct kdf_params *kdf)
+{
+    unsigned char salt[PASSWD_SALT_LEN];
+    unsigned char key[2 * ECRYPTFS_KEY_LEN];
+    char passwd[] = "calibration";
+    struct timespec start, stop;
+    int ret;
+
+    memset(salt, 0, sizeof(salt));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = kdf_derive(kdf, passwd, strlen(passwd), salt, key, sizeof(key));
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (ret < 0)
+        return -1;
+
+    return (stop.tv_sec - start.tv_sec) * 1000.0 +
+        (stop.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+/**
+ * Choose the KDF cost that takes about target_ms on this device
+ * A short run is timed and scaled, so calibration itself stays cheap
+ *
+ * @param kdf Calibrated parameters
+ * @param type enum kdf_type
+ * @param target_ms Time of one derivation
+ *
+ * @return 0 on success, negative value on error
+ */
+int kdf_calibrate(struct kdf_params *kdf, int type, int target_ms)
+{
+    double ms, cost;
+
+    memset(kdf, 0, sizeof(struct kdf_params));
+    kdf->type = type;
+
+    if (type == KDF_SCRYPT) {
+        kdf->cost = KDF_SCRYPT_MIN_LOG_N;
+        kdf->r = KDF_SCRYPT_R;
+        kdf->p = KDF_SCRYPT_P;
+        ms = kdf_time_ms(kdf);
+        if (ms < 0)
+            return -1;
+        /* Time and memory double with each step of N */
+        while (kdf->cost < KDF_SCRYPT_MAX_LOG_N && 2 * ms <= target_ms) {
+            kdf->cost++;
+            ms *= 2;
+        }
+        LOGI("KDF scrypt calibrated to N=2^%u, about %.0f ms", kdf->cost, ms);
+        return 0;
+    }
+
+    /* Long enough for the clock, short enough to not be noticed */
+    kdf->cost = KDF_MIN_ITERATIONS / 10;
+    for (;;) {
+        ms = kdf_time_ms(kdf);
+        if (ms < 0)
+            return -1;
+        if (ms >= KDF_CALIBRATION_MS || kdf->cost >= KDF_MAX_ITERATIONS)
+            break;
+        kdf->cost *= 2;
+    }
+
+    cost = kdf->cost * target_ms / ms;
+    if (cost < KDF_MIN_ITERATIONS)
+        cost = KDF_MIN_ITERATIONS;
+    if (cost > KDF_MAX_ITERATIONS)
+        cost = KDF_MAX_ITERATIONS;
+    kdf->cost = cost;
+
+    LOGI("KDF %d calibrated to %u iterations", type, kdf->cost);
+    return 0;
+}
+
+/**
+ * Get the KDF parameters of new crypto headers
+ * Calibration runs once per process and is reused while the properties
+ * are unchanged
+ *
+ * @param kdf KDF parameters
+ *
+ * @return 0 on success, negative value on error
+ */
+int get_kdf_params(struct kdf_params *kdf)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static struct kdf_params calibrated;
+    static int calibrated_ms;
+    char buff[PROPERTY_VALUE_MAX];
+    int type, target_ms, ret = 0;
+
+    memset(buff, 0, sizeof(buff));
+    property_get(KDF_PROPERTY, buff, KDF_DEFAULT);
+    for (type = 0; type < (int)(sizeof(kdf_names) / sizeof(kdf_names[0]));
+         type++)
+        if (strcmp(buff, kdf_names[type]) == 0)
+            break;
+    if (type == sizeof(kdf_names) / sizeof(kdf_names[0])) {
+        LOGE("Unknown KDF %s, using %s", buff, KDF_DEFAULT);
+        type = KDF_PBKDF2_SHA512;
+    }
+#ifndef HAVE_SCRYPT
+    if (type == KDF_SCRYPT) {
+        LOGE("scrypt is not supported, using %s", KDF_DEFAULT);
+        type = KDF_PBKDF2_SHA512;
+    }
+#endif
+
+    memset(buff, 0, sizeof(buff));
+    property_get(KDF_TARGET_PROPERTY, buff, "");
+    target_ms = atoi(buff);
+    if (target_ms <= 0)
+        target_ms = KDF_TARGET_MS;
+
+    pthread_mutex_lock(&lock);
+    if (calibrated_ms != target_ms || (int)calibrated.type != type) {
+        ret = kdf_calibrate(&calibrated, type, target_ms);
+        calibrated_ms = ret < 0 ? 0 : target_ms;
+    }
+    memcpy(kdf, &calibrated, sizeof(struct kdf_params));
+    pthread_mutex_unlock(&lock);
+
+    return ret;
+}
+
+/**
+ * Start a key context for one user operation
+ *
+ * @param ctx Key context, released with key_ctx_clear
+ * @param passwd Password; must outlive the context
+ */
+void key_ctx_init(struct key_ctx *ctx, char *passwd)
+{
+    memset(ctx, 0, sizeof(struct key_ctx));
+    ctx->passwd = passwd;
+}
+
+/**
+ * Get the key and IV derived from the context password and a salt
+ * The KDF only runs the first time a salt and its parameters are seen
+ *
+ * @param ctx Key context
+ * @param salt Salt of PASSWD_SALT_LEN bytes
+ * @param kdf KDF parameters stored with the salt
+ *
+ * @return 2 * ECRYPTFS_KEY_LEN bytes owned by the context, NULL on error
+ */
+unsigned char *key_ctx_derive(struct key_ctx *ctx, unsigned char *salt,
+                              const struct kdf_params *kdf)
+{
+    unsigned char key[2 * ECRYPTFS_KEY_LEN];
+    int i;
+
+    for (i = 0; i < ctx->nr_keys; i++)
+        if (memcmp(ctx->salt[i], salt, PASSWD_SALT_LEN) == 0 &&
+            memcmp(&ctx->kdf[i], kdf, sizeof(struct kdf_params)) == 0)
+            return ctx->key[i];
+
+    if (kdf_derive(kdf, ctx->passwd, strlen(ctx->passwd), salt, key,
+                   sizeof(key)) < 0)
+        return NULL;
+
+    if (ctx->nr_keys < KEY_CTX_SLOTS) {
+        i = ctx->nr_keys++;
+    } else {
+        i = ctx->next;
+        ctx->next = (ctx->next + 1) % KEY_CTX_SLOTS;
+    }
+
+    memcpy(ctx->salt[i], salt, PASSWD_SALT_LEN);
+    memcpy(&ctx->kdf[i], kdf, sizeof(struct kdf_params));
+    memcpy(ctx->key[i], key, sizeof(key));
+    OPENSSL_cleanse(key, sizeof(key));
+
+    return ctx->key[i];
+}
+
+/**
+ * Wipe the keys derived by a context
+ *
+ * @param ctx Key context
+ */
+void key_ctx_clear(struct key_ctx *ctx)
+{
+    OPENSSL_cleanse(ctx, sizeof(struct key_ctx));
 }
 
 /**
@@ -196,7 +632,8 @@ int generate_crypto_header(struct crypto_header *header, int user)
 
     close(fd);
 
-    return 0;
+    /* The password key is derived with the KDF calibrated for this device */
+    return get_kdf_params(&header->kdf);
 }
 
 /**
@@ -302,36 +739,243 @@ int decrypt_crypto_header(struct crypto_header *header,
 }
 
 /**
- * Write crypto material into a file
+ * Replace a file atomically
+ * The data goes to a temporary file that is synced and renamed over the
+ * old one, so a power loss leaves either the old or the new content
  *
- * @param header Structure to hold crypto material
  * @param path File path
+ * @param data Content
+ * @param len Content length
  *
  * @return 0 on success, negative value on error
  */
-int write_crypto_header(struct crypto_header *header, char *path)
+static int write_file_atomic(const char *path, const void *data, size_t len)
 {
-    int fd, n;
+    char tmp_path[MAX_PATH_LENGTH];
+    char *slash;
+    ssize_t n;
+    int fd;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+        (int)sizeof(tmp_path))
+        return -1;
 
-    fd = open(path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
-        LOGE("Can't write crypto header");
+        LOGE("Can't create %s", tmp_path);
         return fd;
     }
 
-    n = write(fd, header, sizeof(struct crypto_header));
-    if (n != sizeof(struct crypto_header)) {
-        LOGE("Can't write crypto header");
+    n = write(fd, data, len);
+    if (n != (ssize_t)len || fsync(fd) < 0) {
+        LOGE("Can't write %s", tmp_path);
         close(fd);
+        unlink(tmp_path);
         return -1;
     }
+    close(fd);
+
+    if (rename(tmp_path, path) < 0) {
+        LOGE("Can't rename %s: %s", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    /* The rename itself is only durable once the directory is synced */
+    slash = strrchr(tmp_path, '/');
+    if (slash) {
+        *(slash + 1) = '\0';
+        fd = open(tmp_path, O_RDONLY | O_DIRECTORY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Get the status record path of a key file
+ *
+ * @param status_path Status record path
+ * @param path Key file path
+ *
+ * @return 0 on success, negative value on error
+ */
+static int get_status_path(char *status_path, const char *path)
+{
+    if (snprintf(status_path, MAX_PATH_LENGTH, "%s%s", path,
+                 STORAGE_STATUS_SUFFIX) >= MAX_PATH_LENGTH)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Write the encryption status of a storage
+ * One small record is replaced, the key file is not touched
+ *
+ * @param path Key file path
+ * @param status Encryption status
+ * @param progress Percent copied
+ *
+ * @return 0 on success, negative value on error
+ */
+int write_storage_status(char *path, int status, int progress)
+{
+    char status_path[MAX_PATH_LENGTH];
+    struct storage_status record;
+
+    if (get_status_path(status_path, path) < 0)
+        return -1;
+
+    memset(&record, 0, sizeof(record));
+    record.magic = STORAGE_STATUS_MAGIC;
+    record.version = STORAGE_STATUS_VERSION;
+    record.status = status;
+    record.progress = progress;
+    SHA256((unsigned char *)&record, offsetof(struct storage_status, checksum),
+           record.checksum);
+
+    return write_file_atomic(status_path, &record, sizeof(record));
+}
+
+/**
+ * Read the encryption status of a storage
+ *
+ * @param path Key file path
+ * @param status Encryption status
+ * @param progress Percent copied, may be NULL
+ *
+ * @return 0 on success, -ENOENT if the storage has no status record,
+ * other negative value on error
+ */
+int read_storage_status(char *path, int *status, int *progress)
+{
+    char status_path[MAX_PATH_LENGTH];
+    unsigned char checksum[CRYPTO_CHECKSUM_LEN];
+    struct storage_status record;
+    int fd, n;
+
+    if (get_status_path(status_path, path) < 0)
+        return -1;
+
+    fd = open(status_path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? -ENOENT : -1;
 
+    n = read(fd, &record, sizeof(record));
     close(fd);
+
+    SHA256((unsigned char *)&record, offsetof(struct storage_status, checksum),
+           checksum);
+    if (n != sizeof(record) || record.magic != STORAGE_STATUS_MAGIC ||
+        record.version != STORAGE_STATUS_VERSION ||
+        memcmp(checksum, record.checksum, CRYPTO_CHECKSUM_LEN)) {
+        LOGE("Malformed status record %s", status_path);
+        return -1;
+    }
+
+    *status = record.status;
+    if (progress)
+        *progress = record.progress;
+
+    return 0;
+}
+
+/**
+ * Remove the status record of a storage
+ *
+ * @param path Key file path
+ */
+void remove_storage_status(char *path)
+{
+    char status_path[MAX_PATH_LENGTH];
+
+    if (get_status_path(status_path, path) == 0)
+        unlink(status_path);
+}
+
+/**
+ * Write crypto material into a file
+ * The key file is written in the v2 format and replaced atomically;
+ * a v1 file carried the status, which moves to its status record
+ *
+ * @param header Structure to hold crypto material
+ * @param path File path
+ *
+ * @return 0 on success, negative value on error
+ */
+int write_crypto_header(struct crypto_header *header, char *path)
+{
+    struct crypto_header_v2 disk;
+    int ret, status;
+
+    if (read_storage_status(path, &status, NULL) == -ENOENT) {
+        ret = write_storage_status(path, header->stat, 0);
+        if (ret < 0) {
+            LOGE("Can't write status of %s", path);
+            return ret;
+        }
+    }
+
+    memset(&disk, 0, sizeof(disk));
+    disk.magic = CRYPTO_HEADER_MAGIC;
+    disk.version = CRYPTO_HEADER_VERSION;
+    disk.size = sizeof(disk);
+    memcpy(&disk.kdf, &header->kdf, sizeof(disk.kdf));
+    memcpy(disk.fefek, header->fefek, ECRYPTFS_KEY_LEN);
+    memcpy(disk.fnek, header->fnek, ECRYPTFS_KEY_LEN);
+    memcpy(disk.salt, header->salt, PASSWD_SALT_LEN);
+    memcpy(disk.username, header->username, MAX_USERNAME_LEN);
+    memcpy(disk.signature, header->signature, SHA512_DIGEST_LENGTH);
+    SHA256((unsigned char *)&disk, offsetof(struct crypto_header_v2, checksum),
+           disk.checksum);
+
+    ret = write_file_atomic(path, &disk, sizeof(disk));
+    if (ret < 0)
+        LOGE("Can't write crypto header");
+
+    OPENSSL_cleanse(&disk, sizeof(disk));
+    return ret;
+}
+
+/**
+ * Decode a v2 key file
+ *
+ * @param header Structure to hold crypto material
+ * @param disk Key file content
+ *
+ * @return 0 on success, negative value on error
+ */
+static int decode_crypto_header(struct crypto_header *header,
+                                struct crypto_header_v2 *disk)
+{
+    unsigned char checksum[CRYPTO_CHECKSUM_LEN];
+
+    SHA256((unsigned char *)disk, offsetof(struct crypto_header_v2, checksum),
+           checksum);
+    if (disk->version != CRYPTO_HEADER_VERSION || disk->size != sizeof(*disk)
+        || memcmp(checksum, disk->checksum, CRYPTO_CHECKSUM_LEN))
+        return -1;
+
+    memcpy(&header->kdf, &disk->kdf, sizeof(header->kdf));
+    memcpy(header->fefek, disk->fefek, ECRYPTFS_KEY_LEN);
+    memcpy(header->fnek, disk->fnek, ECRYPTFS_KEY_LEN);
+    memcpy(header->salt, disk->salt, PASSWD_SALT_LEN);
+    memcpy(header->username, disk->username, MAX_USERNAME_LEN);
+    memcpy(header->signature, disk->signature, SHA512_DIGEST_LENGTH);
+    /* Only used when the status record is missing */
+    header->stat = STORAGE_ENCRYPTION_NOT_STARTED;
+
     return 0;
 }
 
 /**
  * Read crypto material from a file
+ * v1 files, written before the KDF parameters were stored, are read as
+ * well
  *
  * @param header Structure to hold crypto material
  * @param path File path
@@ -340,7 +984,8 @@ int write_crypto_header(struct crypto_header *header, char *path)
  */
 int read_crypto_header(struct crypto_header *header, char *path)
 {
-    int fd, n;
+    struct crypto_header_v2 disk;
+    int fd, n, ret = 0;
 
     fd = open(path, O_RDONLY);
     if (fd < 0) {
@@ -349,34 +994,41 @@ int read_crypto_header(struct crypto_header *header, char *path)
     }
 
     memset(header, 0, sizeof(struct crypto_header));
-    n = read(fd, header, sizeof(struct crypto_header));
-    if (n != sizeof(struct crypto_header)) {
-        LOGE("Malformed crypto header");
-        close(fd);
-        return -1;
+    memset(&disk, 0, sizeof(disk));
+    n = read(fd, &disk, sizeof(disk));
+    close(fd);
+
+    if (n == sizeof(disk) && disk.magic == CRYPTO_HEADER_MAGIC) {
+        ret = decode_crypto_header(header, &disk);
+    } else if (n == CRYPTO_HEADER_V1_SIZE) {
+        memcpy(header, &disk, CRYPTO_HEADER_V1_SIZE);
+        header->kdf.type = KDF_PBKDF2_SHA1;
+        header->kdf.cost = PBKDF2_ITERATIONS;
+    } else {
+        ret = -1;
     }
 
-    close(fd);
-    return 0;
+    OPENSSL_cleanse(&disk, sizeof(disk));
+    if (ret < 0)
+        LOGE("Malformed crypto header");
+
+    return ret;
 }
 
 /**
  * Builds all crypto primitives required by an EFS
  *
  * @param storage_path EFS path
- * @param passwd EFS password
+ * @param ctx Keys of the EFS password
  *
  * @return 0 on success, negative value on error
  */
-int generate_crypt_info(char *storage_path, int user, char *passwd)
+int generate_crypt_info(char *storage_path, int user, struct key_ctx *ctx)
 {
     struct crypto_header header;
     char key_storage_path[MAX_PATH_LENGTH];
     char private_dir_path[MAX_PATH_LENGTH];
-    unsigned char buffer[2 * ECRYPTFS_KEY_LEN];
-    unsigned char *encryption_key = buffer;
-    unsigned char *IV = buffer + ECRYPTFS_KEY_LEN;
-    unsigned int passwd_len = strlen(passwd);
+    unsigned char *encryption_key, *IV;
     int ret = -1;
 
     /* Create private directory */
@@ -401,7 +1053,13 @@ int generate_crypt_info(char *storage_path, int user, char *passwd)
     /* Generate 512 bits from password; the first 256 bits
 	 * will used to protect fefek && fnek, and the rest will generate the IV
      */
-    pbkdf2(passwd, passwd_len, header.salt, buffer, 2 * ECRYPTFS_KEY_LEN);
+    encryption_key = key_ctx_derive(ctx, header.salt, &header.kdf);
+    if (!encryption_key) {
+        LOGE("Key derivation for %s failed", private_dir_path);
+        OPENSSL_cleanse(&header, sizeof(header));
+        return -1;
+    }
+    IV = encryption_key + ECRYPTFS_KEY_LEN;
     /* Encrypt fefek and fnek */
     ret = encrypt_crypto_header(&header, encryption_key, IV);
     if (ret < 0) {
@@ -417,6 +1075,13 @@ int generate_crypt_info(char *storage_path, int user, char *passwd)
         return ret;
     }
 
+    /* A status left by a removed storage must not be taken over */
+    ret = write_storage_status(key_storage_path, header.stat, 0);
+    if (ret < 0) {
+        LOGE("fail to write status to %s ", key_storage_path);
+        return ret;
+    }
+
     ret = write_crypto_header(&header, key_storage_path);
     if (ret < 0) {
         LOGE("fail to write crypto header to %s ", key_storage_path);
@@ -430,19 +1095,20 @@ int generate_crypt_info(char *storage_path, int user, char *passwd)
  * Validate a password string against a crypto header
  *
  * @param header crypto header
- * @param passwd input password
+ * @param ctx Keys of the input password
  *
  * @return 0 for success, negative value for error
  */
-int check_passwd(struct crypto_header *header, char *passwd)
+int check_passwd(struct crypto_header *header, struct key_ctx *ctx)
 {
-    int passwd_len = strlen(passwd);
-    unsigned char buffer[2 * ECRYPTFS_KEY_LEN];
-    unsigned char *encryption_key = buffer;
-    unsigned char *IV = buffer + ECRYPTFS_KEY_LEN;
+    unsigned char *encryption_key, *IV;
     unsigned char signature[SHA512_DIGEST_LENGTH];
 
-    pbkdf2(passwd, passwd_len, header->salt, buffer, 2 * ECRYPTFS_KEY_LEN);
+    /* Derived with the parameters the header was written with */
+    encryption_key = key_ctx_derive(ctx, header->salt, &header->kdf);
+    if (!encryption_key)
+        return -1;
+    IV = encryption_key + ECRYPTFS_KEY_LEN;
 
     /* Decrypt fefek, fnek and signature */
     decrypt_crypto_header(header, encryption_key, IV);
@@ -463,18 +1129,17 @@ int check_passwd(struct crypto_header *header, char *passwd)
  * Change password for a secure storage
  *
  * @param storage_path secure storage path
- * @param old_passwd old password
- * @param new_passwd new password
+ * @param old_ctx Keys of the old password
+ * @param new_ctx Keys of the new password
  *
  * @return 0 for success, negative value for error
  */
-int change_passwd(char *storage_path, char *old_passwd, char *new_passwd)
+int change_passwd(char *storage_path, struct key_ctx *old_ctx,
+                  struct key_ctx *new_ctx)
 {
     struct crypto_header header;
     char key_storage_path[MAX_PATH_LENGTH];
-    unsigned char buffer[2 * ECRYPTFS_KEY_LEN];
-    unsigned char *encryption_key = buffer, *IV = buffer + ECRYPTFS_KEY_LEN;
-    unsigned int new_passwd_len = strlen(new_passwd);
+    unsigned char *encryption_key, *IV;
     int ret = -1;
 
     ret = get_key_storage_path(key_storage_path, storage_path);
@@ -490,33 +1155,48 @@ int change_passwd(char *storage_path, char *old_passwd, char *new_passwd)
     }
 
     /* If check_passwd succeed the header will be decrypted */
-    ret = check_passwd(&header, old_passwd);
+    ret = check_passwd(&header, old_ctx);
     if (ret < 0) {
         LOGE("Wrong old passwd");
-        return ret;
+        goto out;
+    }
+
+    /* The new password gets the KDF calibrated for this device, which also
+     * upgrades headers written with older parameters
+     */
+    ret = get_kdf_params(&header.kdf);
+    if (ret < 0) {
+        LOGE("Unable to get KDF parameters");
+        goto out;
     }
 
     /* Generate 256 bits from the new password; the first 128 bits will be used
      * to protect crypto keys, and the rest will be used as IV
      */
-    pbkdf2(new_passwd, new_passwd_len, header.salt, buffer,
-           2 * ECRYPTFS_KEY_LEN);
+    encryption_key = key_ctx_derive(new_ctx, header.salt, &header.kdf);
+    if (!encryption_key) {
+        ret = -1;
+        goto out;
+    }
+    IV = encryption_key + ECRYPTFS_KEY_LEN;
 
     /* Rencrypt crypto header with the new password */
     ret = encrypt_crypto_header(&header, encryption_key, IV);
     if (ret < 0) {
         LOGE("Failed to encrypt crypto header");
-        return ret;
+        goto out;
     }
 
     /* Write header to storage */
     ret = write_crypto_header(&header, key_storage_path);
     if (ret < 0) {
         LOGE("Failed to write crypto header to %s ", key_storage_path);
-        return ret;
+        goto out;
     }
 
-    return 0;
+out:
+    OPENSSL_cleanse(&header, sizeof(header));
+    return ret < 0 ? ret : 0;
 }
 
 /* Debug function */
@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <dirent.h>
 #include <cutils/properties.h>
 #include <efs/efs.h>
@@ -40,10 +41,14 @@
 #include <efs/crypto.h>
 #include <efs/key_store.h>
 #include <efs/mount_utils.h>
+#include <efs/unlock_cache.h>
 #include <openssl/sha.h>
+#include <openssl/crypto.h>
 
 /**
  * Internal function to set EFS state
+ * The state is kept in a small record replaced atomically, so the key
+ * material is not rewritten on every transition
  *
  * @param storage_path EFS path
  * @param state State of encryption: encrypted, not encrypted, encryption in progress
@@ -54,7 +59,6 @@
 static int EFS_set_status(char *storage_path, int state)
 {
     char key_path[MAX_PATH_LENGTH];
-    struct crypto_header header;
     int ret = -1;
 
     ret = get_key_storage_path(key_path, storage_path);
@@ -63,43 +67,74 @@ static int EFS_set_status(char *storage_path, int state)
         return ret;
     }
 
-    ret = read_crypto_header(&header, key_path);
-    if (ret < 0) {
-        LOGE("Unable to read crypto header from %s", key_path);
-        return ret;
-    }
-
-    header.stat = state;
-    ret = write_crypto_header(&header, key_path);
+    ret = write_storage_status(key_path, state,
+                               state == STORAGE_ENCRYPTION_COMPLETED ? 100 : 0);
     if (ret < 0) {
-        LOGE("Unable to write crypto header to %s", key_path);
+        LOGE("Unable to write status of %s", storage_path);
         return ret;
     }
 
     return 0;
 }
 
+/* Status record kept up to date with the progress of a journaled copy */
+struct status_progress {
+        char *key_path;
+        int status;
+};
+
+/**
+ * Record the progress of a copy in the status record of its storage
+ *
+ * @param percent Progress of the copy
+ * @param arg Status to record
+ */
+static void record_progress(int percent, void *arg)
+{
+    struct status_progress *sp = arg;
+
+    if (write_storage_status(sp->key_path, sp->status, percent) < 0)
+        LOGE("Unable to record progress of %s", sp->key_path);
+}
+
+/**
+ * Check whether data is migrated file by file, removing each source as
+ * soon as its copy is on disk, instead of copied and removed at the end
+ *
+ * @return 1 if migration is enabled, 0 otherwise
+ */
+static int migrate_enabled(void)
+{
+    char buff[PROPERTY_VALUE_MAX];
+
+    memset(buff, 0, sizeof(buff));
+    property_get(MIGRATE_PROPERTY, buff, "0");
+
+    return atoi(buff) != 0;
+}
+
 /**
  * Internal function to encrypt an EFS
+ * Progress is journaled so an interrupted encryption can be resumed
  *
  * @param storage_path EFS path
  * @param passwd Passwd to protect the master key
+ * @param resume Continue an interrupted encryption instead of starting
+ * @param scan Scan of storage_path
  *
  * @return 0 on success, negative value on error
  */
-static int encrypt_storage(char *storage_path, int user, char *passwd)
+static int encrypt_storage(char *storage_path, int user, char *passwd,
+               int resume, const struct tree_scan *scan)
 {
     char private_dir_path[MAX_PATH_LENGTH];
     char key_storage_path[MAX_PATH_LENGTH];
+    char journal_path[MAX_PATH_LENGTH];
+    struct copy_options opts;
+    struct status_progress sp;
+    struct key_ctx keys;
     int ret = -1;
 
-    ret = generate_crypt_info(storage_path, user, passwd);
-    if (ret < 0) {
-        LOGE("Error generating crypto material for efs storage %s",
-             storage_path);
-        return ret;
-    }
-
     ret = get_private_storage_path(private_dir_path, storage_path);
     if (ret < 0) {
         LOGE("Error getting private storage for %s", storage_path);
@@ -112,23 +147,71 @@ static int encrypt_storage(char *storage_path, int user, char *passwd)
         return ret;
     }
 
+    ret = get_journal_path(journal_path, storage_path);
+    if (ret < 0) {
+        LOGE("Error getting journal path for %s", storage_path);
+        return ret;
+    }
+
+    /* The header is encrypted and then mounted with the same derived key */
+    key_ctx_init(&keys, passwd);
+
+    if (!resume) {
+        ret = generate_crypt_info(storage_path, user, &keys);
+        if (ret < 0) {
+            LOGE("Error generating crypto material for efs storage %s",
+                 storage_path);
+            key_ctx_clear(&keys);
+            return ret;
+        }
+
+        unlink(journal_path);
+        ret = EFS_set_status(storage_path, STORAGE_ENCRYPTION_IN_PROGRESS);
+        if (ret < 0) {
+            LOGE("Failed to start storage encryption");
+            key_ctx_clear(&keys);
+            return ret;
+        }
+    }
+
     ret =
-        mount_ecryptfs(private_dir_path, private_dir_path, passwd,
+        mount_ecryptfs(private_dir_path, private_dir_path, &keys,
                key_storage_path);
+    key_ctx_clear(&keys);
     if (ret < 0) {
         LOGE("Error mounting %s", private_dir_path);
-        remove_dir(key_storage_path);
+        /* A failed resume (e.g. wrong passwd) must not lose the data */
+        if (!resume) {
+            remove_dir(key_storage_path);
+            remove_storage_status(key_storage_path);
+        }
         return ret;
     }
 
-    ret = copy_dir_content(private_dir_path, storage_path);
+    init_copy_options(&opts);
+    opts.journal_path = journal_path;
+    opts.migrate = migrate_enabled();
+    opts.skip_trash = 1;
+    opts.scan = scan;
+    sp.key_path = key_storage_path;
+    sp.status = STORAGE_ENCRYPTION_IN_PROGRESS;
+    opts.checkpoint = record_progress;
+    opts.checkpoint_arg = &sp;
+    ret = copy_dir_content(private_dir_path, storage_path, &opts);
     if (ret < 0) {
         LOGE("Error copy data to  private storage %s",
              private_dir_path);
+        /* Part of the data only exists encrypted; keep it for a resume */
+        if (opts.migrate) {
+            umount_ecryptfs(private_dir_path);
+            return ret;
+        }
         /* Try to fail gracefully */
         umount_ecryptfs(private_dir_path);
         remove_dir(private_dir_path);
         remove_dir(key_storage_path);
+        remove_storage_status(key_storage_path);
+        unlink(journal_path);
         return ret;
     }
 
@@ -150,6 +233,7 @@ static int encrypt_storage(char *storage_path, int user, char *passwd)
         return ret;
     }
 
+    unlink(journal_path);
     return 0;
 }
 
@@ -164,7 +248,7 @@ int EFS_get_status(char *storage_path)
 {
     char key_path[MAX_PATH_LENGTH];
     struct crypto_header header;
-    int ret = -1;
+    int ret = -1, status;
 
     ret = sanitize_storage_path(storage_path);
     if (ret < 0) {
@@ -177,26 +261,51 @@ int EFS_get_status(char *storage_path)
         return ret;
     }
 
-    ret = read_crypto_header(&header, key_path);
+    ret = read_storage_status(key_path, &status, NULL);
+    if (ret == -ENOENT) {
+        /* Written before the status record; v1 headers carry the status */
+        ret = read_crypto_header(&header, key_path);
+        if (ret < 0) {
+            LOGE("Unable to read crypto header from %s", key_path);
+            return ret;
+        }
+        status = header.stat;
+        OPENSSL_cleanse(&header, sizeof(header));
+        return status;
+    }
     if (ret < 0) {
-        LOGE("Unable to read crypto header from %s", key_path);
+        LOGE("Unable to read status of %s", storage_path);
         return ret;
     }
 
-    return header.stat;
+    /* A status record does not outlive its key file */
+    ret = access(key_path, F_OK);
+    if (ret < 0) {
+        LOGE("Unable to access crypto header %s", key_path);
+        return ret;
+    }
+
+    return status;
 }
 
 /**
- * Create an EFS
+ * Create an EFS from a scan of its content
+ * If a previous EFS_create was interrupted, the encryption is resumed
+ * and files already copied are skipped
  *
  * @param storage_path EFS path
  * @param passwd User passwd to secure EFS encryption key
+ * @param scan Scan of storage_path, NULL to walk it here; a scan of
+ * another path is ignored
  *
  * @return 0 on success, negative value on error
  */
-int EFS_create(char *storage_path, int user, char *passwd)
+int EFS_create_from_scan(char *storage_path, int user, char *passwd,
+             const struct tree_scan *scan)
 {
     char private_dir_path[MAX_PATH_LENGTH];
+    struct tree_scan local;
+    int resume = 0;
     int ret = -1;
 
     if (!passwd) {
@@ -223,17 +332,43 @@ int EFS_create(char *storage_path, int user, char *passwd)
 
     ret = access(private_dir_path, F_OK);
     if (ret == 0) {
-        LOGE("Secure storage already exist for %s", storage_path);
-        return -1;
-    }
-
-    ret = check_space(storage_path);
-    if (ret != 1) {
-        LOGE("Error calculating or insufficient space for storage %s", storage_path);
-        return -1;
-    }
-
-    ret = encrypt_storage(storage_path, user, passwd);
+        if (EFS_get_status(storage_path) != STORAGE_ENCRYPTION_IN_PROGRESS) {
+            LOGE("Secure storage already exist for %s", storage_path);
+            return -1;
+        }
+        LOGI("Resuming interrupted encryption of %s", storage_path);
+        resume = 1;
+    }
+
+    /*
+     * One walk serves the space check, the progress and the copy; the
+     * entries are kept so that the copy does not walk again
+     */
+    memset(&local, 0, sizeof(local));
+    if (scan && strcmp(scan->path, storage_path))
+        scan = NULL;
+    if (!scan) {
+        ret = scan_tree(storage_path, SCAN_ENTRIES | SCAN_SKIP_TRASH,
+                        &local);
+        if (ret < 0) {
+            LOGE("Unable to scan %s", storage_path);
+            return ret;
+        }
+        scan = &local;
+    }
+
+    /* Space was checked when the encryption started */
+    if (!resume) {
+        ret = check_space(storage_path, scan, migrate_enabled());
+        if (ret != 1) {
+            LOGE("Error calculating or insufficient space for storage %s", storage_path);
+            free_scan(&local);
+            return -1;
+        }
+    }
+
+    ret = encrypt_storage(storage_path, user, passwd, resume, scan);
+    free_scan(&local);
     if (ret < 0) {
         LOGE("Error encrypting efs storage %s", storage_path);
         return ret;
@@ -244,25 +379,41 @@ int EFS_create(char *storage_path, int user, char *passwd)
 }
 
 /**
- * Unlock EFS
+ * Create an EFS
+ * If a previous EFS_create was interrupted, the encryption is resumed
+ * and files already copied are skipped
  *
  * @param storage_path EFS path
- * @param passwd Passwd to access encryption key
+ * @param passwd User passwd to secure EFS encryption key
  *
  * @return 0 on success, negative value on error
  */
-int EFS_unlock(char *storage_path, char *passwd)
+int EFS_create(char *storage_path, int user, char *passwd)
+{
+    return EFS_create_from_scan(storage_path, user, passwd, NULL);
+}
+
+/**
+ * Unlock EFS with the keys of a user operation
+ * Storages whose headers share a salt reuse the derived key
+ *
+ * @param storage_path EFS path
+ * @param keys Keys of the passwd to access encryption key
+ *
+ * @return 0 on success, negative value on error
+ */
+int EFS_unlock_with_keys(char *storage_path, struct key_ctx *keys)
 {
     char private_dir_path[MAX_PATH_LENGTH];
     char key_storage_path[MAX_PATH_LENGTH];
     int ret = -1;
 
-    if (!passwd) {
+    if (!keys || !keys->passwd) {
         LOGE("Null passwd provided");
         return ret;
     }
 
-    if (strlen(passwd) < MIN_PASSWD_LEN) {
+    if (strlen(keys->passwd) < MIN_PASSWD_LEN) {
         LOGE("Passwd too short");
         return ret;
     }
@@ -288,11 +439,11 @@ int EFS_unlock(char *storage_path, char *passwd)
     ret = EFS_get_status(storage_path);
     if (ret != STORAGE_ENCRYPTION_COMPLETED) {
         LOGE("Unable to unlock storage. Storage encryption failed.");
-        return ret;
+        return ret < 0 ? ret : -1;
     }
 
     ret =
-        mount_ecryptfs(private_dir_path, storage_path, passwd,
+        mount_ecryptfs(private_dir_path, storage_path, keys,
                key_storage_path);
     if (ret < 0) {
         LOGE("Error mounting private storage");
@@ -304,13 +455,35 @@ int EFS_unlock(char *storage_path, char *passwd)
 }
 
 /**
- * Lock an EFS
+ * Unlock EFS
  *
  * @param storage_path EFS path
+ * @param passwd Passwd to access encryption key
  *
  * @return 0 on success, negative value on error
  */
-int EFS_lock(char *storage_path)
+int EFS_unlock(char *storage_path, char *passwd)
+{
+    struct key_ctx keys;
+    int ret;
+
+    key_ctx_init(&keys, passwd);
+    ret = EFS_unlock_with_keys(storage_path, &keys);
+    key_ctx_clear(&keys);
+
+    return ret;
+}
+
+/**
+ * Lock EFS, keeping its keys for a fast unlock with a token
+ * The keys are only kept while UNLOCK_CACHE_PROPERTY is set
+ *
+ * @param storage_path EFS path
+ * @param token Secret for EFS_unlock_with_token, NULL to keep nothing
+ *
+ * @return 0 on success, negative value on error
+ */
+int EFS_lock_with_token(char *storage_path, char *token)
 {
     int ret = -1;
 
@@ -320,9 +493,20 @@ int EFS_lock(char *storage_path)
         return ret;
     }
 
+    /*
+     * Read back from the keyring before the unmount removes them; a
+     * plain lock forgets keys cached by an earlier lock
+     */
+    if (!token)
+        unlock_cache_drop(storage_path);
+    else if (unlock_cache_store(storage_path, token) < 0)
+        LOGE("Unable to cache keys of %s", storage_path);
+
     ret = umount_ecryptfs(storage_path);
     if (ret < 0) {
         LOGE("Error unmounting efs storage");
+        if (token)
+            unlock_cache_drop(storage_path);
         return ret;
     }
 
@@ -331,29 +515,101 @@ int EFS_lock(char *storage_path)
 }
 
 /**
- * Change passwd of an EFS
+ * Lock an EFS
  *
  * @param storage_path EFS path
- * @param old_passwd Old EFS passwd
- * @param new_passwd New EFS passwd
  *
  * @return 0 on success, negative value on error
  */
-int EFS_change_password(char *storage_path, char *old_passwd, char *new_passwd)
+int EFS_lock(char *storage_path)
+{
+    return EFS_lock_with_token(storage_path, NULL);
+}
+
+/**
+ * Unlock EFS with the token it was locked with, without the KDF
+ * The cached keys can only be tried once and expire after the timeout
+ *
+ * @param storage_path EFS path
+ * @param token Token given to EFS_lock_with_token
+ *
+ * @return 0 on success, negative value if the passwd is needed
+ */
+int EFS_unlock_with_token(char *storage_path, char *token)
+{
+    char private_dir_path[MAX_PATH_LENGTH];
+    unsigned char fefek[ECRYPTFS_KEY_LEN], fnek[ECRYPTFS_KEY_LEN];
+    unsigned char salt[ECRYPTFS_SALT_SIZE];
+    int ret = -1;
+
+    ret = sanitize_storage_path(storage_path);
+    if (ret < 0) {
+        LOGE("Invalid storage path");
+        return ret;
+    }
+
+    ret = get_private_storage_path(private_dir_path, storage_path);
+    if (ret < 0) {
+        LOGE("Error getting private storage");
+        return ret;
+    }
+
+    if (check_fs_mounted(private_dir_path) == 1) {
+        LOGE("ecryptfs is already mounted on %s", storage_path);
+        return 0;
+    }
+
+    ret = EFS_get_status(storage_path);
+    if (ret != STORAGE_ENCRYPTION_COMPLETED) {
+        LOGE("Unable to unlock storage. Storage encryption failed.");
+        unlock_cache_drop(storage_path);
+        return ret < 0 ? ret : -1;
+    }
+
+    ret = unlock_cache_load(storage_path, token, fefek, fnek, salt);
+    if (ret < 0) {
+        LOGI("No cached keys for %s", storage_path);
+        return ret;
+    }
+
+    ret = mount_ecryptfs_keys(private_dir_path, storage_path, fefek, fnek,
+                              salt);
+    OPENSSL_cleanse(fefek, sizeof(fefek));
+    OPENSSL_cleanse(fnek, sizeof(fnek));
+    if (ret < 0) {
+        LOGE("Error mounting private storage");
+        return ret;
+    }
+
+    LOGI("Secure storage %s unlocked from cache", storage_path);
+    return 0;
+}
+
+/**
+ * Change passwd of an EFS with the keys of a user operation
+ *
+ * @param storage_path EFS path
+ * @param old_keys Keys of the old EFS passwd
+ * @param new_keys Keys of the new EFS passwd
+ *
+ * @return 0 on success, negative value on error
+ */
+int EFS_change_password_with_keys(char *storage_path, struct key_ctx *old_keys,
+                                  struct key_ctx *new_keys)
 {
     int ret = -1;
 
-    if (!old_passwd || !new_passwd) {
+    if (!old_keys || !new_keys || !old_keys->passwd || !new_keys->passwd) {
         LOGE("Null passwd provided");
         return ret;
     }
 
-    if (strlen(old_passwd) < MIN_PASSWD_LEN) {
+    if (strlen(old_keys->passwd) < MIN_PASSWD_LEN) {
         LOGE("Old passwd too short");
         return ret;
     }
 
-    if (strlen(new_passwd) < MIN_PASSWD_LEN) {
+    if (strlen(new_keys->passwd) < MIN_PASSWD_LEN) {
         LOGE("New passwd too short");
         return ret;
     }
@@ -364,7 +620,10 @@ int EFS_change_password(char *storage_path, char *old_passwd, char *new_passwd)
         return ret;
     }
 
-    ret = change_passwd(storage_path, old_passwd, new_passwd);
+    /* Keys cached under the old passwd must not outlive it */
+    unlock_cache_drop(storage_path);
+
+    ret = change_passwd(storage_path, old_keys, new_keys);
     if (ret < 0) {
         LOGE("Error changing EFS passwd");
         return ret;
@@ -374,6 +633,29 @@ int EFS_change_password(char *storage_path, char *old_passwd, char *new_passwd)
     return 0;
 }
 
+/**
+ * Change passwd of an EFS
+ *
+ * @param storage_path EFS path
+ * @param old_passwd Old EFS passwd
+ * @param new_passwd New EFS passwd
+ *
+ * @return 0 on success, negative value on error
+ */
+int EFS_change_password(char *storage_path, char *old_passwd, char *new_passwd)
+{
+    struct key_ctx old_keys, new_keys;
+    int ret;
+
+    key_ctx_init(&old_keys, old_passwd);
+    key_ctx_init(&new_keys, new_passwd);
+    ret = EFS_change_password_with_keys(storage_path, &old_keys, &new_keys);
+    key_ctx_clear(&old_keys);
+    key_ctx_clear(&new_keys);
+
+    return ret;
+}
+
 /**
  * Remove an EFS
  *
@@ -432,6 +714,13 @@ int EFS_remove(char *storage_path)
         LOGE("Error removing key");
         return ret;
     }
+    remove_storage_status(key_storage_path);
+    unlock_cache_drop(storage_path);
+
+    /* Only present if the encryption was interrupted */
+    ret = get_journal_path(key_storage_path, storage_path);
+    if (ret == 0)
+        unlink(key_storage_path);
 
     LOGI("Secure storage %s removed", storage_path);
     return 0;
@@ -439,6 +728,9 @@ int EFS_remove(char *storage_path)
 
 /**
  * Recover encrypted data from an EFS. The EFS will be destroyed.
+ * With migration enabled, files are removed from the EFS as they are
+ * recovered. The storage is marked STORAGE_DECRYPTION_IN_PROGRESS so it
+ * is not unlocked over the recovered data, and a new call resumes.
  *
  * @param storage_path EFS path
  * @param passwd EFS passwd
@@ -450,6 +742,11 @@ int EFS_recover_data_and_remove(char *storage_path, char *passwd)
     char private_dir_path[MAX_PATH_LENGTH];
     char key_storage_path[MAX_PATH_LENGTH];
     char recovery_path[MAX_PATH_LENGTH];
+    char journal_path[MAX_PATH_LENGTH];
+    struct copy_options opts;
+    struct status_progress sp;
+    struct key_ctx keys;
+    int resume = 0, status;
     int ret = -1;
 
     if (!passwd) {
@@ -503,15 +800,38 @@ int EFS_recover_data_and_remove(char *storage_path, char *passwd)
         return ret;
     }
 
-    ret = mkdir(recovery_path, S_IRWXU);
+    ret = get_journal_path(journal_path, storage_path);
     if (ret < 0) {
+        LOGE("Error getting journal path for %s", storage_path);
+        return ret;
+    }
+
+    /* Part of the data is only in plain text after a migrating recovery */
+    status = EFS_get_status(storage_path);
+    if (status == STORAGE_DECRYPTION_IN_PROGRESS) {
+        LOGI("Resuming interrupted recovery of %s", storage_path);
+        resume = 1;
+    } else if (status != STORAGE_ENCRYPTION_COMPLETED) {
+        LOGE("Unable to recover storage %s, status %d", storage_path, status);
+        return -1;
+    }
+
+    /* A journal of another run would skip files that are not copied */
+    if (!resume)
+        unlink(journal_path);
+
+    /* May be left by an interrupted recovery */
+    ret = mkdir(recovery_path, S_IRWXU);
+    if (ret < 0 && errno != EEXIST) {
         LOGE("mkdir %s fail", recovery_path);
         return ret;
     }
 
+    key_ctx_init(&keys, passwd);
     ret =
-        mount_ecryptfs(private_dir_path, recovery_path, passwd,
+        mount_ecryptfs(private_dir_path, recovery_path, &keys,
                key_storage_path);
+    key_ctx_clear(&keys);
 
     if (ret < 0) {
         LOGE("Error mounting private storage %s to %s",
@@ -520,12 +840,36 @@ int EFS_recover_data_and_remove(char *storage_path, char *passwd)
         return ret;
     }
 
-    ret = copy_dir_content(storage_path, recovery_path);
+    init_copy_options(&opts);
+    opts.journal_path = journal_path;
+    /* A resume must not remove what the interrupted recovery migrated */
+    opts.migrate = resume || migrate_enabled();
+    opts.skip_trash = 1;
+    if (opts.migrate && !resume) {
+        ret = EFS_set_status(storage_path, STORAGE_DECRYPTION_IN_PROGRESS);
+        if (ret < 0) {
+            LOGE("Failed to start storage recovery");
+            umount_ecryptfs(recovery_path);
+            return ret;
+        }
+    }
+    if (opts.migrate) {
+        sp.key_path = key_storage_path;
+        sp.status = STORAGE_DECRYPTION_IN_PROGRESS;
+        opts.checkpoint = record_progress;
+        opts.checkpoint_arg = &sp;
+    }
+
+    ret = copy_dir_content(storage_path, recovery_path, &opts);
     if (ret < 0) {
         LOGE("Error copy data to storage");
-        /* Le graceful fail */
         umount_ecryptfs(recovery_path);
+        /* Migrated files are gone from the EFS; a new call resumes */
+        if (opts.migrate)
+            return ret;
+        /* Le graceful fail */
         remove_dir_content(storage_path);
+        unlink(journal_path);
         return ret;
     }
 
@@ -562,7 +906,8 @@ int EFS_get_progress(char *storage_path)
 {
     char buff[PROPERTY_VALUE_MAX], property[PROPERTY_KEY_MAX], path_hash_hex[ECRYPTFS_SIG_LEN * 2 + 1];
     unsigned char path_hash[ECRYPTFS_SIG_LEN];
-    int ret = -1;
+    char key_path[MAX_PATH_LENGTH];
+    int ret = -1, status, progress;
 
     if (strlen(storage_path) > MAX_PATH_LENGTH) {
         LOGE("Invalid arguments\n");
@@ -588,5 +933,14 @@ int EFS_get_progress(char *storage_path)
         return ret;
     }
 
-    return atoi(buff);
+    progress = atoi(buff);
+    if (progress >= 0)
+        return progress;
+
+    /* Not encrypting since boot; the status record has the last value */
+    if (get_key_storage_path(key_path, storage_path) < 0 ||
+        read_storage_status(key_path, &status, &progress) < 0)
+        return -1;
+
+    return progress;
 }
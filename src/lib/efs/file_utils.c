@@ -26,686 +26,3431 @@
  * Author: Catalin Ionita <catalin.ionita@intel.com>
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/time.h>
-#include <utime.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <dirent.h>
-#include <selinux/selinux.h>
+#include <sys/syscall.h>
 #include <efs/efs.h>
 #include <efs/file_utils.h>
 #include <efs/key_chain.h>
+#include <efs/work_queue.h>
+#include <efs/copy_strategy.h>
+#include <efs/uring_copy.h>
+#include <efs/journal.h>
+#include <efs/throttle.h>
+#include <efs/arena.h>
+#include <efs/con_table.h>
+#include <efs/trash.h>
 #include <openssl/sha.h>
 #include <cutils/properties.h>
 
 typedef struct file_info file_info;
 struct file_info {
-    struct stat st;
-    security_context_t con;
+    struct file_attr attr;
     file_info *next;
-    char *path;
+    file_info *link;            /* first path of a hard linked inode */
+    file_info *parent;          /* NULL at the top of the tree */
+    uint32_t con;               /* context id, unset for regular files */
+    int refs;                   /* holders of a streamed node, see node_put */
+    char name[0];
+};
+
+/* Record returned by getdents64 */
+struct getdents_entry {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[0];
+};
+
+/* Directory read in getdents64 batches */
+struct dir_reader {
+    int fd;
+    char *buf;
+    int len;
+    int pos;
+    int skip_trash;             /* top of a storage walk */
+};
+
+/* Result of a tree walk, allocated from one arena */
+struct file_tree {
+    struct arena arena;
+    struct con_table *cons;     /* contexts of the entries, if kept */
+    file_info *file_list;
+    file_info *dir_list;
+    off64_t size;
+    off64_t largest;
+    int64_t files;
+    int64_t dirs;
+};
+
+/* Open destination directories of the current branch */
+struct dir_stack_entry {
+    file_info *fi;
+    int fd;
+};
+
+struct inode_entry {
+    dev_t dev;
+    ino_t ino;
+    file_info *fi;
+    struct inode_entry *next;
+};
+
+/* Hard linked files seen while walking the tree */
+struct inode_map {
+    struct inode_entry *table[INODE_MAP_SIZE];
+};
+
+/* Directory queued for the walk threads, already open */
+struct walk_dir {
+    file_info *node;            /* NULL for the top of the walk */
+    int fd;
+};
+
+/* Tree walk shared by the walk threads */
+struct tree_walk {
+    struct work_pool pool;
+    struct file_tree parts[MAX_WORKERS];        /* result of each thread */
+    const char *path;           /* top of the walk */
+    struct inode_map *links;
+    struct con_table *cons;
+    pthread_mutex_t lock;       /* protects links */
+    int threads;
+    int entries;                /* keep entries, not only totals */
+    int skip_trash;             /* walk of a storage */
+};
+
+/* Directory emptied by the delete threads */
+struct remove_node {
+    struct remove_node *parent;     /* NULL at the top of the tree */
+    int fd;                     /* open while its entries are removed */
+    int pending;                /* own listing and queued subdirectories */
+    char name[0];
+};
+
+/* Tree deletion shared by the delete threads */
+struct tree_remove {
+    struct work_pool pool;
+    int threads;
+    int error;
+};
+
+struct copy_progress {
+    pthread_mutex_t lock;
+    char property[PROPERTY_KEY_MAX];
+    off64_t done;
+    off64_t total;
+    int percent;
+};
+
+/* Sources waiting to be unlinked once their copies are on disk */
+struct migrate_queue {
+    pthread_mutex_t lock;
+    int src_fd;
+    int dst_fd;
+    char **paths;
+    int nr_paths;
+    int size;
+    off64_t bytes;
+};
+
+/* Source and destination of a directory, opened once for its entries */
+struct dir_handle {
+    file_info *node;            /* NULL for the top of the copy */
+    int src_fd;
+    int dst_fd;
+    int refs;
+    struct dir_handle *next;    /* hash chain */
+    struct dir_handle *older;   /* idle list, while unreferenced */
+    struct dir_handle *newer;
+};
+
+/* Directories of a copy; idle ones are closed past DIR_CACHE_IDLE */
+struct dir_cache {
+    pthread_mutex_t lock;
+    struct dir_handle root;
+    struct dir_handle *table[DIR_CACHE_BUCKETS];
+    struct dir_handle *oldest;
+    struct dir_handle *newest;
+    int nr_idle;
+    int stream;                 /* handles hold a reference to their node */
+};
+
+/* Either a batch of small files or one larger file */
+struct copy_task {
+    file_info **files;
+    int nr_files;
+};
+
+struct copy_schedule {
+    struct copy_task *tasks;
+    int nr_tasks;
+    file_info **files;
+};
+
+struct copy_ctx {
+    const char *src_path;
+    const char *dst_path;
+    int method;
+    int cache;                  /* enum copy_cache */
+    struct buffer_pool buffers;
+    struct copy_progress progress;
+    struct journal *journal;        /* NULL unless resumable */
+    int migrate;
+    struct migrate_queue unlinks;
+    struct work_pool *pool;
+    struct throttle throttle;
+    struct copy_stats stats;
+    struct con_table *cons;
+    struct dir_cache dirs;
+    int stream;                 /* tasks are released once run */
+    copy_checkpoint_fn checkpoint;
+    void *checkpoint_arg;
+};
+
+/* Copy fed by a walk of the source, see copy_stream */
+struct copy_stream {
+    struct copy_ctx *ctx;
+    struct con_table cons;
+    struct arena arena;         /* hard linked files, kept to the end */
+    struct inode_map links;
+    file_info *link_list;       /* every path of hard linked files */
+    struct copy_task *batch;    /* small files not queued yet */
 };
 
 /**
- * Check whether there is enough space on disk to create storage
+ * Create a file node to hold informations about a file
+ * A node only keeps its name and a link to its parent; a path is built
+ * with node_path where a call has no fd based variant
+ *
+ * @param arena Walk arena, NULL to allocate a node released with free
+ * @param parent Parent directory node, NULL at the top of the tree
+ * @param name Entry name
+ * @param st File stat
+ *
+ * @return A pointer to the new file node
+ */
+static file_info *create_node(struct arena *arena, file_info *parent,
+                const char *name, const struct stat *st)
+{
+    size_t len = strlen(name);
+    file_info *fi;
+
+    if (arena) {
+        fi = arena_alloc(arena, sizeof(file_info) + len + 1);
+    } else {
+        fi = malloc(sizeof(file_info) + len + 1);
+        if (!fi) {
+            LOGE("insufficient memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memset(fi, 0, sizeof(file_info));
+    file_attr_from_stat(&fi->attr, st);
+    fi->parent = parent;
+    fi->refs = 1;
+    memcpy(fi->name, name, len + 1);
+
+    return fi;
+}
+
+static void node_get(file_info *fi)
+{
+    if (fi)
+        __sync_fetch_and_add(&fi->refs, 1);
+}
+
+/**
+ * Drop a reference to a node allocated by a streaming copy
+ * Each node holds a reference to its parent, so the directories of the
+ * entries still queued stay around; the last reference frees the node
+ *
+ * @param fi File node, may be NULL
+ */
+static void node_put(file_info *fi)
+{
+    file_info *parent;
+
+    while (fi && __sync_sub_and_fetch(&fi->refs, 1) == 0) {
+        parent = fi->parent;
+        free(fi);
+        fi = parent;
+    }
+}
+
+/**
+ * Build the path of a node below a top directory, for the calls that
+ * have no fd based variant
+ *
+ * @param top Top directory
+ * @param fi File node
+ *
+ * @return Path, released with free
+ */
+static char *node_path(const char *top, const file_info *fi)
+{
+    const file_info *iter;
+    size_t len = strlen(top), n;
+    char *path, *p;
+
+    for (iter = fi; iter; iter = iter->parent)
+        len += strlen(iter->name) + 1;
+
+    path = malloc(len + 1);
+    if (!path) {
+        LOGE("insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    p = path + len;
+    *p = '\0';
+    for (iter = fi; iter; iter = iter->parent) {
+        n = strlen(iter->name);
+        p -= n;
+        memcpy(p, iter->name, n);
+        *--p = '/';
+    }
+    memcpy(path, top, p - path);
+
+    return path;
+}
+
+/**
+ * Keep the attributes of a stat result that a copy needs
+ *
+ * @param attr Attributes
+ * @param st File stat
+ */
+void file_attr_from_stat(struct file_attr *attr, const struct stat *st)
+{
+    attr->size = st->st_size;
+    attr->atime_ns = (int64_t)st->st_atim.tv_sec * 1000000000LL +
+        st->st_atim.tv_nsec;
+    attr->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000LL +
+        st->st_mtim.tv_nsec;
+    attr->mode = st->st_mode;
+    attr->uid = st->st_uid;
+    attr->gid = st->st_gid;
+    attr->flags = 0;
+    if (S_ISREG(st->st_mode) && (off64_t)st->st_blocks * 512 < st->st_size)
+        attr->flags |= FILE_ATTR_SPARSE;
+}
+
+/**
+ * Convert the access and modification times for futimens
+ *
+ * @param attr Attributes
+ * @param times Two timespecs, access time first
+ */
+void file_attr_times(const struct file_attr *attr, struct timespec *times)
+{
+    int64_t ns[2] = { attr->atime_ns, attr->mtime_ns };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        times[i].tv_sec = ns[i] / 1000000000LL;
+        times[i].tv_nsec = ns[i] % 1000000000LL;
+        /* Before the epoch */
+        if (times[i].tv_nsec < 0) {
+            times[i].tv_sec--;
+            times[i].tv_nsec += 1000000000LL;
+        }
+    }
+}
+
+/**
+ * Set up the reader of an open directory
+ *
+ * @param dir Reader
+ * @param fd Open directory, owned by the reader
+ *
+ * @return 0 on success, negative value on error
+ */
+static int dir_fdopen(struct dir_reader *dir, int fd)
+{
+    dir->fd = fd;
+    dir->buf = malloc(DIR_BUFFER_SIZE);
+    if (!dir->buf) {
+        LOGE("insufficient memory\n");
+        close(dir->fd);
+        return -1;
+    }
+    dir->len = 0;
+    dir->pos = 0;
+    dir->skip_trash = 0;
+
+    return 0;
+}
+
+/**
+ * Open a directory for reading relative to its parent
+ *
+ * @param dir Reader
+ * @param dirfd Parent directory, AT_FDCWD for a path
+ * @param name Directory name or path
+ *
+ * @return 0 on success, negative value on error
+ */
+static int dir_open(struct dir_reader *dir, int dirfd, const char *name)
+{
+    int fd;
+
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("open dir %s failed", name);
+        return -1;
+    }
+
+    return dir_fdopen(dir, fd);
+}
+
+/**
+ * Get the next entry of a directory, skipping . and ..
+ * The trash is skipped at the top of a storage walk, so data left to
+ * delete is neither counted nor copied
+ *
+ * @param dir Reader
+ * @param entry Next entry, valid until the next call
+ *
+ * @return 1 if an entry was returned, 0 at the end, negative value on error
+ */
+static int dir_next(struct dir_reader *dir, struct getdents_entry **entry)
+{
+    struct getdents_entry *e;
+    long n;
+
+    for (;;) {
+        if (dir->pos >= dir->len) {
+            n = syscall(__NR_getdents64, dir->fd, dir->buf, DIR_BUFFER_SIZE);
+            if (n < 0) {
+                LOGE("getdents64 failed: %s\n", strerror(errno));
+                return -1;
+            }
+            if (n == 0)
+                return 0;
+            dir->len = n;
+            dir->pos = 0;
+        }
+
+        e = (struct getdents_entry *)(dir->buf + dir->pos);
+        dir->pos += e->d_reclen;
+
+        if (e->d_name[0] == '.' && (e->d_name[1] == '\0' ||
+                        (e->d_name[1] == '.' && e->d_name[2] == '\0')))
+            continue;
+        if (dir->skip_trash && !strcmp(e->d_name, TRASH_DIR_NAME))
+            continue;
+
+        *entry = e;
+        return 1;
+    }
+}
+
+static void dir_close(struct dir_reader *dir)
+{
+    free(dir->buf);
+    close(dir->fd);
+}
+
+/**
+ * Remember a hard linked file or find the first path of its inode
+ *
+ * @param map Inode map
+ * @param fi File node
+ * @param st File stat
+ *
+ * @return First file node seen for this inode, NULL if fi is the first
+ */
+static file_info *inode_map_lookup(struct inode_map *map, file_info *fi,
+                    const struct stat *st)
+{
+    unsigned int i = (st->st_ino ^ st->st_dev) % INODE_MAP_SIZE;
+    struct inode_entry *entry;
+
+    for (entry = map->table[i]; entry; entry = entry->next)
+        if (entry->ino == st->st_ino && entry->dev == st->st_dev)
+            return entry->fi;
+
+    entry = malloc(sizeof(struct inode_entry));
+    if (!entry) {
+        LOGE("insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->fi = fi;
+    entry->next = map->table[i];
+    map->table[i] = entry;
+
+    return NULL;
+}
+
+/**
+ * Free an inode map
+ *
+ * @param map Inode map
+ */
+static void inode_map_free(struct inode_map *map)
+{
+    struct inode_entry *entry, *next;
+    int i;
+
+    for (i = 0; i < INODE_MAP_SIZE; i++) {
+        for (entry = map->table[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+        map->table[i] = NULL;
+    }
+}
+
+/**
+ * Find the first path of a hard linked inode while other threads walk
+ *
+ * @param walk Walk state
+ * @param fi File node
+ * @param st File stat
+ *
+ * @return First file node seen for this inode, NULL if fi is the first
+ */
+static file_info *walk_link(struct tree_walk *walk, file_info *fi,
+                const struct stat *st)
+{
+    file_info *link;
+
+    pthread_mutex_lock(&walk->lock);
+    link = inode_map_lookup(walk->links, fi, st);
+    pthread_mutex_unlock(&walk->lock);
+
+    return link;
+}
+
+/**
+ * Decide whether a subdirectory goes to the walk queue
+ * Directories are listed in place while the other threads have work
+ *
+ * @param walk Walk state
+ *
+ * @return 1 to queue the directory, 0 to list it in place
+ */
+static int walk_defer(struct tree_walk *walk)
+{
+    if (walk->threads < 2)
+        return 0;
+
+    return work_pool_queued(&walk->pool) < WALK_QUEUE_DEPTH * walk->threads;
+}
+
+/**
+ * Open a directory and queue it for the walk threads
+ *
+ * @param walk Walk state
+ * @param dirfd Parent directory, AT_FDCWD for the top
+ * @param name Directory name, or path of the top
+ * @param node Directory node, NULL for the top
+ *
+ * @return 0 on success, negative number in case of an error
+ */
+static int walk_queue(struct tree_walk *walk, int dirfd, const char *name,
+              file_info *node)
+{
+    struct walk_dir *item;
+    int ret;
+
+    item = malloc(sizeof(struct walk_dir));
+    if (!item) {
+        LOGE("insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    item->node = node;
+    item->fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (item->fd < 0) {
+        LOGE("open dir %s failed", name);
+        free(item);
+        return -1;
+    }
+
+    ret = work_pool_push(&walk->pool, item);
+    if (ret < 0) {
+        close(item->fd);
+        free(item);
+    }
+
+    return ret;
+}
+
+/**
+ * Release a directory left in the queue of an aborted walk
+ *
+ * @param item Queued directory
+ */
+static void walk_release(void *item)
+{
+    struct walk_dir *dir = item;
+
+    close(dir->fd);
+    free(dir);
+}
+
+static int list_subdir(struct dir_reader *dir, file_info *node,
+               struct file_tree *tree, struct tree_walk *walk);
+
+/**
+ * List the content of an open directory
+ * Entries are looked up relative to the directory fd
+ *
+ * @param dir Open directory
+ * @param parent Node of the directory, NULL at the top
+ * @param tree Walk result of the calling thread
+ * @param walk Walk state
+ *
+ * @return 0 on success, negative number in case of an error
+ */
+static int list_dir(struct dir_reader *dir, file_info *parent,
+            struct file_tree *tree, struct tree_walk *walk)
+{
+    struct getdents_entry *entry;
+    struct dir_reader child;
+    struct stat st;
+    file_info *node;
+    char *path;
+    int ret;
+
+    while ((ret = dir_next(dir, &entry)) > 0) {
+        ret = fstatat(dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW);
+        if (ret < 0) {
+            LOGE("lstat failed on %s\n", entry->d_name);
+            return ret;
+        }
+
+        tree->size += st.st_size;
+        if (S_ISREG(st.st_mode) && st.st_size > tree->largest)
+            tree->largest = st.st_size;
+
+        if (!S_ISDIR(st.st_mode)) {
+            tree->files++;
+            if (!walk->entries)
+                continue;
+            node = create_node(&tree->arena, parent, entry->d_name, &st);
+            /* Regular files are labeled from their open source when copied */
+            if (!S_ISREG(st.st_mode)) {
+                path = node_path(walk->path, node);
+                ret = con_get_path(walk->cons, path, &node->con);
+                free(path);
+                if (ret < 0) {
+                    LOGE("Unable to get context of %s\n", node->name);
+                    return ret;
+                }
+            }
+            if (walk->links && S_ISREG(st.st_mode) && st.st_nlink > 1)
+                node->link = walk_link(walk, node, &st);
+            node->next = tree->file_list;
+            tree->file_list = node;
+            continue;
+        }
+
+        node = create_node(&tree->arena, parent, entry->d_name, &st);
+        node->next = tree->dir_list;
+        tree->dir_list = node;
+        tree->dirs++;
+
+        if (walk_defer(walk)) {
+            ret = walk_queue(walk, dir->fd, entry->d_name, node);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+
+        ret = dir_open(&child, dir->fd, entry->d_name);
+        if (ret < 0)
+            return ret;
+        ret = list_subdir(&child, node, tree, walk);
+        dir_close(&child);
+        if (ret < 0)
+            return ret;
+    }
+
+    return ret;
+}
+
+/**
+ * Get the context of an open subdirectory and list its content
+ *
+ * @param dir Open directory
+ * @param node Node of the directory
+ * @param tree Walk result of the calling thread
+ * @param walk Walk state
+ *
+ * @return 0 on success, negative number in case of an error
+ */
+static int list_subdir(struct dir_reader *dir, file_info *node,
+               struct file_tree *tree, struct tree_walk *walk)
+{
+    int ret;
+
+    if (walk->entries) {
+        ret = con_get_fd(walk->cons, dir->fd, &node->con);
+        if (ret < 0) {
+            LOGE("Unable to get context of %s\n", node->name);
+            return ret;
+        }
+    }
+
+    return list_dir(dir, node, tree, walk);
+}
+
+/**
+ * List a queued directory; work callback of the walk threads
+ *
+ * @param item Queued directory
+ * @param worker Walk thread index
+ * @param arg Walk state
+ *
+ * @return 0 on success, negative number in case of an error
+ */
+static int walk_item(void *item, int worker, void *arg)
+{
+    struct tree_walk *walk = arg;
+    struct file_tree *tree = &walk->parts[worker];
+    struct walk_dir *queued = item;
+    file_info *node = queued->node;
+    struct dir_reader dir;
+    int ret;
+
+    ret = dir_fdopen(&dir, queued->fd);
+    free(queued);
+    if (ret < 0)
+        return ret;
+
+    if (!node) {
+        dir.skip_trash = walk->skip_trash;
+        ret = list_dir(&dir, NULL, tree, walk);
+    }
+    else
+        ret = list_subdir(&dir, node, tree, walk);
+    dir_close(&dir);
+
+    return ret;
+}
+
+static int node_depth(const file_info *fi)
+{
+    int depth = 0;
+
+    for (; fi->parent; fi = fi->parent)
+        depth++;
+
+    return depth;
+}
+
+/**
+ * Order directories so that each one is followed by its subtree
+ * Both nodes are brought to the same depth, then to their first common
+ * parent, where the names of the two branches are compared
+ */
+static int path_order(const void *a, const void *b)
+{
+    const file_info *p = *(file_info * const *)a;
+    const file_info *q = *(file_info * const *)b;
+    int depth_p = node_depth(p), depth_q = node_depth(q), d;
+
+    for (d = depth_p; d > depth_q; d--)
+        p = p->parent;
+    for (d = depth_q; d > depth_p; d--)
+        q = q->parent;
+
+    /* A directory sorts before its subtree */
+    if (p == q)
+        return depth_p - depth_q;
+
+    while (p->parent != q->parent) {
+        p = p->parent;
+        q = q->parent;
+    }
+
+    return strcmp(p->name, q->name);
+}
+
+/**
+ * Join the results of the walk threads
+ * Directories are put back in the order of a serial walk, parents
+ * before their subtree, as create_dirs expects
+ *
+ * @param walk Walk state
+ * @param tree Walk result
+ */
+static void walk_merge(struct tree_walk *walk, struct file_tree *tree)
+{
+    struct file_tree *part;
+    file_info *iter, *next, **dirs;
+    int64_t nr = 0, i;
+    int t;
+
+    for (t = 0; t < walk->threads; t++)
+        nr += walk->parts[t].dirs;
+
+    dirs = malloc((nr ? nr : 1) * sizeof(file_info *));
+    if (!dirs) {
+        LOGE("insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    nr = 0;
+    for (t = 0; t < walk->threads; t++) {
+        part = &walk->parts[t];
+        tree->size += part->size;
+        tree->files += part->files;
+        tree->dirs += part->dirs;
+        if (part->largest > tree->largest)
+            tree->largest = part->largest;
+
+        for (iter = part->file_list; iter; iter = next) {
+            next = iter->next;
+            iter->next = tree->file_list;
+            tree->file_list = iter;
+        }
+        for (iter = part->dir_list; iter; iter = iter->next)
+            dirs[nr++] = iter;
+
+        arena_merge(&tree->arena, &part->arena);
+    }
+
+    qsort(dirs, nr, sizeof(file_info *), path_order);
+    for (i = 0; i < nr; i++) {
+        dirs[i]->next = tree->dir_list;
+        tree->dir_list = dirs[i];
+    }
+
+    free(dirs);
+}
+
+/**
+ * Get the number of tree walk threads
+ *
+ * @return Number of threads, 1 for a serial walk
+ */
+static int get_walk_threads(void)
+{
+    char buff[PROPERTY_VALUE_MAX];
+
+    memset(buff, 0, sizeof(buff));
+    property_get(WALK_THREADS_PROPERTY, buff, "0");
+    if (atoi(buff) > 0)
+        return atoi(buff) < MAX_WORKERS ? atoi(buff) : MAX_WORKERS;
+
+    return get_nr_cpus();
+}
+
+/**
+ * Walk a tree with a number of threads sharing a directory queue
+ * With one thread the walk is serial and in tree order
+ *
+ * @param path Directory path
+ * @param tree Walk result, released with free_tree even on error
+ * @param links Inode map to detect hard links, NULL to ignore them
+ * @param flags SCAN_ENTRIES to keep the entries and their contexts, not
+ * only totals; SCAN_SKIP_TRASH for the walk of a storage
+ * @param threads Number of walk threads
+ *
+ * @return 0 on success, negative number in case of an error
+ */
+static int walk_tree(const char *path, struct file_tree *tree,
+             struct inode_map *links, int flags, int threads)
+{
+    struct tree_walk walk;
+    struct dir_reader dir;
+    int t, ret;
+
+    memset(tree, 0, sizeof(struct file_tree));
+    arena_init(&tree->arena);
+
+    if (flags & SCAN_ENTRIES) {
+        tree->cons = malloc(sizeof(struct con_table));
+        if (!tree->cons) {
+            LOGE("insufficient memory\n");
+            exit(EXIT_FAILURE);
+        }
+        con_table_init(tree->cons);
+    }
+
+    memset(&walk, 0, sizeof(walk));
+    walk.path = path;
+    walk.links = links;
+    walk.cons = tree->cons;
+    walk.entries = !!(flags & SCAN_ENTRIES);
+    walk.skip_trash = !!(flags & SCAN_SKIP_TRASH);
+    walk.threads = threads < MAX_WORKERS ? threads : MAX_WORKERS;
+
+    if (walk.threads < 2) {
+        ret = dir_open(&dir, AT_FDCWD, path);
+        if (ret < 0)
+            return ret;
+        dir.skip_trash = walk.skip_trash;
+
+        ret = list_dir(&dir, NULL, tree, &walk);
+        dir_close(&dir);
+        return ret;
+    }
+
+    pthread_mutex_init(&walk.lock, NULL);
+    for (t = 0; t < walk.threads; t++)
+        arena_init(&walk.parts[t].arena);
+
+    work_pool_init(&walk.pool, walk.threads, walk_item, &walk);
+    ret = walk_queue(&walk, AT_FDCWD, path, NULL);
+    if (ret == 0)
+        ret = work_pool_start(&walk.pool);
+    if (work_pool_wait(&walk.pool) < 0 && ret == 0)
+        ret = -1;
+    work_pool_drain(&walk.pool, walk_release);
+    work_pool_destroy(&walk.pool);
+    pthread_mutex_destroy(&walk.lock);
+
+    walk_merge(&walk, tree);
+
+    return ret;
+}
+
+/**
+ * Release a walk result
+ *
+ * @param tree Walk result
+ */
+static void free_tree(struct file_tree *tree)
+{
+    if (tree->cons) {
+        con_table_destroy(tree->cons);
+        free(tree->cons);
+        tree->cons = NULL;
+    }
+    arena_destroy(&tree->arena);
+    tree->file_list = NULL;
+    tree->dir_list = NULL;
+}
+
+/**
+ * Release a scan result
+ *
+ * @param scan Scan result
+ */
+void free_scan(struct tree_scan *scan)
+{
+    if (scan->tree) {
+        free_tree(scan->tree);
+        free(scan->tree);
+    }
+    free((char *)scan->path);
+    memset(scan, 0, sizeof(struct tree_scan));
+}
+
+/**
+ * Walk a tree once; the result serves the space check, the progress
+ * total and, if entries are kept, the copy
+ *
+ * @param path Directory path
+ * @param flags SCAN_ENTRIES to keep the entries, which a streaming copy
+ * does not need; SCAN_SKIP_TRASH if path is a storage
+ * @param scan Scan result, release with free_scan
+ *
+ * @return 0 on success, negative number in case of an error
+ */
+int scan_tree(const char *path, int flags, struct tree_scan *scan)
+{
+    struct inode_map links;
+    struct file_tree *tree;
+    int entries = !!(flags & SCAN_ENTRIES);
+    int ret;
+
+    memset(scan, 0, sizeof(struct tree_scan));
+    tree = malloc(sizeof(struct file_tree));
+    scan->path = strdup(path);
+    if (!tree || !scan->path) {
+        LOGE("insufficient memory\n");
+        free(tree);
+        free_scan(scan);
+        return -1;
+    }
+
+    memset(&links, 0, sizeof(links));
+    ret = walk_tree(path, tree, entries ? &links : NULL, flags,
+                    get_walk_threads());
+    inode_map_free(&links);
+    scan->tree = tree;
+    if (ret < 0) {
+        LOGE("Unable to scan %s\n", path);
+        free_scan(scan);
+        return ret;
+    }
+
+    scan->entries = entries;
+    scan->size = tree->size;
+    scan->largest = tree->largest;
+    scan->files = tree->files;
+    scan->dirs = tree->dirs;
+
+    /* Totals are all a streaming copy needs */
+    if (!entries) {
+        free_tree(tree);
+        free(tree);
+        scan->tree = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * Add up the size on disk of an open directory
+ *
+ * @param dir Open directory
+ * @param size Directory size
+ * @param largest Size of the largest file, updated if bigger
+ *
+ * @return 0 for success, negative value in case of an error
+ */
+static int dir_usage(struct dir_reader *dir, off64_t * size,
+             off64_t * largest)
+{
+    struct getdents_entry *entry;
+    struct dir_reader child;
+    struct stat st;
+    int ret;
+
+    while ((ret = dir_next(dir, &entry)) > 0) {
+        ret = fstatat(dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW);
+        if (ret < 0) {
+            LOGE("lstat failed on %s\n", entry->d_name);
+            return ret;
+        }
+
+        *size += st.st_size;
+        if (S_ISREG(st.st_mode) && st.st_size > *largest)
+            *largest = st.st_size;
+
+        if (!S_ISDIR(st.st_mode))
+            continue;
+
+        ret = dir_open(&child, dir->fd, entry->d_name);
+        if (ret < 0)
+            return ret;
+        ret = dir_usage(&child, size, largest);
+        dir_close(&child);
+        if (ret < 0)
+            return ret;
+    }
+
+    return ret;
+}
+
+/**
+ * Get size on disk for a directory and its largest regular file
+ * Similar functionality with du -c
+ * @param path Directory path
+ * @param size Directory size
+ * @param largest Size of the largest file, updated if bigger
+ *
+ * @return 0 for success, negative value in case of an error
+ */
+static int get_dir_usage(const char *path, off64_t * size, off64_t * largest)
+{
+    struct file_tree tree;
+    struct dir_reader dir;
+    int threads, ret;
+
+    threads = get_walk_threads();
+    if (threads > 1) {
+        ret = walk_tree(path, &tree, NULL, 0, threads);
+        *size += tree.size;
+        if (tree.largest > *largest)
+            *largest = tree.largest;
+        free_tree(&tree);
+        return ret;
+    }
+
+    ret = dir_open(&dir, AT_FDCWD, path);
+    if (ret < 0)
+        return ret;
+
+    ret = dir_usage(&dir, size, largest);
+    dir_close(&dir);
+
+    return ret;
+}
+
+/**
+ * Get size on disk for a directory
+ * Similar functionality with du -c
+ * @param path Directory path
+ * @param size Directory size
+ *
+ * @return 0 for success, negative value in case of an error
+ */
+int get_dir_size(const char *path, off64_t * size)
+{
+    off64_t largest = 0;
+
+    return get_dir_usage(path, size, &largest);
+}
+
+/**
+ * Check whether there is enough space on disk to create storage
+ * Each file grows by its ecryptfs header and last extent for good. A
+ * migrating copy also needs room for every worker copying the largest
+ * file, which is only removed once whole, plus one batch of copies not
+ * yet synced
+ *
+ * @param path Path to storage
+ * @param scan Scan of path, NULL to walk it here
+ * @param migrate Sources are removed while copying
+ *
+ * @return 1 if enough space exists, 0 otherwise
+ */
+int check_space(const char *path, const struct tree_scan *scan, int migrate)
+{
+    struct statvfs stat;
+    struct copy_options opts;
+    struct tree_scan local;
+    off64_t need, in_flight, overhead;
+    int ret;
+
+    if (!scan) {
+        ret = scan_tree(path, SCAN_SKIP_TRASH, &local);
+        if (ret < 0) {
+            LOGE("Failed to compute storage size %s", path);
+            return ret;
+        }
+        scan = &local;
+    }
+
+    memset(&stat, 0, sizeof(stat));
+    ret = statvfs(path, &stat);
+    if (ret < 0) {
+        LOGE("Failed to compute free space for storage %s", path);
+        if (scan == &local)
+            free_scan(&local);
+        return ret;
+    }
+
+    init_copy_options(&opts);
+    overhead = scan->files * (off64_t)(ECRYPTFS_HEADER_SIZE +
+                                       ECRYPTFS_EXTENT_SIZE);
+    in_flight = opts.threads * scan->largest + MIGRATE_BATCH_BYTES;
+
+    need = scan->size;
+    if (migrate && in_flight < need)
+        need = in_flight;
+    need += overhead;
+
+    if (scan == &local)
+        free_scan(&local);
+
+    if (need < (off64_t)stat.f_bsize * stat.f_bfree)
+        return 1;
+
+    return 0;
+}
+
+/**
+ * Restore attributes of a copied file or directory through its open fd
+ * This avoids a path lookup per attribute, which is expensive on the
+ * ecryptfs encrypted filename layer
+ *
+ * @param fd Open destination
+ * @param path Destination path, for logging
+ * @param attr Source attributes
+ * @param cons Context table
+ * @param con Context id
+ *
+ * @return 0 for success, negative value in case of an error
+ */
+static int restore_attrs(int fd, const char *path,
+             const struct file_attr *attr, struct con_table *cons,
+             uint32_t con)
+{
+    struct timespec times[2];
+    int ret;
+
+    ret = con_set_fd(cons, fd, con);
+    if (ret < 0) {
+        LOGE("Unable to set context of %s\n", path);
+        return ret;
+    }
+
+    ret = fchown(fd, attr->uid, attr->gid);
+    if (ret < 0) {
+        LOGE("chown %s fail\n", path);
+        return ret;
+    }
+
+    ret = fchmod(fd, attr->mode);
+    if (ret < 0) {
+        LOGE("chmod %s fail\n", path);
+        return ret;
+    }
+
+    /* Save access times */
+    file_attr_times(attr, times);
+    ret = futimens(fd, times);
+    if (ret != 0) {
+        LOGE("utime on %s failed", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Create one directory relative to its parent and restore its attributes
+ * When resuming, directories already journaled are only opened and
+ * existing ones get their attributes restored again
+ *
+ * @param dirfd Destination parent directory
+ * @param fi Source directory
+ * @param src_path Source path, the top of the journaled paths
+ * @param cons Context table
+ * @param journal Resume journal, NULL if not used
+ *
+ * @return Open destination directory, negative value on error
+ */
+static int create_dir(int dirfd, file_info *fi, const char *src_path,
+              struct con_table *cons, struct journal *journal)
+{
+    const char *name = fi->name;
+    char *path = journal ? node_path(src_path, fi) : NULL;
+    int fd, ret, done;
+
+    done = journal && journal_done(journal, path, &fi->attr);
+
+    if (!done) {
+        ret = mkdirat(dirfd, name, fi->attr.mode);
+        if (ret < 0 && !(journal && errno == EEXIST)) {
+            LOGE("mkdir %s fail\n", name);
+            free(path);
+            return ret;
+        }
+    }
+
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("open %s fail\n", name);
+        free(path);
+        return fd;
+    }
+    if (done) {
+        free(path);
+        return fd;
+    }
+
+    ret = restore_attrs(fd, name, &fi->attr, cons, fi->con);
+    if (ret == 0 && journal)
+        ret = journal_record(journal, path, &fi->attr);
+    free(path);
+    if (ret < 0) {
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+/**
+ * Create directory infrastructure and store it on disk
+ * Directories are created in tree order relative to their parent, with
+ * the open destination directories of the current branch on a stack
+ * Used in context with copy file or copy directory
+ * @param tree Walk of the source
+ * @param src_path Source path
+ * @param dst_path Destination path
+ * @param journal Resume journal, NULL if not used
+ *
+ * @return 0 on success, negative value on error
+ */
+static int create_dirs(struct file_tree *tree, const char *src_path,
+               const char *dst_path, struct journal *journal)
+{
+    struct dir_stack_entry *stack;
+    file_info *iter, **dirs;
+    int nr = 0, top = 0, i, fd, ret = 0;
+
+    for (iter = tree->dir_list; iter; iter = iter->next)
+        nr++;
+    if (!nr)
+        return 0;
+
+    dirs = malloc(nr * sizeof(file_info *));
+    stack = malloc((nr + 1) * sizeof(struct dir_stack_entry));
+    if (!dirs || !stack) {
+        LOGE("insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The list is a stack; walking it backwards gives parents first */
+    i = nr;
+    for (iter = tree->dir_list; iter; iter = iter->next)
+        dirs[--i] = iter;
+
+    stack[0].fi = NULL;
+    stack[0].fd = open(dst_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (stack[0].fd < 0) {
+        LOGE("Can't open %s\n", dst_path);
+        free(dirs);
+        free(stack);
+        return -1;
+    }
+
+    for (i = 0; i < nr; i++) {
+        while (top > 0 && stack[top].fi != dirs[i]->parent)
+            close(stack[top--].fd);
+
+        fd = create_dir(stack[top].fd, dirs[i], src_path, tree->cons,
+                        journal);
+        if (fd < 0) {
+            LOGE("Can't copy %s\n", dirs[i]->name);
+            ret = -1;
+            break;
+        }
+        top++;
+        stack[top].fi = dirs[i];
+        stack[top].fd = fd;
+    }
+
+    while (top >= 0)
+        close(stack[top--].fd);
+    free(dirs);
+    free(stack);
+    return ret;
+}
+
+/**
+ * Account copied bytes and export the progress through a system property
+ *
+ * @param n Number of bytes copied
+ * @param arg Progress shared by all copy workers
+ */
+static void progress_update(off64_t n, void *arg)
+{
+    struct copy_progress *progress = arg;
+    char buff[PROPERTY_VALUE_MAX];
+    int percent, ret;
+
+    pthread_mutex_lock(&progress->lock);
+    progress->done += n;
+    if (progress->total > 0) {
+        percent = progress->done * 100 / progress->total;
+        if (percent > 100)
+            percent = 100;
+        // check if update is required
+        if (percent != progress->percent) {
+            progress->percent = percent;
+            memset(buff, 0, sizeof(buff));
+            snprintf(buff, sizeof(buff), "%d", percent);
+            ret = property_set(progress->property, buff);
+            if (ret < 0) {
+                LOGE("property_set");
+            }
+        }
+    }
+    pthread_mutex_unlock(&progress->lock);
+}
+
+/**
+ * Progress callback of the copy jobs; a background copy may wait here
+ *
+ * @param n Number of bytes copied
+ * @param arg Copy context
+ */
+static void copy_progress(off64_t n, void *arg)
+{
+    struct copy_ctx *ctx = arg;
+
+    progress_update(n, &ctx->progress);
+    throttle_account(&ctx->throttle, n);
+}
+
+/**
+ * Sync the copies and remove their sources
+ * The batch is owned by the caller, so the queue lock need not be held
+ *
+ * @param queue Migrate queue
+ * @param paths Sources of the batch, freed here
+ * @param nr_paths Number of sources
+ *
+ * @return 0 on success, negative value on error
+ */
+static int migrate_flush(struct migrate_queue *queue, char **paths,
+                         int nr_paths)
+{
+    int i, ret = 0;
+
+    if (nr_paths == 0)
+        return 0;
+
+    /* Destination first; for ecryptfs the source fs is the lower one */
+    if (syscall(__NR_syncfs, queue->dst_fd) < 0 ||
+        syscall(__NR_syncfs, queue->src_fd) < 0) {
+        LOGE("syncfs failed: %s", strerror(errno));
+        ret = -1;
+    }
+
+    for (i = 0; i < nr_paths; i++) {
+        /* Sources are only removed once their copies are on disk */
+        if (ret == 0 && unlink(paths[i]) < 0 && errno != ENOENT) {
+            LOGE("unable to remove %s\n", paths[i]);
+            ret = -1;
+        }
+        free(paths[i]);
+        paths[i] = NULL;
+    }
+
+    return ret;
+}
+
+/**
+ * Queue a copied source for removal
+ * Sources are removed in batches of MIGRATE_BATCH_FILES files or
+ * MIGRATE_BATCH_BYTES bytes, after a sync of both filesystems. A full
+ * batch is swapped out under the lock and flushed outside of it, so the
+ * other workers keep copying meanwhile
+ *
+ * @param ctx Copy context
+ * @param path Source path
+ * @param size Source size
+ *
+ * @return 0 on success, negative value on error
+ */
+static int migrate_add(struct copy_ctx *ctx, const char *path, off64_t size)
+{
+    struct migrate_queue *queue = &ctx->unlinks;
+    char **batch = NULL, **fresh;
+    int nr_paths = 0, ret = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->paths[queue->nr_paths] = strdup(path);
+    if (!queue->paths[queue->nr_paths]) {
+        LOGE("insufficient memory\n");
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+    queue->nr_paths++;
+    queue->bytes += size;
+
+    if (queue->nr_paths == queue->size || queue->bytes >= MIGRATE_BATCH_BYTES) {
+        fresh = calloc(queue->size, sizeof(char *));
+        if (fresh) {
+            batch = queue->paths;
+            nr_paths = queue->nr_paths;
+            queue->paths = fresh;
+        } else {
+            /* Can't swap; the queue must be emptied before the next add */
+            ret = migrate_flush(queue, queue->paths, queue->nr_paths);
+        }
+        queue->nr_paths = 0;
+        queue->bytes = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (batch) {
+        ret = migrate_flush(queue, batch, nr_paths);
+        free(batch);
+    }
+
+    return ret;
+}
+
+/**
+ * Set up the migrate queue of a copy
+ *
+ * @param ctx Copy context
+ *
+ * @return 0 on success, negative value on error
+ */
+static int migrate_init(struct copy_ctx *ctx)
+{
+    struct migrate_queue *queue = &ctx->unlinks;
+
+    queue->src_fd = open(ctx->src_path, O_RDONLY | O_DIRECTORY);
+    queue->dst_fd = open(ctx->dst_path, O_RDONLY | O_DIRECTORY);
+    queue->size = MIGRATE_BATCH_FILES;
+    queue->paths = calloc(queue->size, sizeof(char *));
+    if (queue->src_fd < 0 || queue->dst_fd < 0 || !queue->paths) {
+        LOGE("Unable to set up migration from %s\n", ctx->src_path);
+        if (queue->src_fd >= 0)
+            close(queue->src_fd);
+        if (queue->dst_fd >= 0)
+            close(queue->dst_fd);
+        free(queue->paths);
+        return -1;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+
+    return 0;
+}
+
+/**
+ * Remove the remaining copied sources and release the queue
+ *
+ * @param ctx Copy context
+ *
+ * @return 0 on success, negative value on error
+ */
+static int migrate_destroy(struct copy_ctx *ctx)
+{
+    struct migrate_queue *queue = &ctx->unlinks;
+    int ret;
+
+    /* The workers are done; no batch is being flushed */
+    ret = migrate_flush(queue, queue->paths, queue->nr_paths);
+    queue->nr_paths = 0;
+
+    pthread_mutex_destroy(&queue->lock);
+    close(queue->src_fd);
+    close(queue->dst_fd);
+    free(queue->paths);
+
+    return ret;
+}
+
+/**
+ * Build the source path of a node for the journal and the migration
+ *
+ * @param ctx Copy context
+ * @param fi File node
+ *
+ * @return Path released with free, NULL if neither needs it
+ */
+static char *copy_path(struct copy_ctx *ctx, const file_info *fi)
+{
+    if (!ctx->journal && !ctx->migrate)
+        return NULL;
+
+    return node_path(ctx->src_path, fi);
+}
+
+/**
+ * Handle a source entry whose copy is complete
+ *
+ * @param ctx Copy context
+ * @param path Source path
+ * @param attr Source attributes
+ *
+ * @return 0 on success, negative value on error
+ */
+static int copy_done(struct copy_ctx *ctx, const char *path,
+             const struct file_attr *attr)
+{
+    int ret;
+
+    __sync_fetch_and_add(&ctx->stats.files, 1);
+
+    if (ctx->journal) {
+        ret = journal_record(ctx->journal, path, attr);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (ctx->migrate)
+        return migrate_add(ctx, path, S_ISREG(attr->mode) ? attr->size : 0);
+
+    return 0;
+}
+
+/**
+ * Account a copied file in the run statistics
+ *
+ * @param ctx Copy context
+ * @param bytes Data bytes copied
+ * @param holes Bytes of holes skipped
+ */
+static void stats_add(struct copy_ctx *ctx, off64_t bytes, off64_t holes)
+{
+    __sync_fetch_and_add(&ctx->stats.bytes, bytes);
+    __sync_fetch_and_add(&ctx->stats.holes, holes);
+}
+
+/**
+ * Open the top directories of a copy
+ *
+ * @param cache Directory cache
+ * @param src_path Source
+ * @param dst_path Destination
+ * @param stream Nodes are allocated and released by a streaming copy
+ *
+ * @return 0 on success, negative value on error
+ */
+static int dir_cache_init(struct dir_cache *cache, const char *src_path,
+              const char *dst_path, int stream)
+{
+    memset(cache, 0, sizeof(struct dir_cache));
+    cache->stream = stream;
+    cache->root.refs = 1;
+
+    cache->root.src_fd = open(src_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    cache->root.dst_fd = open(dst_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cache->root.src_fd < 0 || cache->root.dst_fd < 0) {
+        LOGE("Can't open %s or %s\n", src_path, dst_path);
+        if (cache->root.src_fd >= 0)
+            close(cache->root.src_fd);
+        if (cache->root.dst_fd >= 0)
+            close(cache->root.dst_fd);
+        return -1;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return 0;
+}
+
+static unsigned int dir_hash(const file_info *node)
+{
+    return ((uintptr_t)node >> 4) % DIR_CACHE_BUCKETS;
+}
+
+static void dir_free(struct dir_cache *cache, struct dir_handle *h)
+{
+    close(h->src_fd);
+    close(h->dst_fd);
+    if (cache->stream)
+        node_put(h->node);
+    free(h);
+}
+
+static void dir_idle_remove(struct dir_cache *cache, struct dir_handle *h)
+{
+    if (h->older)
+        h->older->newer = h->newer;
+    else
+        cache->oldest = h->newer;
+    if (h->newer)
+        h->newer->older = h->older;
+    else
+        cache->newest = h->older;
+    h->older = h->newer = NULL;
+    cache->nr_idle--;
+}
+
+static void dir_idle_add(struct dir_cache *cache, struct dir_handle *h)
+{
+    h->older = cache->newest;
+    if (cache->newest)
+        cache->newest->newer = h;
+    else
+        cache->oldest = h;
+    cache->newest = h;
+    cache->nr_idle++;
+}
+
+static void dir_insert(struct dir_cache *cache, struct dir_handle *h)
+{
+    unsigned int i = dir_hash(h->node);
+
+    h->next = cache->table[i];
+    cache->table[i] = h;
+}
+
+/**
+ * Release a directory handle; caller holds the cache lock
+ * The handle stays open on the idle list, and the oldest idle handle is
+ * closed once there are more than DIR_CACHE_IDLE
+ *
+ * @param cache Directory cache
+ * @param h Directory handle
+ */
+static void dir_put_locked(struct dir_cache *cache, struct dir_handle *h)
+{
+    struct dir_handle **p, *old;
+
+    if (h == &cache->root || --h->refs > 0)
+        return;
+
+    dir_idle_add(cache, h);
+    if (cache->nr_idle <= DIR_CACHE_IDLE)
+        return;
+
+    old = cache->oldest;
+    dir_idle_remove(cache, old);
+    for (p = &cache->table[dir_hash(old->node)]; *p != old; p = &(*p)->next)
+        ;
+    *p = old->next;
+    dir_free(cache, old);
+}
+
+/**
+ * Get the handle of a directory; caller holds the cache lock
+ * A directory that is not open is opened relative to its parent, which
+ * is opened the same way if needed
+ *
+ * @param cache Directory cache
+ * @param node Directory node, NULL for the top of the copy
+ *
+ * @return Directory handle, NULL on error
+ */
+static struct dir_handle *dir_get_locked(struct dir_cache *cache,
+                     file_info *node)
+{
+    struct dir_handle *h, *parent;
+
+    if (!node)
+        return &cache->root;
+
+    for (h = cache->table[dir_hash(node)]; h; h = h->next) {
+        if (h->node != node)
+            continue;
+        if (h->refs++ == 0)
+            dir_idle_remove(cache, h);
+        return h;
+    }
+
+    parent = dir_get_locked(cache, node->parent);
+    if (!parent)
+        return NULL;
+
+    h = calloc(1, sizeof(struct dir_handle));
+    if (!h) {
+        LOGE("insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    h->src_fd = openat(parent->src_fd, node->name,
+                       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    h->dst_fd = openat(parent->dst_fd, node->name,
+                       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir_put_locked(cache, parent);
+    if (h->src_fd < 0 || h->dst_fd < 0) {
+        LOGE("Can't open directory %s\n", node->name);
+        if (h->src_fd >= 0)
+            close(h->src_fd);
+        if (h->dst_fd >= 0)
+            close(h->dst_fd);
+        free(h);
+        return NULL;
+    }
+
+    h->node = node;
+    h->refs = 1;
+    if (cache->stream)
+        node_get(node);
+    dir_insert(cache, h);
+
+    return h;
+}
+
+/**
+ * Get the handle of a directory to copy its entries
+ *
+ * @param cache Directory cache
+ * @param node Directory node, NULL for the top of the copy
+ *
+ * @return Directory handle, NULL on error
+ */
+static struct dir_handle *dir_get(struct dir_cache *cache, file_info *node)
+{
+    struct dir_handle *h;
+
+    pthread_mutex_lock(&cache->lock);
+    h = dir_get_locked(cache, node);
+    pthread_mutex_unlock(&cache->lock);
+
+    return h;
+}
+
+static void dir_put(struct dir_cache *cache, struct dir_handle *h)
+{
+    pthread_mutex_lock(&cache->lock);
+    dir_put_locked(cache, h);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Hand the directories opened by a streaming walk over to the cache
+ *
+ * @param cache Directory cache
+ * @param node Directory node
+ * @param src_fd Source directory, owned by the handle
+ * @param dst_fd Destination directory, owned by the handle
+ *
+ * @return Directory handle, released with dir_put
+ */
+static struct dir_handle *dir_add(struct dir_cache *cache, file_info *node,
+                  int src_fd, int dst_fd)
+{
+    struct dir_handle *h;
+
+    h = calloc(1, sizeof(struct dir_handle));
+    if (!h) {
+        LOGE("insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    h->node = node;
+    h->src_fd = src_fd;
+    h->dst_fd = dst_fd;
+    h->refs = 1;
+    if (cache->stream)
+        node_get(node);
+
+    pthread_mutex_lock(&cache->lock);
+    dir_insert(cache, h);
+    pthread_mutex_unlock(&cache->lock);
+
+    return h;
+}
+
+/**
+ * Close every directory of a copy
+ *
+ * @param cache Directory cache
+ */
+static void dir_cache_destroy(struct dir_cache *cache)
+{
+    struct dir_handle *h, *next;
+    int i;
+
+    for (i = 0; i < DIR_CACHE_BUCKETS; i++) {
+        for (h = cache->table[i]; h; h = next) {
+            next = h->next;
+            dir_free(cache, h);
+        }
+        cache->table[i] = NULL;
+    }
+    close(cache->root.src_fd);
+    close(cache->root.dst_fd);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/**
+ * Open a copy source according to the page cache policy
+ *
+ * @param ctx Copy context
+ * @param dir Directory of the source
+ * @param name Source name
+ * @param direct Set if the file was opened with O_DIRECT
+ *
+ * @return File descriptor, negative value on error
+ */
+static int open_source(struct copy_ctx *ctx, struct dir_handle *dir,
+               const char *name, int *direct)
+{
+    int fd;
+
+    *direct = 0;
+    if (ctx->cache == COPY_CACHE_DIRECT) {
+        fd = openat(dir->src_fd, name, O_RDONLY | O_DIRECT);
+        if (fd >= 0) {
+            *direct = 1;
+            return fd;
+        }
+        /* ecryptfs and a few others refuse O_DIRECT */
+    }
+
+    return openat(dir->src_fd, name, O_RDONLY);
+}
+
+/**
+ * Open the next file of a batch and start reading it ahead
+ * The kernel does not read ahead across files, so without the hint every
+ * small file waits for its own read
+ *
+ * @param ctx Copy context
+ * @param dir Directory of the file
+ * @param fi Next file
+ *
+ * @return File descriptor, -1 if nothing was prefetched
+ */
+static int prefetch_file(struct copy_ctx *ctx, struct dir_handle *dir,
+             file_info *fi)
+{
+    off64_t len = fi->attr.size;
+    char *path;
+    int fd, done;
+
+    if (ctx->cache != COPY_CACHE_DROP || !S_ISREG(fi->attr.mode) ||
+        fi->attr.size == 0)
+        return -1;
+    if (ctx->journal) {
+        path = node_path(ctx->src_path, fi);
+        done = journal_done(ctx->journal, path, &fi->attr);
+        free(path);
+        if (done)
+            return -1;
+    }
+
+    fd = openat(dir->src_fd, fi->name, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (len > CACHE_WINDOW_SIZE)
+        len = CACHE_WINDOW_SIZE;
+    posix_fadvise64(fd, 0, len, POSIX_FADV_WILLNEED);
+
+    return fd;
+}
+
+/**
+ * Copy a file
+ *
+ * @param ctx Copy context
+ * @param worker Index of the calling worker
+ * @param dir Directory of the file
+ * @param fi Source file
+ * @param fd_src Source opened by prefetch_file, -1 to open it here;
+ * closed on return
+ *
+ * @return 0 for success, negative value in case of an error
+ */
+static int copy_file(struct copy_ctx *ctx, int worker, struct dir_handle *dir,
+             file_info *fi, int fd_src)
+{
+    const struct file_attr *attr = &fi->attr;
+    const char *name = fi->name;
+    int ret = -1;
+    int fd_dst, direct = 0;
+    uint32_t con;
+    off64_t range;
+    struct copy_job job;
+    char *buffer;
+
+    buffer = buffer_pool_get(&ctx->buffers, worker);
+    if (!buffer) {
+        if (fd_src >= 0)
+            close(fd_src);
+        return -1;
+    }
+
+    if (fd_src < 0)
+        fd_src = open_source(ctx, dir, name, &direct);
+    if (fd_src < 0) {
+        LOGE("open %s failed\n", name);
+        return fd_src;
+    }
+
+    /* Truncate what an interrupted run may have left */
+    fd_dst = openat(dir->dst_fd, name, O_CREAT | O_WRONLY | O_TRUNC,
+                    attr->mode);
+    if (fd_dst < 0) {
+        LOGE("open %s failed\n", name);
+        close(fd_src);
+        return fd_dst;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.fd_src = fd_src;
+    job.cache = ctx->cache;
+    job.direct = direct;
+    job.fd_dst = fd_dst;
+    job.buffer = buffer;
+    job.buffer_size = ctx->buffers.size;
+    job.progress = copy_progress;
+    job.arg = ctx;
+    job.sparse = (attr->flags & FILE_ATTR_SPARSE) != 0;
+
+    /*
+     * Huge files are copied a range at a time so that an aborted copy
+     * stops early. The ranges are written in order: a write past the
+     * end of an ecryptfs file encrypts the zeros of the gap, so the
+     * destination is never extended ahead of the data.
+     */
+    range = attr->size >= HUGE_FILE_SIZE ? HUGE_CHUNK_SIZE : 0;
+    for (;;) {
+        job.end = range ? job.pos + range : -1;
+        ret = copy_data(ctx->method, &job);
+        if (ret < 0 || !range || job.pos < job.end)
+            break;
+        if (work_pool_aborted(ctx->pool)) {
+            ret = -ECANCELED;
+            break;
+        }
+    }
+    if (ret < 0) {
+        LOGE("Error copying %s: %s\n", name, strerror(-ret));
+        ret = -1;
+        goto out;
+    }
+
+    /* Recreate a trailing hole */
+    if (job.skipped && ftruncate64(fd_dst, job.pos) < 0) {
+        LOGE("truncate %s failed\n", name);
+        ret = -1;
+        goto out;
+    }
+    stats_add(ctx, job.pos - job.skipped, job.skipped);
+
+    /* The source is removed after a migration, check the copy first */
+    if (ctx->migrate && job.pos != attr->size) {
+        LOGE("Short copy of %s: %lld of %lld bytes\n", name,
+             (long long)job.pos, (long long)attr->size);
+        ret = -1;
+        goto out;
+    }
+
+    /* Read from the open source rather than by path during the walk */
+    ret = con_get_fd(ctx->cons, fd_src, &con);
+    if (ret < 0) {
+        LOGE("Unable to get context of %s\n", name);
+        goto out;
+    }
+    ret = restore_attrs(fd_dst, name, attr, ctx->cons, con);
+
+out:
+    close(fd_src);
+    close(fd_dst);
+    return ret;
+}
+
+/**
+ * Copy a symbolic link
+ * Its context is set by path, as a link can't be opened
+ *
+ * @param ctx Copy context
+ * @param dir Directory of the link
+ * @param fi Source link informations
+ *
+ * @return 0 on success, negative value if an error occurs
+ */
+static int copy_symlink(struct copy_ctx *ctx, struct dir_handle *dir,
+            file_info *fi)
+{
+    const char *name = fi->name;
+    char *linkname, *path;
+    int ret = -1;
+
+    linkname = malloc(fi->attr.size + 1);
+    if (linkname == NULL) {
+        LOGE("insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    ret = readlinkat(dir->src_fd, name, linkname, fi->attr.size + 1);
+    if (ret < 0) {
+        free(linkname);
+        LOGE("readlink %s failed\n", name);
+        return -1;
+    }
+    linkname[fi->attr.size] = '\0';
+    ret = symlinkat(linkname, dir->dst_fd, name);
+    /* Left by an interrupted run */
+    if (ret < 0 && errno == EEXIST && unlinkat(dir->dst_fd, name, 0) == 0)
+        ret = symlinkat(linkname, dir->dst_fd, name);
+    free(linkname);
+    if (ret < 0) {
+        LOGE("can't create symlink %s", name);
+        return ret;
+    }
+
+    path = node_path(ctx->dst_path, fi);
+    ret = con_set_path(ctx->cons, path, fi->con);
+    free(path);
+    if (ret < 0) {
+        LOGE("Unable to set context of %s\n", name);
+        return ret;
+    }
+
+    ret = fchownat(dir->dst_fd, name, fi->attr.uid, fi->attr.gid,
+                   AT_SYMLINK_NOFOLLOW);
+    if (ret < 0) {
+        LOGE("lchown %s fail\n", name);
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Skip an entry copied by an interrupted run
+ *
+ * @param ctx Copy context
+ * @param path Source path from copy_path
+ * @param fi Source file
+ *
+ * @return 1 if skipped, 0 if it must be copied, negative value on error
+ */
+static int skip_done(struct copy_ctx *ctx, const char *path, file_info *fi)
+{
+    if (!ctx->journal || !journal_done(ctx->journal, path, &fi->attr))
+        return 0;
+
+    progress_update(fi->attr.size, &ctx->progress);
+    if (ctx->migrate && migrate_add(ctx, path, 0) < 0)
+        return -1;
+
+    return 1;
+}
+
+/**
+ * Copy one entry of the file list
+ *
+ * @param ctx Copy context
+ * @param worker Worker index
+ * @param dir Directory of the entry
+ * @param fi File node
+ * @param fd_src Source opened by prefetch_file or -1; closed on return
+ *
+ * @return 0 on success, negative value if an error occurs
+ */
+static int copy_one(struct copy_ctx *ctx, int worker, struct dir_handle *dir,
+            file_info *fi, int fd_src)
+{
+    char *path = copy_path(ctx, fi);
+    int ret;
+
+    ret = skip_done(ctx, path, fi);
+    if ((ret != 0 || S_ISLNK(fi->attr.mode)) && fd_src >= 0) {
+        close(fd_src);
+        fd_src = -1;
+    }
+    if (ret != 0) {
+        free(path);
+        return ret < 0 ? ret : 0;
+    }
+
+    if (S_ISLNK(fi->attr.mode))
+        ret = copy_symlink(ctx, dir, fi);
+    else
+        ret = copy_file(ctx, worker, dir, fi, fd_src);
+    if (ret < 0)
+        LOGE("Copying %s failed\n", fi->name);
+    else
+        ret = copy_done(ctx, path, &fi->attr);
+    free(path);
+
+    return ret;
+}
+
+/**
+ * Release a task queued by a streaming copy, with the nodes it owns
+ *
+ * @param item Copy task
+ */
+static void release_task(void *item)
+{
+    struct copy_task *task = item;
+    int i;
+
+    for (i = 0; i < task->nr_files; i++)
+        node_put(task->files[i]);
+    free(task);
+}
+
+/**
+ * Run a copy task; called from the copy workers
+ * The directory of the previous file is kept for the next one, and only
+ * a file of the same directory is read ahead
+ *
+ * @param item Copy task
+ * @param worker Worker index
+ * @param arg Copy context
+ *
+ * @return 0 on success, negative value if an error occurs
+ */
+static int copy_entry(void *item, int worker, void *arg)
+{
+    struct copy_task *task = item;
+    struct copy_ctx *ctx = arg;
+    struct dir_handle *dir = NULL;
+    file_info *fi;
+    int i, fd, next = -1, ret = 0;
+
+    for (i = 0; i < task->nr_files; i++) {
+        fi = task->files[i];
+        if (!dir || dir->node != fi->parent) {
+            if (dir)
+                dir_put(&ctx->dirs, dir);
+            dir = dir_get(&ctx->dirs, fi->parent);
+            if (!dir) {
+                ret = -1;
+                break;
+            }
+        }
+
+        fd = next;
+        next = -1;
+        /* Read the next file ahead while this one is copied */
+        if (i + 1 < task->nr_files && task->files[i + 1]->parent == fi->parent)
+            next = prefetch_file(ctx, dir, task->files[i + 1]);
+
+        ret = copy_one(ctx, worker, dir, fi, fd);
+        if (ret < 0 || work_pool_aborted(ctx->pool))
+            break;
+    }
+
+    if (next >= 0)
+        close(next);
+    if (dir)
+        dir_put(&ctx->dirs, dir);
+
+    if (ctx->stream)
+        release_task(task);
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Split the file list into copy tasks by size class
+ * Small files and links are grouped in batches and the rest get one task
+ * each. Huge files are queued first, so that the rest of the copy runs
+ * next to them instead of after them.
+ *
+ * @param file_list File list
+ * @param sched Resulting schedule
+ *
+ * @return 0 on success, negative value if an error occurs
+ */
+static int schedule_copy(file_info ** file_list, struct copy_schedule *sched)
+{
+    struct copy_task *task = NULL;
+    file_info *iter;
+    int nr_files = 0, huge;
+
+    memset(sched, 0, sizeof(struct copy_schedule));
+
+    for (iter = *file_list; iter; iter = iter->next)
+        if (!iter->link)
+            nr_files++;
+
+    sched->files = calloc(nr_files + 1, sizeof(file_info *));
+    sched->tasks = calloc(nr_files + 1, sizeof(struct copy_task));
+    if (!sched->files || !sched->tasks) {
+        LOGE("insufficient memory\n");
+        return -1;
+    }
+
+    nr_files = 0;
+    for (huge = 1; huge >= 0; huge--) {
+        for (iter = *file_list; iter; iter = iter->next) {
+            off64_t size = S_ISREG(iter->attr.mode) ? iter->attr.size : 0;
+
+            /* Hard links are created once all files are copied */
+            if (iter->link || (size >= HUGE_FILE_SIZE) != huge)
+                continue;
+
+            sched->files[nr_files] = iter;
+            if (size < SMALL_FILE_SIZE && task &&
+                task->nr_files < SMALL_BATCH_FILES) {
+                task->nr_files++;
+            } else {
+                task = &sched->tasks[sched->nr_tasks++];
+                task->files = &sched->files[nr_files];
+                task->nr_files = 1;
+                /* Larger files never share a task */
+                if (size >= SMALL_FILE_SIZE)
+                    task = NULL;
+            }
+            nr_files++;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Release a copy schedule
  *
- * @param path Path to storage
- *
- * @return 1 if enough space exists, 0 otherwise
+ * @param sched Copy schedule
  */
-int check_space(const char *path)
+static void free_schedule(struct copy_schedule *sched)
 {
-    struct statvfs stat;
-    off64_t size = 0;
-    int ret;
+    free(sched->tasks);
+    free(sched->files);
+}
 
-    ret = get_dir_size(path, &size);
-    if (ret < 0) {
-        LOGE("Failed to compute storage size %s", path);
-        return ret;
-    }
+/* Source entry of a file handed to the io_uring engine */
+struct uring_entry {
+    struct copy_ctx *ctx;
+    file_info *fi;
+    struct dir_handle *dir;     /* held while the file is in a slot */
+};
 
-    memset(&stat, 0, sizeof(stat));
-    ret = statvfs(path, &stat);
-    if (ret < 0) {
-        LOGE("Failed to compute free space for storage %s", path);
-        return ret;
-    }
+/**
+ * Open the directories of a file about to be started by the io_uring
+ * engine; they are released when the file is done
+ *
+ * @param file File to start
+ * @param arg Unused
+ *
+ * @return 0 on success, negative value on error
+ */
+static int uring_file_start(struct uring_file *file, void *arg)
+{
+    struct uring_entry *entry = file->arg;
 
-    if ((unsigned)size < stat.f_bsize * stat.f_bfree)
-        return 1;
+    entry->dir = dir_get(&entry->ctx->dirs, entry->fi->parent);
+    if (!entry->dir)
+        return -1;
+    file->src_dirfd = entry->dir->src_fd;
+    file->dst_dirfd = entry->dir->dst_fd;
 
     return 0;
 }
 
 /**
- * Create a file node to hold informations about a file
+ * Finish a file started by the io_uring engine
  *
- * @param path File path
- * @param st File stat
+ * @param file Finished file
+ * @param error Result of the copy
+ * @param arg Unused
  *
- * @return A pointer to the new file node
+ * @return 0 on success, negative value on error
  */
-static file_info *create_node(const char *path, struct stat *st,
-                security_context_t con)
+static int uring_file_done(struct uring_file *file, int error, void *arg)
 {
-    int len = strlen(path);
+    struct uring_entry *entry = file->arg;
+    struct copy_ctx *ctx = entry->ctx;
+    struct stat st;
+    char *path;
+    int ret;
 
-    file_info *fi = malloc(sizeof(file_info) + len + 1);
-    if (fi == 0) {
-        LOGE("insufficient memory\n");
-        exit(EXIT_FAILURE);;
+    if (!error && ctx->migrate) {
+        if (fstatat(file->dst_dirfd, file->name, &st,
+                    AT_SYMLINK_NOFOLLOW) < 0 || st.st_size != file->attr->size) {
+            LOGE("Short copy of %s\n", file->name);
+            error = -1;
+        }
     }
+    dir_put(&ctx->dirs, entry->dir);
+    if (error)
+        return error;
 
-    memset(fi, 0, sizeof(file_info) + len + 1);
-    memcpy(&fi->st, st, sizeof(struct stat));
-    fi->con = con;
-    fi->next = NULL;
-    fi->path = (char *)(fi + 1);
-    strncpy(fi->path, path, len);
+    stats_add(ctx, file->attr->size, 0);
+    path = copy_path(ctx, entry->fi);
+    ret = copy_done(ctx, path, file->attr);
+    free(path);
 
-    return fi;
+    return ret;
 }
 
 /**
- * Generate all files from a Directory path
- * Similar functionality with ls -R
- * @param path Directory path
- * @param file_list List of files
- * @param dir_list  List of directories
+ * Copy the file list with the io_uring engine
+ * Symbolic links are created synchronously, regular files go through
+ * the ring
  *
- * @return 0 on success, negative number in case of an error
+ * @param ctx Copy context
+ * @param file_list File list
+ *
+ * @return 0 on success, -ENOSYS if io_uring is unavailable and nothing
+ * was copied, other negative value on error
  */
-static int generate_file_list(const char *path, file_info ** file_list,
-                  file_info ** dir_list)
+static int copy_files_uring(struct copy_ctx *ctx, file_info ** file_list)
 {
-    DIR *dir;
-    struct dirent *dirent;
-    struct stat st;
-    security_context_t con;
-    int len;
-    char *file_path;
-    file_info *node;
-    int ret = -1;
-
-    len = strlen(path);
-    if (len > MAX_PATH_LENGTH) {
-        LOGE("Invalid argument %s\n", path);
-        return -1;
-    }
-
-    dir = opendir(path);
-    if (!dir) {
-        LOGE("open dir %s failed", path);
-        return -1;
+    struct uring_file *files;
+    struct uring_entry *entries;
+    struct dir_handle *dir;
+    file_info *iter;
+    char *path = NULL;
+    int nr = 0, ret = 0;
+
+    if (!uring_available())
+        return -ENOSYS;
+
+    for (iter = *file_list; iter; iter = iter->next)
+        nr++;
+
+    files = calloc(nr ? nr : 1, sizeof(struct uring_file));
+    entries = calloc(nr ? nr : 1, sizeof(struct uring_entry));
+    if (!files || !entries) {
+        LOGE("insufficient memory\n");
+        ret = -1;
+        goto out;
     }
 
-    while ((dirent = readdir(dir))) {
-        int file_len = strlen(dirent->d_name);
+    nr = 0;
+    for (iter = *file_list; iter; iter = iter->next) {
+        if (iter->link)
+            continue;
 
-        /* This should not happen */
-        if (file_len > MAX_FILE_LENGTH) {
-            LOGE("file system error\n");
-            closedir(dir);
-            return -1;
+        free(path);
+        path = copy_path(ctx, iter);
+        ret = skip_done(ctx, path, iter);
+        if (ret < 0)
+            goto out;
+        if (ret) {
+            ret = 0;
+            continue;
         }
-        /* Ignore /. and /.. */
-        if (file_len == 1 || file_len == 2) {
-            if (dirent->d_name[0] == '.') {
-                if (dirent->d_name[1] == '\0')
-                    continue;
-                if ((dirent->d_name[1] == '.')
-                    && (dirent->d_name[2] == '\0'))
-                    continue;
+
+        if (S_ISLNK(iter->attr.mode)) {
+            dir = dir_get(&ctx->dirs, iter->parent);
+            if (!dir) {
+                ret = -1;
+                goto out;
             }
+            ret = copy_symlink(ctx, dir, iter);
+            dir_put(&ctx->dirs, dir);
+            if (ret == 0)
+                ret = copy_done(ctx, path, &iter->attr);
+            if (ret < 0)
+                goto out;
+            continue;
         }
 
-        file_path =
-            (char *)malloc(MAX_PATH_LENGTH + MAX_FILE_LENGTH + 1);
-        if (!file_path) {
-            LOGE("insufficient memory\n");
-            exit(EXIT_FAILURE);
-        }
-        memset(file_path, 0, MAX_PATH_LENGTH + MAX_FILE_LENGTH + 1);
-        strcpy(file_path, path);
-        *(file_path + len) = '/';
-        strcpy(file_path + len + 1, dirent->d_name);
+        entries[nr].ctx = ctx;
+        entries[nr].fi = iter;
+        files[nr].name = iter->name;
+        files[nr].attr = &iter->attr;
+        files[nr].cons = ctx->cons;
+        files[nr].arg = &entries[nr];
+        nr++;
+    }
 
-        ret = lstat(file_path, &st);
-        if (ret < 0) {
-            LOGE("lstat failed on %s\n", file_path);
-            closedir(dir);
-            return ret;
+    ret = uring_copy_files(files, nr, ctx->buffers.size, copy_progress,
+                   ctx, uring_file_start, uring_file_done, NULL);
+    if (ret == -ENOSYS) {
+        /* Symlinks are already there, do not report a clean fallback */
+        LOGE("io_uring became unavailable during copy\n");
+        ret = -1;
+    }
+
+out:
+    free(path);
+    free(files);
+    free(entries);
+    return ret;
+}
+
+/**
+ * Recreate hard links to files already copied
+ *
+ * @param ctx Copy context
+ * @param file_list File list
+ *
+ * @return 0 on success, negative value if an error occurs
+ */
+static int copy_links(struct copy_ctx *ctx, file_info ** file_list)
+{
+    struct dir_handle *dir, *target;
+    const char *name;
+    file_info *iter;
+    char *path = NULL;
+    int ret = 0;
+
+    for (iter = *file_list; iter; iter = iter->next) {
+        if (!iter->link)
+            continue;
+
+        free(path);
+        path = copy_path(ctx, iter);
+        ret = skip_done(ctx, path, iter);
+        if (ret < 0)
+            break;
+        if (ret) {
+            ret = 0;
+            continue;
         }
 
-        ret = lgetfilecon(file_path, &con);
-        if (ret < 0) {
-            LOGE("lgetfilecon failed on %s\n", file_path);
-            closedir(dir);
-            return ret;
+        dir = dir_get(&ctx->dirs, iter->parent);
+        if (!dir) {
+            ret = -1;
+            break;
+        }
+        target = dir_get(&ctx->dirs, iter->link->parent);
+        if (!target) {
+            dir_put(&ctx->dirs, dir);
+            ret = -1;
+            break;
         }
 
-        node = create_node(file_path, &st, con);
-        if (dirent->d_type == DT_DIR) {
-            node->next = *dir_list;
-            *dir_list = node;
-            ret =
-                generate_file_list(file_path, file_list, dir_list);
-            if (ret < 0) {
-                free(file_path);
-                return ret;
-            }
-        } else {
-            node->next = *file_list;
-            *file_list = node;
+        name = iter->name;
+        ret = linkat(target->dst_fd, iter->link->name, dir->dst_fd,
+                     name, 0);
+        /* Left by an interrupted run */
+        if (ret < 0 && errno == EEXIST && unlinkat(dir->dst_fd, name, 0) == 0)
+            ret = linkat(target->dst_fd, iter->link->name, dir->dst_fd,
+                         name, 0);
+        dir_put(&ctx->dirs, target);
+        dir_put(&ctx->dirs, dir);
+        if (ret < 0) {
+            LOGE("can't link %s to %s\n", name, iter->link->name);
+            break;
         }
 
-        free(file_path);
+        progress_update(iter->attr.size, &ctx->progress);
+        __sync_fetch_and_add(&ctx->stats.links, 1);
+        ret = copy_done(ctx, path, &iter->attr);
+        if (ret < 0)
+            break;
     }
+    free(path);
 
-    closedir(dir);
-    return 0;
+    return ret;
 }
 
 /**
- * Get size on disk for a directory
- * Similar functionality with du -c
- * @param path Directory path
- * @param size Directory size
+ * Report the progress of a copy once its journal is synced
+ * Runs under the journal lock
  *
- * @return 0 for success, negative value in case of an error
+ * @param arg Copy context
  */
-int get_dir_size(const char *path, off64_t * size)
+static void checkpoint_progress(void *arg)
 {
-    DIR *dir;
-    struct dirent *dirent;
-    struct stat st;
-    int len, ret = -1;
-    char *file_path;
+    struct copy_ctx *ctx = arg;
+    int percent;
 
-    len = strlen(path);
-    if (len > MAX_PATH_LENGTH) {
-        LOGE("Invalid argument %s\n", path);
-        return -1;
+    pthread_mutex_lock(&ctx->progress.lock);
+    percent = ctx->progress.percent;
+    pthread_mutex_unlock(&ctx->progress.lock);
+
+    ctx->checkpoint(percent, ctx->checkpoint_arg);
+}
+
+/**
+ * Set up a copy context and export the initial progress
+ *
+ * @param ctx Copy context
+ * @param src_path Source
+ * @param dst_path Destination
+ * @param opts Copy options
+ * @param journal Resume journal, NULL if not used
+ * @param cons Contexts of the source entries
+ * @param total Size of the source tree, for progress
+ * @param stream Copy fed by a streaming walk
+ *
+ * @return 0 on success, negative value if an error occurs
+ */
+static int copy_begin(struct copy_ctx *ctx, const char *src_path,
+              const char *dst_path, const struct copy_options *opts,
+              struct journal *journal, struct con_table *cons,
+              off64_t total, int stream)
+{
+    char buff[PROPERTY_VALUE_MAX], path_hash_hex[ECRYPTFS_SIG_LEN * 2 + 1];
+    unsigned char path_hash[ECRYPTFS_SIG_LEN];
+    int ret = -1;
+
+    memset(ctx, 0, sizeof(struct copy_ctx));
+    ctx->src_path = src_path;
+    ctx->dst_path = dst_path;
+    ctx->method = opts->method;
+    ctx->cache = opts->cache;
+    ctx->journal = journal;
+    ctx->migrate = opts->migrate;
+    ctx->cons = cons;
+    ctx->stream = stream;
+    ctx->progress.total = total;
+
+    memcpy(ctx->progress.property, property_prefix, strlen(property_prefix));
+    SHA512((unsigned char *)src_path, strlen(src_path), path_hash);
+    convert_to_hex_format(path_hash, path_hash_hex, ECRYPTFS_SIG_LEN);
+    memcpy(ctx->progress.property + strlen(property_prefix), path_hash_hex,
+           SHA_HEAD);
+
+    memset(buff, 0, sizeof(buff));
+    snprintf(buff, sizeof(buff), "%d", 0);
+    ret = property_set(ctx->progress.property, buff);
+    if (ret < 0) {
+        LOGE("property_set");
     }
 
-    dir = opendir(path);
-    if (!dir) {
-        LOGE("open dir %s failed", path);
+    if (dir_cache_init(&ctx->dirs, src_path, dst_path, stream) < 0)
+        return -1;
+    if (ctx->migrate && migrate_init(ctx) < 0) {
+        dir_cache_destroy(&ctx->dirs);
         return -1;
     }
 
-    while ((dirent = readdir(dir))) {
-        int file_len = strlen(dirent->d_name);
+    pthread_mutex_init(&ctx->progress.lock, NULL);
+    if (journal && opts->checkpoint) {
+        ctx->checkpoint = opts->checkpoint;
+        ctx->checkpoint_arg = opts->checkpoint_arg;
+        journal->on_checkpoint = checkpoint_progress;
+        journal->checkpoint_arg = ctx;
+    }
+    /* Before the workers are started so they inherit the priorities */
+    throttle_init(&ctx->throttle, opts->background, opts->rate_limit,
+                  opts->psi_limit);
+    buffer_pool_init(&ctx->buffers, opts->buffer_size);
 
-        /* This should not happen */
-        if (file_len > MAX_FILE_LENGTH) {
-            LOGE("file system error\n");
-            closedir(dir);
-            return -1;
-        }
+    return 0;
+}
 
-        /* ignore /. and /.. */
-        if (file_len == 1 || file_len == 2) {
-            if (dirent->d_name[0] == '.') {
-                if (dirent->d_name[1] == '\0')
-                    continue;
-                if ((dirent->d_name[1] == '.')
-                    && (dirent->d_name[2] == '\0'))
-                    continue;
-            }
+/**
+ * Report a finished copy and release its context
+ *
+ * @param ctx Copy context
+ * @param opts Copy options
+ * @param ret Result of the copy
+ *
+ * @return ret, or a negative value if the last migrated sources could
+ * not be removed
+ */
+static int copy_end(struct copy_ctx *ctx, const struct copy_options *opts,
+            int ret)
+{
+    if (ret == 0) {
+        if (property_set(ctx->progress.property, "100") < 0) {
+            LOGE("property_set");
         }
 
-        file_path =
-            (char *)malloc(MAX_PATH_LENGTH + MAX_FILE_LENGTH + 1);
-        if (!file_path)
-            return -1;
-        memset(file_path, 0, MAX_PATH_LENGTH + MAX_FILE_LENGTH + 1);
-        strcpy(file_path, path);
-        *(file_path + len) = '/';
-        strcpy(file_path + len + 1, dirent->d_name);
+        LOGI("Copied %lld files (%lld hard links), %lld bytes, skipped %lld "
+             "bytes of holes\n", (long long)ctx->stats.files,
+             (long long)ctx->stats.links, (long long)ctx->stats.bytes,
+             (long long)ctx->stats.holes);
+
+        /* Reported apart from the data copy */
+        ctx->stats.contexts = ctx->cons->nr;
+        ctx->stats.con_get_ns = ctx->cons->get_ns;
+        ctx->stats.con_set_ns = ctx->cons->set_ns;
+        LOGI("%lld contexts, %lld us reading, %lld us restoring\n",
+             (long long)ctx->stats.contexts,
+             (long long)ctx->stats.con_get_ns / 1000,
+             (long long)ctx->stats.con_set_ns / 1000);
+        if (opts->stats)
+            memcpy(opts->stats, &ctx->stats, sizeof(struct copy_stats));
+    }
 
-        ret = lstat(file_path, &st);
-        if (ret < 0) {
-            LOGE("lstat failed on %s\n", file_path);
-            closedir(dir);
-            free(file_path);
-            return ret;
-        }
+    /* The journal is checkpointed once more after the context is gone */
+    if (ctx->journal)
+        ctx->journal->on_checkpoint = NULL;
+    throttle_destroy(&ctx->throttle);
+    buffer_pool_destroy(&ctx->buffers);
+    dir_cache_destroy(&ctx->dirs);
+    pthread_mutex_destroy(&ctx->progress.lock);
+    /* Completed copies are migrated even if the copy failed */
+    if (ctx->migrate && migrate_destroy(ctx) < 0 && ret == 0)
+        ret = -1;
+    return ret;
+}
 
-        *size += st.st_size;
+/**
+ * Copy multiple files from source to destination
+ * Files are scheduled by size class and spread over a pool of workers;
+ * the first failing file aborts the whole copy
+ *
+ * @param tree Walk of the source
+ * @param src_path Source
+ * @param dst_path Destination
+ * @param opts Copy options
+ * @param journal Resume journal, NULL if not used
+ *
+ * @return 0 on success, negative value if an error occurs
+ */
+static int copy_files(struct file_tree *tree, const char *src_path,
+              const char *dst_path, const struct copy_options *opts,
+              struct journal *journal)
+{
+    file_info **file_list = &tree->file_list;
+    file_info *iter, *sample = NULL;
+    struct dir_handle *dir;
+    struct copy_ctx ctx;
+    struct work_pool pool;
+    struct copy_schedule sched;
+    int i, fd, ret;
+
+    ret = copy_begin(&ctx, src_path, dst_path, opts, journal, tree->cons,
+                     tree->size, 0);
+    if (ret < 0)
+        return ret;
 
-        if (dirent->d_type == DT_DIR) {
-            ret = get_dir_size(file_path, size);
-            if (ret < 0) {
-                free(file_path);
-                return ret;
+    /* Probe copy methods on the largest regular file */
+    if (ctx.method == COPY_METHOD_AUTO) {
+        for (iter = *file_list; iter; iter = iter->next)
+            if (S_ISREG(iter->attr.mode) &&
+                (!sample || iter->attr.size > sample->attr.size))
+                sample = iter;
+        ctx.method = COPY_METHOD_RW;
+        if (sample && sample->attr.size > 0 &&
+            (dir = dir_get(&ctx.dirs, sample->parent))) {
+            fd = openat(dir->src_fd, sample->name, O_RDONLY);
+            if (fd >= 0) {
+                ctx.method = probe_copy_method(fd, ctx.dirs.root.dst_fd);
+                close(fd);
             }
+            dir_put(&ctx.dirs, dir);
         }
+    }
 
-        free(file_path);
+    work_pool_init(&pool, opts->threads, copy_entry, &ctx);
+    ctx.pool = &pool;
+    memset(&sched, 0, sizeof(sched));
+
+    if (opts->engine == COPY_ENGINE_URING) {
+        ret = copy_files_uring(&ctx, file_list);
+        if (ret == 0)
+            goto done;
+        if (ret != -ENOSYS)
+            goto out;
+        LOGI("io_uring unavailable, using synchronous copy\n");
     }
 
-    closedir(dir);
-    return 0;
+    ret = schedule_copy(file_list, &sched);
+    if (ret < 0) {
+        LOGE("Unable to schedule copy of %s\n", src_path);
+        goto out;
+    }
+
+    for (i = 0; i < sched.nr_tasks; i++) {
+        ret = work_pool_push(&pool, &sched.tasks[i]);
+        if (ret < 0)
+            goto out;
+    }
+
+    ret = work_pool_start(&pool);
+    if (ret < 0) {
+        LOGE("Unable to start copy workers\n");
+        goto out;
+    }
+
+    ret = work_pool_wait(&pool);
+    if (ret < 0)
+        goto out;
+
+done:
+    ret = copy_links(&ctx, file_list);
+
+out:
+    work_pool_destroy(&pool);
+    free_schedule(&sched);
+    return copy_end(&ctx, opts, ret);
 }
 
 /**
- * Create directory infrastructure and store it on disk
- * Used in context with copy file or copy directory
- * @param dir_list Linked list with directories names and attributes
- * @param src_path Source path
- * @param dst_path Destination path
+ * Allocate a copy task released with release_task
  *
- * @return 0 on success, negative value on error
+ * @param nr_files Number of file slots
+ *
+ * @return Copy task
  */
-static int create_dirs(file_info ** dir_list, const char *src_path, const char *dst_path)
+static struct copy_task *alloc_task(int nr_files)
 {
-    file_info *iter = *dir_list;
-    char *path;
-    int len;
-    int ret = -1;
-    struct utimbuf time;
-
-    if (!iter)
-        return 0;
-
-    len = strlen(dst_path) + strlen(iter->path) - strlen(src_path) + 1;
-    if (len > MAX_PATH_LENGTH || strlen(dst_path) > MAX_PATH_LENGTH
-        || strlen(src_path) > MAX_PATH_LENGTH) {
-        LOGE("Can't copy %s", iter->path);
-        return -1;
-    }
+    struct copy_task *task;
 
-    path = (char *)malloc(MAX_PATH_LENGTH + 1);
-    if (!path) {
+    task = calloc(1, sizeof(struct copy_task) + nr_files * sizeof(file_info *));
+    if (!task) {
         LOGE("insufficient memory\n");
         exit(EXIT_FAILURE);
     }
+    task->files = (file_info **)(task + 1);
+
+    return task;
+}
+
+/**
+ * Queue a task, waiting while the workers are STREAM_QUEUE_DEPTH behind
+ *
+ * @param stream Streaming copy
+ * @param task Copy task, released if it can't be queued
+ *
+ * @return 0 on success, negative value if the copy was aborted
+ */
+static int stream_push(struct copy_stream *stream, struct copy_task *task)
+{
+    int ret;
+
+    ret = work_pool_push(stream->ctx->pool, task);
+    if (ret < 0)
+        release_task(task);
+
+    return ret;
+}
 
-    memset(path, 0, MAX_PATH_LENGTH + 1);
-    strcpy(path, dst_path);
-    *(path + strlen(dst_path)) = '/';
-    strcpy(path + strlen(dst_path) + 1, iter->path + strlen(src_path));
+/**
+ * Queue the pending batch of small files
+ *
+ * @param stream Streaming copy
+ *
+ * @return 0 on success, negative value if the copy was aborted
+ */
+static int stream_flush(struct copy_stream *stream)
+{
+    struct copy_task *task = stream->batch;
+
+    if (!task)
+        return 0;
+
+    stream->batch = NULL;
+    return stream_push(stream, task);
+}
+
+/**
+ * Queue one entry of the source as soon as it is walked
+ * Small files and links are grouped in batches and the rest get one task
+ * each, as in schedule_copy; the queue limit bounds the huge files in
+ * flight
+ *
+ * @param stream Streaming copy
+ * @param parent Directory node, NULL at the top
+ * @param name Entry name
+ * @param st Entry stat
+ *
+ * @return 0 on success, negative value if an error occurs
+ */
+static int stream_file(struct copy_stream *stream, file_info *parent,
+               const char *name, const struct stat *st)
+{
+    off64_t size = S_ISREG(st->st_mode) ? st->st_size : 0;
+    struct copy_task *task;
+    file_info *fi, *first;
+    char *path;
+    int ret;
 
-    /* The "list" is a stack; recurency will restore FIFO order */
-    if (!iter->next) {
-        ret = mkdir(path, iter->st.st_mode);
+    fi = create_node(NULL, parent, name, st);
+    node_get(parent);
+    /* Regular files are labeled from their open source when copied */
+    if (!S_ISREG(st->st_mode)) {
+        path = node_path(stream->ctx->src_path, fi);
+        ret = con_get_path(&stream->cons, path, &fi->con);
+        free(path);
         if (ret < 0) {
-            LOGE("mkdir %s fail\n", path);
-            free(path);
+            LOGE("Unable to get context of %s\n", name);
+            node_put(fi);
             return ret;
         }
-        ret = setfilecon(path, iter->con);
+    }
+
+    /*
+     * Hard links are created once all files are copied. Every path is
+     * kept on the link list, so its directory stays until then
+     */
+    if (S_ISREG(st->st_mode) && st->st_nlink > 1) {
+        first = create_node(&stream->arena, parent, name, st);
+        node_get(parent);
+        first->link = inode_map_lookup(&stream->links, first, st);
+        first->next = stream->link_list;
+        stream->link_list = first;
+        if (first->link) {
+            node_put(fi);
+            return 0;
+        }
+    }
+
+    if (size >= SMALL_FILE_SIZE) {
+        task = alloc_task(1);
+        task->files[task->nr_files++] = fi;
+        return stream_push(stream, task);
+    }
+
+    if (!stream->batch)
+        stream->batch = alloc_task(SMALL_BATCH_FILES);
+    stream->batch->files[stream->batch->nr_files++] = fi;
+    if (stream->batch->nr_files < SMALL_BATCH_FILES)
+        return 0;
+
+    return stream_flush(stream);
+}
+
+/**
+ * Create the destination of a source directory, then queue its content
+ * Each directory is created before any of its entries is queued, and its
+ * descriptors go to the directory cache for the workers
+ *
+ * @param stream Streaming copy
+ * @param dir Open source directory
+ * @param dst_fd Destination of the directory
+ * @param parent Directory node, NULL at the top
+ *
+ * @return 0 on success, negative value if an error occurs
+ */
+static int stream_dir(struct copy_stream *stream, struct dir_reader *dir,
+              int dst_fd, file_info *parent)
+{
+    struct copy_ctx *ctx = stream->ctx;
+    struct getdents_entry *entry;
+    struct dir_reader child;
+    struct dir_handle *handle;
+    struct stat st;
+    file_info *node;
+    int fd, ret;
+
+    while ((ret = dir_next(dir, &entry)) > 0) {
+        if (work_pool_aborted(ctx->pool))
+            return -1;
+
+        ret = fstatat(dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW);
         if (ret < 0) {
-            LOGE("setfilecon %s fail\n", path);
-            free(path);
+            LOGE("lstat failed on %s\n", entry->d_name);
             return ret;
         }
-        ret = chown(path, iter->st.st_uid, iter->st.st_gid);
+
+        if (!S_ISDIR(st.st_mode)) {
+            ret = stream_file(stream, parent, entry->d_name, &st);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+
+        node = create_node(NULL, parent, entry->d_name, &st);
+        node_get(parent);
+        ret = dir_open(&child, dir->fd, entry->d_name);
         if (ret < 0) {
-            LOGE("chown %s fail\n", path);
-            free(path);
+            node_put(node);
             return ret;
         }
-        ret = chmod(path, iter->st.st_mode);
+
+        ret = con_get_fd(&stream->cons, child.fd, &node->con);
         if (ret < 0) {
-            LOGE("chmod %s fail\n", path);
-            free(path);
-            return ret;
+            LOGE("Unable to get context of %s\n", node->name);
+            goto next;
         }
-        time.actime = iter->st.st_atime;
-        time.modtime = iter->st.st_mtime;
-        ret = utime(path, &time);
-        if (ret != 0) {
-            LOGE("utime on %s failed", path);
-            free(path);
-            return -1;
+
+        fd = create_dir(dst_fd, node, ctx->src_path, &stream->cons,
+                        ctx->journal);
+        if (fd < 0) {
+            LOGE("Can't copy %s\n", node->name);
+            ret = -1;
+            goto next;
         }
-        return 0;
+
+        /* The handle owns both descriptors from here */
+        handle = dir_add(&ctx->dirs, node, child.fd, fd);
+        ret = stream_dir(stream, &child, fd, node);
+        free(child.buf);
+        dir_put(&ctx->dirs, handle);
+        node_put(node);
+        if (ret < 0)
+            return ret;
+        continue;
+next:
+        dir_close(&child);
+        node_put(node);
+        if (ret < 0)
+            return ret;
     }
 
-    ret = create_dirs(&iter->next, src_path, dst_path);
-    if (ret < 0) {
-        free(path);
-        return ret;
-    };
+    /* Don't keep a partial batch while the workers are idle */
+    if (ret == 0 && work_pool_queued(ctx->pool) == 0)
+        ret = stream_flush(stream);
 
-    ret = mkdir(path, iter->st.st_mode);
-    if (ret < 0) {
-        LOGE("mkdir %s fail", path);
-        free(path);
-        return ret;
-    }
+    return ret;
+}
 
-    ret = setfilecon(path, iter->con);
-    if (ret < 0) {
-        LOGE("setfilecon %s fail\n", path);
-        free(path);
-        return ret;
+/**
+ * Look for a sample file for the copy method probe
+ * The search stops at the first regular file large enough to tell or
+ * after STREAM_PROBE_ENTRIES entries, keeping the largest file seen
+ *
+ * @param dir Open directory
+ * @param sample Open sample, -1 until one is found
+ * @param size Size of the sample
+ * @param budget Entries left to look at
+ *
+ * @return 1 once the search is over, 0 to go on, negative value on error
+ */
+static int find_sample(struct dir_reader *dir, int *sample, off64_t *size,
+               int *budget)
+{
+    struct getdents_entry *entry;
+    struct dir_reader child;
+    struct stat st;
+    int fd, ret;
+
+    while ((ret = dir_next(dir, &entry)) > 0) {
+        if (--(*budget) < 0)
+            return 1;
+        if (fstatat(dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+
+        if (S_ISREG(st.st_mode) && st.st_size > *size) {
+            fd = openat(dir->fd, entry->d_name, O_RDONLY);
+            if (fd < 0)
+                continue;
+            if (*sample >= 0)
+                close(*sample);
+            *sample = fd;
+            *size = st.st_size;
+            if (*size >= SMALL_FILE_SIZE)
+                return 1;
+        }
+        if (!S_ISDIR(st.st_mode))
+            continue;
+
+        if (dir_open(&child, dir->fd, entry->d_name) < 0)
+            continue;
+        ret = find_sample(&child, sample, size, budget);
+        dir_close(&child);
+        if (ret != 0)
+            return ret;
     }
 
-    ret = chown(path, iter->st.st_uid, iter->st.st_gid);
+    return ret;
+}
+
+/**
+ * Pick the copy method of a streaming copy before any file is queued
+ * Unlike a full walk, the walk of a streaming copy has no largest file
+ * to probe upfront, so a sample is looked for near the top of the tree
+ *
+ * @param ctx Copy context
+ * @param skip_trash Source is a storage
+ *
+ * @return Copy method to use
+ */
+static int stream_probe(struct copy_ctx *ctx, int skip_trash)
+{
+    struct dir_reader dir;
+    off64_t size = 0;
+    int budget = STREAM_PROBE_ENTRIES, sample = -1, method;
+
+    if (dir_open(&dir, ctx->dirs.root.src_fd, ".") < 0)
+        return COPY_METHOD_RW;
+    dir.skip_trash = skip_trash;
+    find_sample(&dir, &sample, &size, &budget);
+    dir_close(&dir);
+
+    if (sample < 0)
+        return COPY_METHOD_RW;
+
+    method = probe_copy_method(sample, ctx->dirs.root.dst_fd);
+    close(sample);
+    return method;
+}
+
+/**
+ * Copy a tree while it is walked
+ * Workers copy entries as soon as they are listed, and the walk waits
+ * once STREAM_QUEUE_DEPTH tasks are queued, so memory does not depend
+ * on the size of the tree; only hard linked files are kept to the end
+ *
+ * @param src_path Source
+ * @param dst_path Destination
+ * @param opts Copy options
+ * @param journal Resume journal, NULL if not used
+ * @param total Size of the source tree, for progress
+ *
+ * @return 0 on success, negative value if an error occurs
+ */
+static int copy_stream(const char *src_path, const char *dst_path,
+               const struct copy_options *opts, struct journal *journal,
+               off64_t total)
+{
+    struct copy_stream stream;
+    struct copy_ctx ctx;
+    struct work_pool pool;
+    struct dir_reader dir;
+    file_info *iter;
+    int dst_fd, ret;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.ctx = &ctx;
+    arena_init(&stream.arena);
+    con_table_init(&stream.cons);
+
+    ret = copy_begin(&ctx, src_path, dst_path, opts, journal, &stream.cons,
+                     total, 1);
+    if (ret < 0)
+        goto out;
+
+    /* The workers read the method; it must be set before they start */
+    if (ctx.method == COPY_METHOD_AUTO)
+        ctx.method = stream_probe(&ctx, opts->skip_trash);
+
+    work_pool_init(&pool, opts->threads, copy_entry, &ctx);
+    work_pool_set_limit(&pool, STREAM_QUEUE_DEPTH);
+    ctx.pool = &pool;
+
+    ret = work_pool_start(&pool);
     if (ret < 0) {
-        LOGE("chown %s fail\n", path);
-        free(path);
-        return ret;
+        LOGE("Unable to start copy workers\n");
+        goto end;
     }
 
-    ret = chmod(path, iter->st.st_mode);
+    ret = dir_open(&dir, AT_FDCWD, src_path);
     if (ret < 0) {
-        LOGE("chmod %s fail\n", path);
-        free(path);
-        return ret;
+        work_pool_abort(&pool, ret);
+        goto wait;
     }
+    dir.skip_trash = opts->skip_trash;
+    dst_fd = open(dst_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dst_fd < 0) {
+        LOGE("Can't open %s\n", dst_path);
+        ret = -1;
+    } else {
+        ret = stream_dir(&stream, &dir, dst_fd, NULL);
+        if (ret == 0)
+            ret = stream_flush(&stream);
+        close(dst_fd);
+    }
+    dir_close(&dir);
+    if (ret < 0)
+        work_pool_abort(&pool, ret);
 
-    time.actime = iter->st.st_atime;
-    time.modtime = iter->st.st_mtime;
-    ret = utime(path, &time);
-    if (ret != 0) {
-        LOGE("utime on %s failed", path);
-        free(path);
-        return -1;
+wait:
+    if (work_pool_wait(&pool) < 0 && ret == 0)
+        ret = -1;
+    if (ret < 0) {
+        LOGE("Streaming copy of %s failed\n", src_path);
+        work_pool_drain(&pool, release_task);
+        if (stream.batch)
+            release_task(stream.batch);
+        goto end;
     }
 
-    free(path);
-    return 0;
+    ret = copy_links(&ctx, &stream.link_list);
+
+end:
+    work_pool_destroy(&pool);
+    ret = copy_end(&ctx, opts, ret);
+out:
+    for (iter = stream.link_list; iter; iter = iter->next)
+        node_put(iter->parent);
+    arena_destroy(&stream.arena);
+    inode_map_free(&stream.links);
+    con_table_destroy(&stream.cons);
+    return ret;
 }
 
 /**
- * Remove all files sprecified by a file_info list
- *
- * @param file_list List with informations about files
+ * Fill copy options with defaults
  *
- * @return 0 on success, negative value in case of an error
+ * @param opts Copy options
  */
-static int delete_files(file_info ** file_list)
+void init_copy_options(struct copy_options *opts)
 {
-    file_info *iter = *file_list;
-    int ret = 0;
+    char buff[PROPERTY_VALUE_MAX];
 
-    while (iter) {
-        if (remove(iter->path) < 0) {
-            LOGE("unable to remove %s\n", iter->path);
-            ret = -1;
-        }
-        iter = iter->next;
-    }
+    memset(opts, 0, sizeof(struct copy_options));
+    opts->threads = get_nr_cpus();
+    opts->method = COPY_METHOD_AUTO;
 
-    return ret;
+    memset(buff, 0, sizeof(buff));
+    property_get(COPY_THREADS_PROPERTY, buff, "0");
+    if (atoi(buff) > 0)
+        opts->threads = atoi(buff);
+
+    memset(buff, 0, sizeof(buff));
+    property_get(COPY_METHOD_PROPERTY, buff, "auto");
+    if (copy_method_from_name(buff) >= 0)
+        opts->method = copy_method_from_name(buff);
+
+    memset(buff, 0, sizeof(buff));
+    property_get(COPY_BUFFER_PROPERTY, buff, "0");
+    opts->buffer_size = align_buffer_size(strtoul(buff, NULL, 10));
+
+    memset(buff, 0, sizeof(buff));
+    property_get(COPY_ENGINE_PROPERTY, buff, "sync");
+    if (!strcmp(buff, "io_uring"))
+        opts->engine = COPY_ENGINE_URING;
+
+    memset(buff, 0, sizeof(buff));
+    property_get(COPY_CACHE_PROPERTY, buff, "drop");
+    if (copy_cache_from_name(buff) >= 0)
+        opts->cache = copy_cache_from_name(buff);
+
+    memset(buff, 0, sizeof(buff));
+    property_get(BACKGROUND_PROPERTY, buff, "0");
+    opts->background = atoi(buff) > 0;
+
+    memset(buff, 0, sizeof(buff));
+    property_get(RATE_LIMIT_PROPERTY, buff, "0");
+    opts->rate_limit = strtoll(buff, NULL, 10);
+
+    memset(buff, 0, sizeof(buff));
+    property_get(PSI_LIMIT_PROPERTY, buff, "");
+    opts->psi_limit = buff[0] ? atoi(buff) : DEFAULT_PSI_LIMIT;
+
+    memset(buff, 0, sizeof(buff));
+    property_get(COPY_STREAM_PROPERTY, buff, "1");
+    opts->stream = atoi(buff) > 0;
 }
 
 /**
- * Copy a file
+ * Check whether a copy with these options runs while the source is
+ * walked; such a copy only needs the totals of a scan
  *
- * @param src_path Source
- * @param dst_path Destination
- * @param st File attributes
+ * @param opts Copy options
  *
- * @return 0 for success, negative value in case of an error
+ * @return 1 for a streaming copy, 0 if the whole source is walked first
  */
-static int copy_file(const char * property, const char *src_path, const char *dst_path,
-                struct stat *st, security_context_t con,
-                off64_t * done, const off64_t * total)
+int copy_streams(const struct copy_options *opts)
 {
-    char buffer[MAX_PATH_LENGTH], buff[PROPERTY_VALUE_MAX];
-    int n = 0, m = 0, ret = -1;
-    int fd_src, fd_dst;
-    struct utimbuf time;
-    double total_d = *total;
+    return opts->stream && opts->engine == COPY_ENGINE_SYNC;
+}
 
-    fd_src = open(src_path, O_RDONLY);
-    if (fd_src < 0) {
-        LOGE("open %s failed\n", src_path);
-        return fd_src;
+/**
+ * Copy content of a directory
+ * The source is walked once, unless opts carry a scan of it already;
+ * a scan holding the entries is copied from, even if streaming is on,
+ * and a streaming copy only takes the total size from any other scan
+ *
+ * @param dst_path Destination path
+ * @param src_path Source path
+ * @param opts Copy options, NULL for defaults
+ *
+ * @return 0 on success, negative value in case of an error
+ */
+int copy_dir_content(const char *dst_path, const char *src_path,
+             const struct copy_options *opts)
+{
+    const struct tree_scan *scan;
+    struct tree_scan local;
+    struct copy_options default_opts;
+    struct journal journal, *jp = NULL;
+    off64_t total = 0;
+    int flags, ret = -1;
+
+    if (!opts) {
+        init_copy_options(&default_opts);
+        opts = &default_opts;
     }
+    flags = opts->skip_trash ? SCAN_SKIP_TRASH : 0;
 
-    fd_dst = open(dst_path, O_CREAT | O_WRONLY, st->st_mode);
-    if (fd_dst < 0) {
-        LOGE("open %s failed\n", dst_path);
-        close(fd_src);
-        return fd_dst;
+    memset(&local, 0, sizeof(local));
+    scan = opts->scan;
+    if (scan && strcmp(scan->path, src_path)) {
+        LOGI("Scan of %s does not match %s\n", scan->path, src_path);
+        scan = NULL;
     }
+    if (scan && !scan->entries && !copy_streams(opts))
+        scan = NULL;
 
-    do {
-        n = read(fd_src, buffer, sizeof(buffer));
-        if (n < 0) {
-            LOGE("Error reading from file\n");
-            close(fd_src);
-            close(fd_dst);
-            return n;
-        }
-        if (n == 0)
-            break;
-        m = write(fd_dst, buffer, n);
-        if (m != n) {
-            close(fd_src);
-            close(fd_dst);
-            return -1;
+    if (opts->journal_path) {
+        ret = journal_open(&journal, opts->journal_path, dst_path);
+        if (ret < 0) {
+            LOGE("Unable to open copy journal %s\n", opts->journal_path);
+            return ret;
         }
+        jp = &journal;
+    }
 
-        *done += m;
-        // check if update is required
-        if ((*done - m) / total_d * 100 != *done / total_d * 100) {
-            memset(buff, 0, sizeof(buff));
-            snprintf(buff, sizeof(buff), "%llu", (off64_t)(*done / total_d * 100));
-            ret = property_set(property, buff);
-            if (ret < 0) {
-                LOGE("property_set");
-            }
-        }
-    } while (n);
+    if (copy_streams(opts) && !(scan && scan->entries)) {
+        if (scan)
+            total = scan->size;
+        else if (scan_tree(src_path, flags, &local) == 0)
+            total = local.size;
 
-    close(fd_src);
-    close(fd_dst);
+        ret = copy_stream(src_path, dst_path, opts, jp, total);
+        if (ret < 0)
+            LOGE("copy_stream for %s failed\n", src_path);
+        goto out;
+    }
 
-    ret = setfilecon(dst_path, con);
-    if (ret < 0) {
-        LOGE("setfilecon %s fail\n", dst_path);
-        return ret;
+    if (!scan) {
+        ret = scan_tree(src_path, SCAN_ENTRIES | flags, &local);
+        if (ret < 0)
+            goto out;
+        scan = &local;
     }
 
-    ret = chown(dst_path, st->st_uid, st->st_gid);
+    ret = create_dirs(scan->tree, src_path, dst_path, jp);
     if (ret < 0) {
-        LOGE("chown %s fail\n", dst_path);
-        return ret;
+        LOGE("create_dirs for %s failed\n", src_path);
+        goto out;
     }
 
-    ret = chmod(dst_path, st->st_mode);
+    ret = copy_files(scan->tree, src_path, dst_path, opts, jp);
     if (ret < 0) {
-        LOGE("chmod %s fail\n", dst_path);
-        return ret;
+        LOGE("copy_files for %s failed\n", src_path);
+        goto out;
     }
 
-    /* Save access times */
-    time.actime = st->st_atime;
-    time.modtime = st->st_mtime;
-    ret = utime(dst_path, &time);
-    if (ret != 0) {
-        LOGE("utime on %s failed", dst_path);
-        return -1;
+out:
+    /* Keep what was completed, even if the copy failed */
+    if (jp) {
+        if (journal_checkpoint(jp) < 0 && ret == 0)
+            ret = -1;
+        journal_close(jp);
     }
-
-    return 0;
+    free_scan(&local);
+    return ret;
 }
 
 /**
- * Copy multiple files from source to destination
- *
- * @param file_list File list
- * @param src_path Source
- * @param dst_path Destination
+ * Get the number of delete threads
  *
- * @return 0 on success, negative value if an error occurs
+ * @return Number of threads, 1 for a serial delete
  */
-static int copy_files(file_info ** file_list, const char *src_path, const char *dst_path)
+static int get_remove_threads(void)
 {
-    file_info *iter = *file_list;
-    char path[MAX_PATH_LENGTH + 1], buff[PROPERTY_VALUE_MAX], *linkname;
-    char property[PROPERTY_KEY_MAX], path_hash_hex[ECRYPTFS_SIG_LEN * 2 + 1];
-    unsigned char path_hash[ECRYPTFS_SIG_LEN];
-    int len = 0, ret = -1;
-    off64_t done = 0, total = 0;
+    char buff[PROPERTY_VALUE_MAX];
 
-    if (strlen(src_path) > MAX_PATH_LENGTH
-        || strlen(dst_path) > MAX_PATH_LENGTH) {
-        LOGE("Invalid arguments\n");
-        return ret;
-    }
+    memset(buff, 0, sizeof(buff));
+    property_get(REMOVE_THREADS_PROPERTY, buff, "0");
+    if (atoi(buff) > 0)
+        return atoi(buff) < MAX_WORKERS ? atoi(buff) : MAX_WORKERS;
 
-    ret = get_dir_size(src_path, &total);
-    if (ret < 0) {
-        LOGE("Failed to compute storage size %s", src_path);
-        return ret;
-    }
+    return get_nr_cpus();
+}
 
-    memset(property, 0, sizeof(property));
-    memcpy(property, property_prefix, strlen(property_prefix));
-    SHA512((unsigned char *)src_path, strlen(src_path), path_hash);
-    convert_to_hex_format(path_hash, path_hash_hex, ECRYPTFS_SIG_LEN);
-    memcpy(property + strlen(property_prefix), path_hash_hex, SHA_HEAD);
+/**
+ * Allocate a directory to remove; it holds a reference to its parent
+ *
+ * @param parent Parent directory
+ * @param name Directory name
+ *
+ * @return Directory node
+ */
+static struct remove_node *remove_node_new(struct remove_node *parent,
+                       const char *name)
+{
+    struct remove_node *node;
+    size_t len = strlen(name);
 
-    memset(buff, 0, sizeof(buff));
-    snprintf(buff, sizeof(buff), "%llu", (off64_t)(done / (double)total * 100));
-    ret = property_set(property, buff);
-    if (ret < 0) {
-        LOGE("property_set");
+    node = malloc(sizeof(struct remove_node) + len + 1);
+    if (!node) {
+        LOGE("insufficient memory\n");
+        exit(EXIT_FAILURE);
     }
+    node->parent = parent;
+    node->fd = -1;
+    node->pending = 1;
+    memcpy(node->name, name, len + 1);
+    if (parent)
+        __sync_fetch_and_add(&parent->pending, 1);
+
+    return node;
+}
 
-    while (iter) {
-        len =
-            strlen(dst_path) + strlen(iter->path) - strlen(src_path) +
-            1;
-        if (len > MAX_PATH_LENGTH) {
-            LOGE("Invalig len\n");
-            return -1;
+/**
+ * Drop a reference to a directory; the last one closes and removes it
+ * and releases its parent in turn. The top directory is kept
+ *
+ * @param rm Tree deletion
+ * @param node Directory
+ */
+static void remove_release(struct tree_remove *rm, struct remove_node *node)
+{
+    struct remove_node *parent;
+
+    while (node && __sync_sub_and_fetch(&node->pending, 1) == 0) {
+        parent = node->parent;
+        if (node->fd >= 0)
+            close(node->fd);
+        /* Already gone if another deletion runs on the same tree */
+        if (parent && unlinkat(parent->fd, node->name, AT_REMOVEDIR) < 0 &&
+            errno != ENOENT) {
+            LOGE("unable to remove %s\n", node->name);
+            rm->error = -1;
         }
+        free(node);
+        node = parent;
+    }
+}
 
-        strcpy(path, dst_path);
-        path[strlen(dst_path)] = '/';
-        strcpy(path + strlen(dst_path) + 1,
-               iter->path + strlen(src_path));
-
-        if (S_ISLNK(iter->st.st_mode)) {
-            linkname = malloc(iter->st.st_size + 1);
-            if (linkname == NULL) {
-                LOGE("insufficient memory\n");
-                exit(EXIT_FAILURE);
-            }
-            ret =
-                readlink(iter->path, linkname,
-                     iter->st.st_size + 1);
-            if (ret < 0) {
-                free(linkname);
-                LOGE("lstat failed\n");
-                return -1;
-            }
-            linkname[iter->st.st_size] = '\0';
-            ret = symlink(linkname, path);
-            if (ret < 0) {
-                free(linkname);
-                LOGE("can't create symlink %s", path);
-                return ret;
-            }
-
-            ret = lsetfilecon(path, iter->con);
-            if (ret < 0) {
-                LOGE("lsetfilecon %s fail\n", iter->path);
-                free(linkname);
-                return ret;
-            }
+static void remove_node_tree(struct tree_remove *rm,
+                 struct remove_node *node);
 
-            ret = lchown(path, iter->st.st_uid, iter->st.st_gid);
-            if (ret < 0) {
-                LOGE("lchown %s fail\n", iter->path);
-                free(linkname);
-                return ret;
+/**
+ * Remove the content of an open directory, relative to its fd
+ * Subdirectories go to the other delete threads while they are short
+ * of work, and are removed in place otherwise
+ *
+ * @param rm Tree deletion
+ * @param node Directory
+ * @param dir Open directory
+ */
+static void remove_entries(struct tree_remove *rm, struct remove_node *node,
+               struct dir_reader *dir)
+{
+    struct getdents_entry *entry;
+    struct remove_node *child;
+    struct stat st;
+    int is_dir, ret;
+
+    while ((ret = dir_next(dir, &entry)) > 0) {
+        is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN &&
+            fstatat(dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            is_dir = S_ISDIR(st.st_mode);
+
+        if (!is_dir) {
+            if (unlinkat(dir->fd, entry->d_name, 0) < 0 && errno != ENOENT) {
+                LOGE("unable to remove %s\n", entry->d_name);
+                rm->error = -1;
             }
-
-            free(linkname);
-            iter = iter->next;
             continue;
         }
 
-        ret = copy_file(property, iter->path, path, &iter->st, iter->con, &done, &total);
-        if (ret < 0) {
-            LOGE("Copying file form %s to %s failed\n", iter->path,
-                 path);
-            return ret;
-        }
-
-        iter = iter->next;
+        child = remove_node_new(node, entry->d_name);
+        if (rm->threads > 1 &&
+            work_pool_queued(&rm->pool) < WALK_QUEUE_DEPTH * rm->threads &&
+            work_pool_push(&rm->pool, child) == 0)
+            continue;
+        remove_node_tree(rm, child);
     }
 
-    ret = property_set(property, "100");
-    if (ret < 0) {
-        LOGE("property_set");
-    }
-    return 0;
+    if (ret < 0)
+        rm->error = -1;
 }
 
 /**
- * Free linked file list
+ * Remove a directory and its subtree, relative to its parent
+ * Failures are recorded so that the rest of the tree is still removed
  *
- * @param file_list File list
+ * @param rm Tree deletion
+ * @param node Directory, released on return
  */
-static void free_list(file_info ** file_list)
+static void remove_node_tree(struct tree_remove *rm,
+                 struct remove_node *node)
 {
-    file_info *iter = *file_list;
-    file_info *aux;
-
-    while (iter) {
-        freecon(iter->con);
-        aux = iter;
-        iter = iter->next;
-        free(aux);
+    struct dir_reader dir;
+
+    if (dir_open(&dir, node->parent->fd, node->name) < 0) {
+        if (errno != ENOENT)
+            rm->error = -1;
+    } else {
+        /* The fd is closed with the last reference to the directory */
+        node->fd = dir.fd;
+        remove_entries(rm, node, &dir);
+        free(dir.buf);
     }
 
+    remove_release(rm, node);
 }
 
 /**
- * Copy content of a directory
+ * Remove a queued directory; work callback of the delete threads
  *
- * @param dst_path Destination path
- * @param src_path Source path
+ * @param item Directory node
+ * @param worker Delete thread index
+ * @param arg Tree deletion
+ *
+ * @return 0
+ */
+static int remove_item(void *item, int worker, void *arg)
+{
+    remove_node_tree(arg, item);
+    return 0;
+}
+
+/**
+ * Remove files from a directory relative to an open directory
+ * The tree is walked with getdents64 and every entry is unlinked
+ * relative to its directory fd; subtrees are spread over a pool of
+ * threads and each directory is removed once its last entry is gone
+ *
+ * @param dirfd Directory the name is relative to, or AT_FDCWD
+ * @param name Directory name or path
  *
  * @return 0 on success, negative value in case of an error
  */
-int copy_dir_content(const char *dst_path, const char *src_path)
+int remove_dir_content_at(int dirfd, const char *name)
 {
-    file_info *file_list = 0, *dir_list = 0;
-    int ret = -1;
+    struct tree_remove rm;
+    struct remove_node *root;
+    struct dir_reader dir;
+    int ret;
 
-    ret = generate_file_list(src_path, &file_list, &dir_list);
+    ret = dir_open(&dir, dirfd, name);
     if (ret < 0) {
-        LOGE("generate_file_list for %s failed\n", src_path);
-        goto err;
+        LOGE("unable to open %s\n", name);
+        return ret;
     }
 
-    ret = create_dirs(&dir_list, src_path, dst_path);
-    if (ret < 0) {
-        LOGE("create_dirs for %s failed\n", src_path);
-        goto err;
+    memset(&rm, 0, sizeof(rm));
+    rm.threads = get_remove_threads();
+    if (rm.threads > 1) {
+        work_pool_init(&rm.pool, rm.threads, remove_item, &rm);
+        if (work_pool_start(&rm.pool) < 0) {
+            work_pool_destroy(&rm.pool);
+            rm.threads = 1;
+        }
     }
 
-    ret = copy_files(&file_list, src_path, dst_path);
-    if (ret < 0) {
-        LOGE("copy_files for %s failed\n", src_path);
-        goto err;
+    root = remove_node_new(NULL, "");
+    root->fd = dir.fd;
+    remove_entries(&rm, root, &dir);
+    free(dir.buf);
+    remove_release(&rm, root);
+
+    if (rm.threads > 1) {
+        work_pool_wait(&rm.pool);
+        work_pool_destroy(&rm.pool);
     }
 
-    free_list(&file_list);
-    free_list(&dir_list);
-    return 0;
+    if (rm.error < 0)
+        LOGE("unable to remove content of %s\n", name);
 
-err:
-    free_list(&file_list);
-    free_list(&dir_list);
-    return ret;
+    return rm.error;
 }
 
 /**
@@ -717,36 +3462,7 @@ err:
  */
 int remove_dir_content(const char *path)
 {
-    file_info *file_list = 0, *dir_list = 0;
-    int ret = -1;
-
-    ret = generate_file_list(path, &file_list, &dir_list);
-    if (ret < 0) {
-        LOGE("generate_file_list for %s failed\n", path);
-        goto err;
-    }
-
-    ret = delete_files(&file_list);
-    if (ret < 0) {
-        LOGE("delete_files %s failed\n", path);
-        goto err;
-    }
-
-    ret = delete_files(&dir_list);
-    if (ret < 0) {
-        LOGE("delete dirs failed %s\n", path);
-        goto err;
-    }
-
-    free_list(&file_list);
-    free_list(&dir_list);
-
-    return 0;
-
-err:
-    free_list(&file_list);
-    free_list(&dir_list);
-    return ret;
+    return remove_dir_content_at(AT_FDCWD, path);
 }
 
 /**
@@ -780,7 +3496,7 @@ static void print_nodes(file_info ** list)
 {
     file_info *iter = *list;
     while (iter) {
-        LOGE("%s\n", iter->path);
+        LOGE("%s\n", iter->name);
         iter = iter->next;
     }
 }
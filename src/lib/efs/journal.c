@@ -0,0 +1,400 @@
+/**
+ * @file   journal.c
+ * @author Catalin Ionita <catalin.ionita@intel.com>
+ * @date   Fri Oct 16 16:21:08 2026
+ *
+ * @brief
+ * Copy journal used to resume an interrupted storage encryption.
+ * Completed files and directories are appended in batches, after the
+ * copied data has been synced, so every entry on disk is safe to skip.
+ *
+ */
+
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <efs/efs.h>
+#include <efs/file_utils.h>
+#include <efs/journal.h>
+
+static unsigned int hash_path(const char *path)
+{
+    unsigned int hash = 5381;
+
+    while (*path)
+        hash = hash * 33 + (unsigned char)*path++;
+
+    return hash;
+}
+
+/**
+ * Add a completed entry to the lookup table
+ *
+ * @param journal Journal
+ * @param path Source path
+ * @param size Source size
+ * @param mtime Source modification time in ns
+ *
+ * @return 0 on success, negative value on error
+ */
+static int journal_insert(struct journal *journal, const char *path,
+              int64_t size, int64_t mtime)
+{
+    struct journal_entry *entry;
+    unsigned int i;
+    int len = strlen(path);
+
+    entry = malloc(sizeof(struct journal_entry) + len + 1);
+    if (!entry) {
+        LOGE("insufficient memory\n");
+        return -1;
+    }
+
+    entry->size = size;
+    entry->mtime_ns = mtime;
+    memcpy(entry->path, path, len + 1);
+
+    i = hash_path(path) % journal->table_size;
+    entry->next = journal->table[i];
+    journal->table[i] = entry;
+    journal->nr_entries++;
+
+    return 0;
+}
+
+/**
+ * Load the records of a previous run
+ * A torn record at the end is cut off so new records append cleanly
+ *
+ * @param journal Journal
+ *
+ * @return 0 on success, negative value on error
+ */
+static int journal_load(struct journal *journal)
+{
+    struct journal_record rec;
+    struct stat st;
+    char *path = NULL, *grown;
+    size_t size = 0;
+    off_t valid = 0;
+    ssize_t n;
+
+    if (fstat(journal->fd, &st) < 0)
+        return -1;
+
+    for (;;) {
+        n = pread(journal->fd, &rec, sizeof(rec), valid);
+        /* A torn record ends the journal */
+        if (n != sizeof(rec) || rec.path_len == 0 ||
+            rec.path_len > st.st_size - valid - sizeof(rec))
+            break;
+
+        if (rec.path_len >= size) {
+            grown = realloc(path, rec.path_len + 1);
+            if (!grown) {
+                LOGE("insufficient memory\n");
+                free(path);
+                return -1;
+            }
+            path = grown;
+            size = rec.path_len + 1;
+        }
+
+        n = pread(journal->fd, path, rec.path_len, valid + sizeof(rec));
+        if (n != (ssize_t)rec.path_len)
+            break;
+        path[rec.path_len] = '\0';
+
+        if (journal_insert(journal, path, rec.size, rec.mtime_ns) < 0) {
+            free(path);
+            return -1;
+        }
+        valid += sizeof(rec) + rec.path_len;
+    }
+    free(path);
+
+    if (ftruncate(journal->fd, valid) < 0) {
+        LOGE("Unable to truncate journal");
+        return -1;
+    }
+    if (lseek(journal->fd, valid, SEEK_SET) < 0)
+        return -1;
+
+    if (journal->nr_entries)
+        LOGI("Resuming copy, %u entries already done", journal->nr_entries);
+
+    return 0;
+}
+
+/**
+ * Open or create a journal and load entries of a previous run
+ *
+ * @param journal Journal
+ * @param path Journal file path
+ * @param dst_path Copy destination, synced before each checkpoint
+ *
+ * @return 0 on success, negative value on error
+ */
+int journal_open(struct journal *journal, const char *path,
+         const char *dst_path)
+{
+    memset(journal, 0, sizeof(struct journal));
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_mutex_init(&journal->checkpoint_lock, NULL);
+    journal->sync_fd = -1;
+    journal->table_size = JOURNAL_TABLE_SIZE;
+    journal->table = calloc(journal->table_size,
+                sizeof(struct journal_entry *));
+    if (!journal->table) {
+        LOGE("insufficient memory\n");
+        return -1;
+    }
+
+    journal->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (journal->fd < 0) {
+        LOGE("Unable to open journal %s", path);
+        free(journal->table);
+        pthread_mutex_destroy(&journal->checkpoint_lock);
+        pthread_mutex_destroy(&journal->lock);
+        return -1;
+    }
+
+    journal->sync_fd = open(dst_path, O_RDONLY | O_DIRECTORY);
+    if (journal->sync_fd < 0) {
+        LOGE("Unable to open %s", dst_path);
+        goto err;
+    }
+
+    if (journal_load(journal) < 0)
+        goto err;
+
+    return 0;
+
+err:
+    journal_close(journal);
+    return -1;
+}
+
+/**
+ * Check whether a source entry was already copied
+ * The entry must be unchanged since it was journaled
+ *
+ * @param journal Journal
+ * @param path Source path
+ * @param attr Current source attributes
+ *
+ * @return 1 if already copied, 0 otherwise
+ */
+int journal_done(struct journal *journal, const char *path,
+         const struct file_attr *attr)
+{
+    struct journal_entry *entry;
+
+    /* The table is only modified while loading */
+    entry = journal->table[hash_path(path) % journal->table_size];
+    for (; entry; entry = entry->next)
+        if (entry->size == attr->size && entry->mtime_ns == attr->mtime_ns
+            && !strcmp(entry->path, path))
+            return 1;
+
+    return 0;
+}
+
+/**
+ * Make the recorded entries durable
+ * The pending records are swapped out under the journal lock, so that
+ * workers keep recording while the destination and the journal are
+ * synced. Destination data is synced first so no entry can outlive its
+ * data; records only count as durable once this returns.
+ * Caller must hold the checkpoint lock
+ *
+ * @param journal Journal
+ *
+ * @return 0 on success, negative value on error
+ */
+static int checkpoint_locked(struct journal *journal)
+{
+    size_t len, size, done = 0;
+    char *records;
+    ssize_t n;
+
+    if (journal->error)
+        return -1;
+
+    pthread_mutex_lock(&journal->lock);
+    len = journal->pending_len;
+    records = journal->pending;
+    size = journal->pending_size;
+    journal->pending = journal->writing;
+    journal->pending_size = journal->writing_size;
+    journal->writing = records;
+    journal->writing_size = size;
+    journal->pending_len = 0;
+    journal->pending_files = 0;
+    journal->pending_bytes = 0;
+    pthread_mutex_unlock(&journal->lock);
+
+    if (len == 0)
+        return 0;
+
+    /* ecryptfs pages first, then the lower filesystem */
+    if (syscall(__NR_syncfs, journal->sync_fd) < 0 ||
+        syscall(__NR_syncfs, journal->fd) < 0) {
+        LOGE("syncfs failed: %s", strerror(errno));
+        goto err;
+    }
+
+    while (done < len) {
+        n = write(journal->fd, records + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("Unable to write journal: %s", strerror(errno));
+            goto err;
+        }
+        done += n;
+    }
+
+    if (fdatasync(journal->fd) < 0) {
+        LOGE("Unable to sync journal: %s", strerror(errno));
+        goto err;
+    }
+
+    if (journal->on_checkpoint)
+        journal->on_checkpoint(journal->checkpoint_arg);
+
+    return 0;
+
+err:
+    /* Later records would follow a torn one and be lost on load */
+    journal->error = 1;
+    return -1;
+}
+
+/**
+ * Record a completed file or directory
+ * A checkpoint is taken every JOURNAL_CHECKPOINT_FILES entries or
+ * JOURNAL_CHECKPOINT_BYTES copied bytes
+ *
+ * @param journal Journal
+ * @param path Source path
+ * @param attr Source attributes at copy time
+ *
+ * @return 0 on success, negative value on error
+ */
+int journal_record(struct journal *journal, const char *path,
+           const struct file_attr *attr)
+{
+    struct journal_record rec;
+    size_t len = strlen(path), need;
+    char *pending;
+    int checkpoint, ret = 0;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.path_len = len;
+    rec.mode = attr->mode;
+    rec.size = attr->size;
+    rec.mtime_ns = attr->mtime_ns;
+
+    pthread_mutex_lock(&journal->lock);
+
+    need = journal->pending_len + sizeof(rec) + len;
+    if (need > journal->pending_size) {
+        pending = realloc(journal->pending, 2 * need);
+        if (!pending) {
+            LOGE("insufficient memory\n");
+            pthread_mutex_unlock(&journal->lock);
+            return -1;
+        }
+        journal->pending = pending;
+        journal->pending_size = 2 * need;
+    }
+
+    memcpy(journal->pending + journal->pending_len, &rec, sizeof(rec));
+    memcpy(journal->pending + journal->pending_len + sizeof(rec), path, len);
+    journal->pending_len = need;
+    journal->pending_files++;
+    if (S_ISREG(attr->mode))
+        journal->pending_bytes += attr->size;
+
+    checkpoint = journal->pending_files >= JOURNAL_CHECKPOINT_FILES ||
+        journal->pending_bytes >= JOURNAL_CHECKPOINT_BYTES;
+
+    pthread_mutex_unlock(&journal->lock);
+
+    /* A running checkpoint is not waited for; a later record takes one */
+    if (checkpoint && pthread_mutex_trylock(&journal->checkpoint_lock) == 0) {
+        ret = checkpoint_locked(journal);
+        pthread_mutex_unlock(&journal->checkpoint_lock);
+    }
+
+    return ret;
+}
+
+/**
+ * Make all recorded entries durable
+ *
+ * @param journal Journal
+ *
+ * @return 0 on success, negative value on error
+ */
+int journal_checkpoint(struct journal *journal)
+{
+    int ret;
+
+    pthread_mutex_lock(&journal->checkpoint_lock);
+    ret = checkpoint_locked(journal);
+    pthread_mutex_unlock(&journal->checkpoint_lock);
+
+    return ret;
+}
+
+/**
+ * Release a journal; pending entries must be checkpointed before
+ *
+ * @param journal Journal
+ */
+void journal_close(struct journal *journal)
+{
+    struct journal_entry *entry, *next;
+    unsigned int i;
+
+    for (i = 0; i < journal->table_size; i++) {
+        for (entry = journal->table[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+    }
+
+    free(journal->table);
+    free(journal->pending);
+    free(journal->writing);
+    if (journal->sync_fd >= 0)
+        close(journal->sync_fd);
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->checkpoint_lock);
+    pthread_mutex_destroy(&journal->lock);
+}
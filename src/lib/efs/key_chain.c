@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <openssl/crypto.h>
 #include <efs/key_chain.h>
 #include <efs/file_utils.h>
 #include <efs/efs.h>
@@ -124,6 +125,42 @@ int remove_ecryptfs_key(char *sig)
     return 0;
 }
 
+/**
+ * Read back a key added with add_ecryptfs_key
+ *
+ * @param sig Key signature (hash of the key)
+ * @param key Key of ECRYPTFS_KEY_LEN bytes
+ * @param salt Salt of ECRYPTFS_SALT_SIZE bytes
+ *
+ * @return 0 for success, negative value in case of an error
+ */
+int read_ecryptfs_key(char *sig, unsigned char *key, unsigned char *salt)
+{
+    struct ecryptfs_auth_tok tok;
+    key_serial_t id;
+    long n;
+
+    id = syscall(__NR_keyctl, KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING, KEY_TYPE, sig, 0);
+    if (id < 0) {
+        LOGE("Failed to find key with sig %s\n", sig);
+        return id;
+    }
+
+    n = syscall(__NR_keyctl, KEYCTL_READ, id, (char *)&tok, sizeof(tok));
+    if (n != sizeof(tok)) {
+        LOGE("Failed to read key with sig %s\n", sig);
+        OPENSSL_cleanse(&tok, sizeof(tok));
+        return -1;
+    }
+
+    memcpy(key, tok.token.password.session_key_encryption_key,
+           ECRYPTFS_KEY_LEN);
+    memcpy(salt, tok.token.password.salt, ECRYPTFS_SALT_SIZE);
+    OPENSSL_cleanse(&tok, sizeof(tok));
+
+    return 0;
+}
+
 /**
  * Convert buffer to hex format.
  * Note: This function assume that dest buffer is at least 2*src_len
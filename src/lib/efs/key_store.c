@@ -40,6 +40,7 @@
 #include <efs/process.h>
 #include <efs/crypto.h>
 #include <efs/key_store.h>
+#include <efs/journal.h>
 
 /**
  * Construction to get the private storage path
@@ -179,3 +180,24 @@ int get_key_storage_path(char *path, char *storage_path)
     return snprintf(path, MAX_PATH_LENGTH, "%s%s.%s", KEY_STORAGE_PATH,
             KEY_FILE_NAME, id);
 }
+
+/**
+ * Get the path of the copy journal used to resume an interrupted
+ * encryption; it is kept next to the key file
+ *
+ * @param path Journal path
+ * @param storage_path EFS storage path
+ *
+ * @return 0 on success, negative value on error
+ */
+int get_journal_path(char *path, char *storage_path)
+{
+    int ret;
+
+    ret = get_key_storage_path(path, storage_path);
+    if (ret < 0 || ret + strlen(JOURNAL_SUFFIX) >= MAX_PATH_LENGTH)
+        return -1;
+
+    strcat(path, JOURNAL_SUFFIX);
+    return 0;
+}
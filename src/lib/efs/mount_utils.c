@@ -28,6 +28,7 @@
 
 #include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <openssl/crypto.h>
 #include <errno.h>
 #include <sys/syscall.h>
 #include <sys/stat.h>
@@ -206,17 +207,18 @@ int ecryptfs_wait_and_unmount(const char *mount_point)
 }
 
 /**
- * Mount ecryptfs
+ * Mount ecryptfs with plain text keys
  *
  * @param path Path
  * @param mount_point Mount Point
- * @param passwd Password
- * @param key_storage_path Key storage path
+ * @param fefek File encryption key
+ * @param fnek File name encryption key
+ * @param salt Salt of the keyring tokens
  *
  * @return 0 on success, negative value in case of an error
  */
-int mount_ecryptfs(char *path, char *mount_point, char *passwd,
-           char *key_storage_path)
+int mount_ecryptfs_keys(char *path, char *mount_point, unsigned char *fefek,
+                        unsigned char *fnek, unsigned char *salt)
 {
     int ret = -1;
     unsigned char fefek_hash[ECRYPTFS_SIG_LEN];
@@ -224,49 +226,29 @@ int mount_ecryptfs(char *path, char *mount_point, char *passwd,
     unsigned char fnek_hash[ECRYPTFS_SIG_LEN];
     char fnek_hash_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
     char mount_options[MAX_OPTION_LENGTH];
-    struct crypto_header header;
     struct stat st;
 
-    /* Nothing to do if ecryptfs is already mounted on <path> */
-    if (check_fs_mounted(path) == 1) {
-        LOGE("ecryptfs is already mounted on %s", path);
-        return 0;
-    }
-
     ret = stat(mount_point, &st);
     if (ret < 0) {
         LOGE("lstat failed on %s", mount_point);
         return ret;
     }
 
-    ret = read_crypto_header(&header, key_storage_path);
-    if (ret < 0) {
-        LOGE("Unable to read crypto header");
-        return ret;
-    }
-
-    ret = check_passwd(&header, passwd);
-    if (ret < 0) {
-        LOGE("Wrong Password");
-        return ret;
-    }
-
     /* Compute hash of fefek */
-    SHA512(header.fefek, ECRYPTFS_KEY_LEN, fefek_hash);
+    SHA512(fefek, ECRYPTFS_KEY_LEN, fefek_hash);
     convert_to_hex_format(fefek_hash, fefek_hash_hex, ECRYPTFS_SIG_SIZE);
 
     /* Compute hash of fnek */
-    SHA512(header.fnek, ECRYPTFS_KEY_LEN, fnek_hash);
+    SHA512(fnek, ECRYPTFS_KEY_LEN, fnek_hash);
     convert_to_hex_format(fnek_hash, fnek_hash_hex, ECRYPTFS_SIG_SIZE);
 
-    /* ToDo add gotos for fail */
     /* Add fefek to kernel keyring */
-    ret = add_ecryptfs_key(header.fefek, fefek_hash_hex, header.salt);
+    ret = add_ecryptfs_key(fefek, fefek_hash_hex, salt);
     if (ret < 0)
         return ret;
 
     /* Add fnek to kernel keyring */
-    ret = add_ecryptfs_key(header.fnek, fnek_hash_hex, header.salt);
+    ret = add_ecryptfs_key(fnek, fnek_hash_hex, salt);
     if (ret < 0)
         return ret;
 
@@ -296,6 +278,46 @@ int mount_ecryptfs(char *path, char *mount_point, char *passwd,
     return 0;
 }
 
+/**
+ * Mount ecryptfs
+ *
+ * @param path Path
+ * @param mount_point Mount Point
+ * @param ctx Keys of the password
+ * @param key_storage_path Key storage path
+ *
+ * @return 0 on success, negative value in case of an error
+ */
+int mount_ecryptfs(char *path, char *mount_point, struct key_ctx *ctx,
+           char *key_storage_path)
+{
+    struct crypto_header header;
+    int ret = -1;
+
+    /* Nothing to do if ecryptfs is already mounted on <path> */
+    if (check_fs_mounted(path) == 1) {
+        LOGE("ecryptfs is already mounted on %s", path);
+        return 0;
+    }
+
+    ret = read_crypto_header(&header, key_storage_path);
+    if (ret < 0) {
+        LOGE("Unable to read crypto header");
+        return ret;
+    }
+
+    ret = check_passwd(&header, ctx);
+    if (ret < 0)
+        LOGE("Wrong Password");
+    else
+        ret = mount_ecryptfs_keys(path, mount_point, header.fefek,
+                                  header.fnek, header.salt);
+
+    /* The keys are in the keyring, the plain text copy is not needed */
+    OPENSSL_cleanse(&header, sizeof(header));
+    return ret;
+}
+
 /**
  * Unmount encryptfs
  *
@@ -0,0 +1,240 @@
+/**
+ * @file   throttle.c
+ * @author Catalin Ionita <catalin.ionita@intel.com>
+ * @date   Fri Oct 16 18:02:37 2026
+ *
+ * @brief
+ * Background copy throttling: idle I/O and CPU priority, a bytes per
+ * second cap and a pause whenever /proc/pressure shows that the rest of
+ * the system is stalled on I/O or memory.
+ *
+ */
+
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <efs/efs.h>
+#include <efs/file_utils.h>
+#include <efs/throttle.h>
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ns(int64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/**
+ * Read the total stall time of a pressure file
+ * The first line is "some avg10=... avg60=... avg300=... total=<us>"
+ *
+ * @param path Pressure file
+ * @param total Stall time in microseconds
+ *
+ * @return 0 on success, negative value if pressure is not available
+ */
+static int read_stall(const char *path, int64_t *total)
+{
+    char buf[256], *p;
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    p = strstr(buf, "total=");
+    if (strncmp(buf, "some", 4) || !p)
+        return -1;
+    *total = strtoll(p + strlen("total="), NULL, 10);
+
+    return 0;
+}
+
+/**
+ * Sample pressure and pause the copy if the stalled share of the last
+ * interval is above the limit. The copy's own stalls are included, so
+ * after a pause the next sample mostly covers the pause itself and the
+ * backoff only grows if the rest of the system is still stalled
+ * Caller must hold the throttle lock
+ *
+ * @param throttle Throttle
+ * @param now Current time in ns
+ */
+static void check_pressure(struct throttle *throttle, int64_t now)
+{
+    int64_t io = throttle->io_stall_us, mem = throttle->mem_stall_us;
+    int64_t interval_us, stalled;
+
+    interval_us = (now - throttle->sample_ns) / 1000;
+    read_stall(PSI_IO_PATH, &io);
+    read_stall(PSI_MEMORY_PATH, &mem);
+
+    stalled = io - throttle->io_stall_us;
+    if (mem - throttle->mem_stall_us > stalled)
+        stalled = mem - throttle->mem_stall_us;
+
+    throttle->io_stall_us = io;
+    throttle->mem_stall_us = mem;
+    throttle->sample_ns = now;
+
+    if (stalled * 100 <= interval_us * throttle->psi_limit) {
+        throttle->backoff_ms = 0;
+        return;
+    }
+
+    if (throttle->backoff_ms == 0)
+        throttle->backoff_ms = BACKOFF_MIN_MS;
+    else if (throttle->backoff_ms < BACKOFF_MAX_MS)
+        throttle->backoff_ms *= 2;
+    throttle->pause_ns = now + throttle->backoff_ms * 1000000LL;
+}
+
+/**
+ * Prepare throttling of a copy
+ * In background mode the calling thread gets idle I/O priority and the
+ * lowest CPU priority; copy workers started afterwards inherit both
+ *
+ * @param throttle Throttle
+ * @param background Non zero to throttle, otherwise this is a no-op
+ * @param rate Bytes per second cap, 0 for none
+ * @param psi_limit Stalled share in percent that pauses the copy,
+ * 0 to ignore pressure
+ *
+ * @return 0 on success, negative value on error
+ */
+int throttle_init(struct throttle *throttle, int background, int64_t rate,
+                  int psi_limit)
+{
+    memset(throttle, 0, sizeof(struct throttle));
+    if (!background)
+        return 0;
+
+    pthread_mutex_init(&throttle->lock, NULL);
+    throttle->enabled = 1;
+    throttle->rate = rate > 0 ? rate : 0;
+    throttle->psi_limit = psi_limit > 0 ? psi_limit : 0;
+    throttle->sample_ns = now_ns();
+
+    if (throttle->psi_limit &&
+        (read_stall(PSI_IO_PATH, &throttle->io_stall_us) < 0 ||
+         read_stall(PSI_MEMORY_PATH, &throttle->mem_stall_us) < 0)) {
+        LOGI("Pressure stall information not available");
+        throttle->psi_limit = 0;
+    }
+
+    throttle->saved_ioprio = syscall(__NR_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    if (syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+        LOGE("Unable to set idle I/O priority: %s", strerror(errno));
+
+    errno = 0;
+    throttle->saved_nice = getpriority(PRIO_PROCESS, 0);
+    if (errno == 0 && setpriority(PRIO_PROCESS, 0, BACKGROUND_NICE) < 0)
+        LOGE("Unable to lower priority: %s", strerror(errno));
+
+    LOGI("Background copy, rate cap %lld B/s, pressure limit %d%%",
+         (long long)throttle->rate, throttle->psi_limit);
+    return 0;
+}
+
+/**
+ * Account copied bytes and wait if the copy must slow down
+ * Called concurrently by the copy workers
+ *
+ * @param throttle Throttle
+ * @param bytes Bytes just copied
+ */
+void throttle_account(struct throttle *throttle, int64_t bytes)
+{
+    int64_t now, until;
+
+    if (!throttle->enabled)
+        return;
+
+    now = now_ns();
+    pthread_mutex_lock(&throttle->lock);
+
+    if (throttle->psi_limit &&
+        now - throttle->sample_ns >= PSI_INTERVAL_MS * 1000000LL)
+        check_pressure(throttle, now);
+
+    until = throttle->pause_ns;
+    if (throttle->rate) {
+        /* Idle time does not build up a budget */
+        if (throttle->next_ns < now)
+            throttle->next_ns = now;
+        throttle->next_ns += bytes / throttle->rate * 1000000000LL +
+            bytes % throttle->rate * 1000000000LL / throttle->rate;
+        if (throttle->next_ns > until)
+            until = throttle->next_ns;
+    }
+    if (until > now)
+        throttle->waited_ns += until - now;
+
+    pthread_mutex_unlock(&throttle->lock);
+
+    if (until > now)
+        sleep_ns(until - now);
+}
+
+/**
+ * Restore the priorities of the calling thread
+ *
+ * @param throttle Throttle
+ */
+void throttle_destroy(struct throttle *throttle)
+{
+    if (!throttle->enabled)
+        return;
+
+    if (throttle->saved_ioprio >= 0)
+        syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                throttle->saved_ioprio);
+    setpriority(PRIO_PROCESS, 0, throttle->saved_nice);
+
+    LOGI("Background copy waited %lld ms",
+         (long long)(throttle->waited_ns / 1000000));
+    pthread_mutex_destroy(&throttle->lock);
+    throttle->enabled = 0;
+}
@@ -0,0 +1,269 @@
+/**
+ * @file   trash.c
+ * @author Catalin Ionita <catalin.ionita@intel.com>
+ * @date   Fri Oct 16 23:40:12 2026
+ *
+ * @brief
+ * Deferred removal of stale data under a storage mount point.
+ * The entries are renamed into a hidden trash directory of the storage
+ * so it can be mounted at once, and a background thread at idle
+ * priority deletes the trash through a descriptor opened before the
+ * mount. A trash left by a dead process is removed on the next start.
+ *
+ */
+
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <efs/efs.h>
+#include <efs/file_utils.h>
+#include <efs/throttle.h>
+#include <efs/trash.h>
+#include <cutils/properties.h>
+
+/* Distinguishes the batches of one process inside a trash directory */
+static unsigned int trash_seq;
+
+/**
+ * Delete the trash of a storage; body of the background thread
+ * The thread and the delete threads it starts run at idle priority
+ *
+ * @param arg Storage directory fd, opened before any mount on it
+ *
+ * @return NULL
+ */
+static void *trash_thread(void *arg)
+{
+    int fd = (int)(long)arg;
+
+    if (syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+        LOGE("Unable to set idle I/O priority: %s", strerror(errno));
+    if (setpriority(PRIO_PROCESS, 0, BACKGROUND_NICE) < 0)
+        LOGE("Unable to lower priority: %s", strerror(errno));
+
+    if (remove_dir_content_at(fd, TRASH_DIR_NAME) < 0) {
+        LOGE("Unable to empty trash, it is kept for the next start");
+    } else if (unlinkat(fd, TRASH_DIR_NAME, AT_REMOVEDIR) < 0 &&
+               errno != ENOENT) {
+        /* Refilled by a later unlock, whose thread removes it */
+        LOGI("Trash kept: %s", strerror(errno));
+    }
+
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Delete the trash of a storage in a detached thread
+ * If no thread can be started, the trash is deleted before returning
+ *
+ * @param fd Storage directory fd, closed when the trash is gone
+ */
+static void trash_start(int fd)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, trash_thread, (void *)(long)fd);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        LOGE("Unable to start trash thread: %s", strerror(ret));
+        trash_thread((void *)(long)fd);
+    }
+}
+
+/**
+ * Create a new batch directory in the trash of a storage
+ *
+ * @param fd Storage directory
+ *
+ * @return Open batch directory, negative value on error
+ */
+static int trash_open_batch(int fd)
+{
+    char name[32];
+    int trash_fd, batch_fd = -1;
+
+    if (mkdirat(fd, TRASH_DIR_NAME, S_IRWXU) < 0 && errno != EEXIST) {
+        LOGE("Unable to create %s: %s", TRASH_DIR_NAME, strerror(errno));
+        return -1;
+    }
+
+    trash_fd = openat(fd, TRASH_DIR_NAME,
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (trash_fd < 0) {
+        LOGE("Unable to open %s: %s", TRASH_DIR_NAME, strerror(errno));
+        return -1;
+    }
+
+    /* Batches of a dead process with the same pid may still be there */
+    for (;;) {
+        snprintf(name, sizeof(name), "%d.%u", (int)getpid(),
+                 __sync_fetch_and_add(&trash_seq, 1));
+        if (mkdirat(trash_fd, name, S_IRWXU) == 0)
+            break;
+        if (errno != EEXIST) {
+            LOGE("Unable to create trash batch: %s", strerror(errno));
+            goto out;
+        }
+    }
+
+    batch_fd = openat(trash_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (batch_fd < 0)
+        LOGE("Unable to open trash batch: %s", strerror(errno));
+
+out:
+    close(trash_fd);
+    return batch_fd;
+}
+
+/**
+ * Rename every entry of a storage, but the trash, into a trash batch
+ * The directory is listed again until nothing is left, as renaming
+ * entries while reading it may hide some of them
+ *
+ * @param fd Storage directory
+ * @param batch_fd Trash batch
+ *
+ * @return 0 on success, negative value on error
+ */
+static int trash_move(int fd, int batch_fd)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int dir_fd, moved;
+
+    dir_fd = dup(fd);
+    if (dir_fd < 0)
+        return -1;
+    dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return -1;
+    }
+
+    do {
+        moved = 0;
+        rewinddir(dir);
+        while ((entry = readdir(dir)) != NULL) {
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")
+                || !strcmp(entry->d_name, TRASH_DIR_NAME))
+                continue;
+
+            if (renameat(fd, entry->d_name, batch_fd, entry->d_name) < 0) {
+                LOGE("Unable to move %s to trash: %s", entry->d_name,
+                     strerror(errno));
+                closedir(dir);
+                return -1;
+            }
+            moved++;
+        }
+    } while (moved);
+
+    closedir(dir);
+    return 0;
+}
+
+/**
+ * Empty a directory before a storage is mounted on it
+ * The entries are only renamed; they are deleted by a background
+ * thread at idle priority, together with the trash of an earlier run
+ * Falls back to deleting them in place if the trash is disabled or
+ * can't be used
+ *
+ * @param path Directory path
+ *
+ * @return 0 on success, negative value in case of an error
+ */
+int trash_dir_content(const char *path)
+{
+    char buff[PROPERTY_VALUE_MAX];
+    int fd, batch_fd, ret;
+
+    memset(buff, 0, sizeof(buff));
+    property_get(TRASH_PROPERTY, buff, "1");
+    if (atoi(buff) <= 0)
+        return remove_dir_content(path);
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Unable to open %s", path);
+        return -1;
+    }
+
+    batch_fd = trash_open_batch(fd);
+    if (batch_fd < 0) {
+        close(fd);
+        return remove_dir_content(path);
+    }
+
+    ret = trash_move(fd, batch_fd);
+    close(batch_fd);
+    if (ret < 0) {
+        close(fd);
+        return remove_dir_content(path);
+    }
+
+    trash_start(fd);
+    return 0;
+}
+
+/**
+ * Delete in the background a trash left under a storage by a process
+ * that died before emptying it
+ *
+ * @param path Directory path
+ *
+ * @return 1 if a trash was found, 0 if there is none, negative value
+ * on error
+ */
+int trash_recover(const char *path)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    if (fstatat(fd, TRASH_DIR_NAME, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+        !S_ISDIR(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+
+    LOGI("Removing trash left under %s", path);
+    trash_start(fd);
+    return 1;
+}
@@ -0,0 +1,431 @@
+/**
+ * @file   unlock_cache.c
+ * @author Catalin Ionita <catalin.ionita@intel.com>
+ * @date   Sat Oct 17 10:12:36 2026
+ *
+ * @brief
+ * Re-unlock cache for storages locked during user switching.
+ * On lock, fefek and fnek are read back from the kernel keyring,
+ * wrapped under HMAC(session key, token) for a random session key and a
+ * caller chosen token, and kept in a dedicated keyring whose entries
+ * the kernel expires. The session key is a separate key only its
+ * possessor can read, so the wrapped keys alone do not allow guessing
+ * the token offline. Within the timeout the token alone remounts the
+ * storage, without the KDF.
+ *
+ */
+
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+#include <asm/unistd.h>
+#include <linux/keyctl.h>
+#include <cutils/properties.h>
+#include <efs/efs.h>
+#include <efs/key_chain.h>
+#include <efs/file_utils.h>
+#include <efs/crypto.h>
+#include <efs/mount_utils.h>
+#include <efs/unlock_cache.h>
+
+typedef int32_t key_serial_t;
+
+/* Possessor permissions of a key, see keyctl(2) */
+#define KEY_POS_VIEW 0x01000000
+#define KEY_POS_READ 0x02000000
+#define KEY_POS_SEARCH 0x08000000
+#define KEY_POS_SETATTR 0x20000000
+
+/**
+ * Get how long a locked storage can be unlocked with its token
+ *
+ * @return timeout in seconds, 0 if the cache is disabled
+ */
+int unlock_cache_timeout(void)
+{
+    char buff[PROPERTY_VALUE_MAX];
+    int timeout;
+
+    memset(buff, 0, sizeof(buff));
+    property_get(UNLOCK_CACHE_PROPERTY, buff, "0");
+    timeout = atoi(buff);
+
+    return timeout > 0 ? timeout : 0;
+}
+
+/**
+ * Find the keyring of the cache
+ *
+ * @param create Create the keyring if it is missing
+ *
+ * @return keyring id, negative value if not found or on error
+ */
+static key_serial_t cache_keyring(int create)
+{
+    key_serial_t id;
+
+    id = syscall(__NR_keyctl, KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING,
+                 "keyring", UNLOCK_CACHE_KEYRING, 0);
+    if (id >= 0 || !create)
+        return id;
+
+    /* add_key replaces a keyring of the same name, so only add it once */
+    id = syscall(__NR_add_key, "keyring", UNLOCK_CACHE_KEYRING, NULL, 0,
+                 KEY_SPEC_USER_KEYRING);
+    if (id < 0)
+        LOGE("Unable to create keyring %s: %s", UNLOCK_CACHE_KEYRING,
+             strerror(errno));
+
+    return id;
+}
+
+/**
+ * Get the key description of a cache entry or of its session key
+ *
+ * @param name Description, MAX_PATH_LENGTH bytes
+ * @param prefix UNLOCK_CACHE_PREFIX or UNLOCK_SESSION_PREFIX
+ * @param mount_point Sanitized storage path
+ */
+static void entry_name(char *name, const char *prefix, const char *mount_point)
+{
+    snprintf(name, MAX_PATH_LENGTH, "%s%s", prefix, mount_point);
+}
+
+/**
+ * Find the cache entry or the session key of a storage
+ *
+ * @param keyring Cache keyring
+ * @param prefix UNLOCK_CACHE_PREFIX or UNLOCK_SESSION_PREFIX
+ * @param mount_point Sanitized storage path
+ *
+ * @return key id, negative value if not found
+ */
+static key_serial_t find_entry(key_serial_t keyring, const char *prefix,
+                               const char *mount_point)
+{
+    char name[MAX_PATH_LENGTH];
+
+    entry_name(name, prefix, mount_point);
+    return syscall(__NR_keyctl, KEYCTL_SEARCH, keyring, KEY_TYPE, name, 0);
+}
+
+/**
+ * Add a key to the cache; the kernel expires it after the timeout
+ *
+ * @param keyring Cache keyring
+ * @param prefix UNLOCK_CACHE_PREFIX or UNLOCK_SESSION_PREFIX
+ * @param mount_point Sanitized storage path
+ * @param data Payload
+ * @param len Payload length
+ * @param timeout Seconds before the key expires
+ * @param perm Permissions of the key, 0 to keep the defaults
+ *
+ * @return key id, negative value on error
+ */
+static key_serial_t add_entry(key_serial_t keyring, const char *prefix,
+                              const char *mount_point, const void *data,
+                              size_t len, int timeout, uint32_t perm)
+{
+    char name[MAX_PATH_LENGTH];
+    key_serial_t id;
+
+    entry_name(name, prefix, mount_point);
+    id = syscall(__NR_add_key, KEY_TYPE, name, data, len, keyring);
+    if (id < 0) {
+        LOGE("Unable to add %s: %s", name, strerror(errno));
+        return id;
+    }
+
+    if (syscall(__NR_keyctl, KEYCTL_SET_TIMEOUT, id, timeout) < 0 ||
+        (perm && syscall(__NR_keyctl, KEYCTL_SETPERM, id, perm) < 0)) {
+        LOGE("Unable to protect %s: %s", name, strerror(errno));
+        syscall(__NR_keyctl, KEYCTL_UNLINK, id, keyring);
+        return -1;
+    }
+
+    return id;
+}
+
+/**
+ * Read and unlink the cache entry or the session key of a storage
+ *
+ * @param keyring Cache keyring
+ * @param prefix UNLOCK_CACHE_PREFIX or UNLOCK_SESSION_PREFIX
+ * @param mount_point Sanitized storage path
+ * @param data Payload
+ * @param len Expected payload length
+ *
+ * @return 0 on success, negative value if missing or malformed
+ */
+static int take_entry(key_serial_t keyring, const char *prefix,
+                      const char *mount_point, void *data, size_t len)
+{
+    key_serial_t id;
+    long n;
+
+    /* Expired keys are not found */
+    id = find_entry(keyring, prefix, mount_point);
+    if (id < 0)
+        return -1;
+
+    n = syscall(__NR_keyctl, KEYCTL_READ, id, (char *)data, len);
+    syscall(__NR_keyctl, KEYCTL_UNLINK, id, keyring);
+    if (n != (long)len) {
+        LOGE("Malformed cache entry for %s", mount_point);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Derive the key and IV wrapping a cache entry from a token
+ *
+ * @param session Session key of the entry
+ * @param token Caller token
+ * @param wrap Key followed by the IV, SHA512_DIGEST_LENGTH bytes
+ *
+ * @return 0 on success, negative value on error
+ */
+static int wrap_key(const unsigned char *session, const char *token,
+                    unsigned char *wrap)
+{
+    if (!HMAC(EVP_sha512(), session, UNLOCK_SESSION_KEY_LEN,
+              (const unsigned char *)token, strlen(token), wrap, NULL)) {
+        LOGE("Unable to derive wrapping key");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Check that a key matches its ecryptfs signature
+ *
+ * @param key Key of ECRYPTFS_KEY_LEN bytes
+ * @param sig Signature from the mount options
+ *
+ * @return 1 if it matches, 0 otherwise
+ */
+static int key_matches(unsigned char *key, const char *sig)
+{
+    unsigned char hash[SHA512_DIGEST_LENGTH];
+    char hash_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+
+    SHA512(key, ECRYPTFS_KEY_LEN, hash);
+    convert_to_hex_format(hash, hash_hex, ECRYPTFS_SIG_SIZE);
+
+    return strcmp(hash_hex, sig) == 0;
+}
+
+/**
+ * Keep the keys of a mounted storage that is about to be locked
+ * Nothing is kept while the cache is disabled
+ *
+ * @param mount_point Sanitized storage path
+ * @param token Secret the storage can be unlocked with again
+ *
+ * @return 0 on success, negative value on error
+ */
+int unlock_cache_store(const char *mount_point, const char *token)
+{
+    struct unlock_cache_entry entry;
+    unsigned char session[UNLOCK_SESSION_KEY_LEN];
+    unsigned char keys[2 * ECRYPTFS_KEY_LEN];
+    unsigned char wrap[SHA512_DIGEST_LENGTH];
+    char mount_options[MAX_OPTION_LENGTH];
+    key_serial_t keyring, session_id, id;
+    int timeout = unlock_cache_timeout();
+    int fd, ret = -1;
+
+    if (timeout == 0)
+        return 0;
+
+    if (!token || strlen(token) < UNLOCK_TOKEN_MIN_LEN) {
+        LOGE("Unlock token too short");
+        return -1;
+    }
+
+    ret = get_mount_options(mount_point, mount_options);
+    if (ret != 1) {
+        LOGE("%s not mounted", mount_point);
+        return -1;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    ret = get_key_hash_from_mount_options(mount_options, entry.fefek_sig,
+                                          entry.fnek_sig);
+    if (ret < 0)
+        return ret;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open /dev/urandom");
+        return fd;
+    }
+    ret = read(fd, session, UNLOCK_SESSION_KEY_LEN);
+    close(fd);
+    if (ret != UNLOCK_SESSION_KEY_LEN) {
+        LOGE("Can't read from /dev/urandom");
+        ret = -1;
+        goto out;
+    }
+
+    /* Both keys were added with the salt of the same header */
+    ret = read_ecryptfs_key(entry.fefek_sig, keys, entry.salt);
+    if (ret == 0)
+        ret = read_ecryptfs_key(entry.fnek_sig, keys + ECRYPTFS_KEY_LEN,
+                                entry.salt);
+    if (ret == 0)
+        ret = wrap_key(session, token, wrap);
+    if (ret == 0)
+        ret = encrypt_buffer(keys, sizeof(keys), entry.keys, wrap,
+                             wrap + ECRYPTFS_KEY_LEN);
+    if (ret < 0)
+        goto out;
+
+    keyring = cache_keyring(1);
+    if (keyring < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    /* A protected session key can't be updated in place */
+    unlock_cache_drop(mount_point);
+
+    session_id = add_entry(keyring, UNLOCK_SESSION_PREFIX, mount_point,
+                           session, sizeof(session), timeout,
+                           KEY_POS_VIEW | KEY_POS_READ | KEY_POS_SEARCH |
+                           KEY_POS_SETATTR);
+    if (session_id < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    id = add_entry(keyring, UNLOCK_CACHE_PREFIX, mount_point, &entry,
+                   sizeof(entry), timeout, 0);
+    if (id < 0) {
+        syscall(__NR_keyctl, KEYCTL_UNLINK, session_id, keyring);
+        ret = -1;
+        goto out;
+    }
+
+    LOGI("Keys of %s cached for %d s", mount_point, timeout);
+
+out:
+    OPENSSL_cleanse(session, sizeof(session));
+    OPENSSL_cleanse(keys, sizeof(keys));
+    OPENSSL_cleanse(wrap, sizeof(wrap));
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Get the keys of a storage locked with unlock_cache_store
+ * The entry is dropped whatever the outcome, so a token gets one try
+ *
+ * @param mount_point Sanitized storage path
+ * @param token Token given on lock
+ * @param fefek File encryption key
+ * @param fnek File name encryption key
+ * @param salt Salt of the keyring tokens, ECRYPTFS_SALT_SIZE bytes
+ *
+ * @return 0 on success, negative value if the keys are not available
+ */
+int unlock_cache_load(const char *mount_point, const char *token,
+                      unsigned char *fefek, unsigned char *fnek,
+                      unsigned char *salt)
+{
+    struct unlock_cache_entry entry;
+    unsigned char session[UNLOCK_SESSION_KEY_LEN];
+    unsigned char keys[2 * ECRYPTFS_KEY_LEN];
+    unsigned char wrap[SHA512_DIGEST_LENGTH];
+    key_serial_t keyring;
+    int ret = -1;
+
+    if (!token || strlen(token) < UNLOCK_TOKEN_MIN_LEN)
+        return -1;
+
+    keyring = cache_keyring(0);
+    if (keyring < 0)
+        return -1;
+
+    /* Both are taken, so neither outlives a failed try */
+    ret = take_entry(keyring, UNLOCK_CACHE_PREFIX, mount_point, &entry,
+                     sizeof(entry));
+    if (take_entry(keyring, UNLOCK_SESSION_PREFIX, mount_point, session,
+                   sizeof(session)) < 0)
+        ret = -1;
+    if (ret == 0)
+        ret = wrap_key(session, token, wrap);
+    if (ret == 0)
+        ret = decrypt_buffer(entry.keys, sizeof(keys), keys, wrap,
+                             wrap + ECRYPTFS_KEY_LEN);
+    if (ret < 0)
+        goto out;
+
+    entry.fefek_sig[ECRYPTFS_SIG_SIZE_HEX] = '\0';
+    entry.fnek_sig[ECRYPTFS_SIG_SIZE_HEX] = '\0';
+    if (!key_matches(keys, entry.fefek_sig) ||
+        !key_matches(keys + ECRYPTFS_KEY_LEN, entry.fnek_sig)) {
+        LOGE("Wrong unlock token for %s", mount_point);
+        ret = -1;
+        goto out;
+    }
+
+    memcpy(fefek, keys, ECRYPTFS_KEY_LEN);
+    memcpy(fnek, keys + ECRYPTFS_KEY_LEN, ECRYPTFS_KEY_LEN);
+    memcpy(salt, entry.salt, ECRYPTFS_SALT_SIZE);
+
+out:
+    OPENSSL_cleanse(session, sizeof(session));
+    OPENSSL_cleanse(keys, sizeof(keys));
+    OPENSSL_cleanse(wrap, sizeof(wrap));
+    OPENSSL_cleanse(&entry, sizeof(entry));
+    return ret;
+}
+
+/**
+ * Forget the cached keys of a storage
+ *
+ * @param mount_point Sanitized storage path
+ */
+void unlock_cache_drop(const char *mount_point)
+{
+    key_serial_t keyring, id;
+
+    keyring = cache_keyring(0);
+    if (keyring < 0)
+        return;
+
+    id = find_entry(keyring, UNLOCK_CACHE_PREFIX, mount_point);
+    if (id >= 0)
+        syscall(__NR_keyctl, KEYCTL_UNLINK, id, keyring);
+    id = find_entry(keyring, UNLOCK_SESSION_PREFIX, mount_point);
+    if (id >= 0)
+        syscall(__NR_keyctl, KEYCTL_UNLINK, id, keyring);
+}
@@ -0,0 +1,695 @@
+/**
+ * @file   uring_copy.c
+ * @author Catalin Ionita <catalin.ionita@intel.com>
+ * @date   Fri Oct 16 14:02:37 2026
+ *
+ * @brief
+ * Asynchronous copy engine built on io_uring. Opens, reads, writes and
+ * closes for many files are kept in flight on a single ring.
+ *
+ */
+
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <efs/efs.h>
+#include <efs/file_utils.h>
+#include <efs/uring_copy.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+enum {
+    OP_OPEN_SRC,
+    OP_OPEN_DST,
+    OP_READ,
+    OP_WRITE,
+    OP_CLOSE,
+};
+
+enum {
+    SLOT_FREE,
+    SLOT_OPEN,
+    SLOT_COPY,
+    SLOT_CLOSE,
+};
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned to_submit;
+};
+
+struct uring_slot {
+    struct uring_file *file;
+    int state;
+    int inflight;
+    int error;
+    int fd_src;
+    int fd_dst;
+    off64_t pos;
+    char *buffer;
+    unsigned write_len;
+    unsigned write_done;
+};
+
+/**
+ * Create an io_uring instance and map its rings
+ *
+ * @param ring Ring descriptor
+ * @param entries Submission queue size
+ *
+ * @return 0 on success, negative errno on error
+ */
+static int uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    int ret;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -errno;
+
+    ring->entries = p.sq_entries;
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ret = -errno;
+        goto err_close;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd,
+                    IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ret = -errno;
+            goto err_sq;
+        }
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ret = -errno;
+        goto err_cq;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+    return 0;
+
+err_cq:
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+err_sq:
+    munmap(ring->sq_ptr, ring->sq_len);
+err_close:
+    close(ring->fd);
+    return ret;
+}
+
+/**
+ * Unmap the rings and close the io_uring instance
+ *
+ * @param ring Ring descriptor
+ */
+static void uring_exit(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+/**
+ * Check that the kernel supports every opcode used by the engine
+ *
+ * @param ring Ring descriptor
+ *
+ * @return 1 if supported, 0 otherwise
+ */
+static int uring_probe_ops(struct uring *ring)
+{
+    static const int ops[] = {
+        IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE
+    };
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    unsigned i;
+    int ret;
+
+    probe = calloc(1, len);
+    if (!probe)
+        return 0;
+
+    /* IORING_REGISTER_PROBE itself needs 5.6, like the opcodes we use */
+    ret = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+              probe, 256);
+    if (ret < 0) {
+        free(probe);
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            free(probe);
+            return 0;
+        }
+    }
+
+    free(probe);
+    return 1;
+}
+
+/**
+ * Get a free submission entry; it is published by uring_commit
+ *
+ * @param ring Ring descriptor
+ *
+ * @return Cleared submission entry, NULL if the queue is full
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    /* Entries not consumed by the kernel yet must not be overwritten */
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->entries)
+        return NULL;
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+
+    return sqe;
+}
+
+/**
+ * Get a free submission entry, submitting the queued ones if it is full
+ *
+ * @param ring Ring descriptor
+ *
+ * @return Cleared submission entry, NULL if none can be freed
+ */
+static struct io_uring_sqe *uring_next_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    int ret;
+
+    while (!(sqe = uring_get_sqe(ring))) {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 0, 0,
+                      NULL, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            LOGE("Submission queue full: %s", ret < 0 ? strerror(errno) :
+                 "nothing consumed");
+            return NULL;
+        }
+        ring->to_submit -= ret;
+    }
+
+    return sqe;
+}
+
+/**
+ * Publish the entry returned by the last uring_get_sqe call
+ *
+ * @param ring Ring descriptor
+ * @param user_data Completion cookie
+ */
+static void uring_commit(struct uring *ring, struct io_uring_sqe *sqe,
+             unsigned long long user_data)
+{
+    sqe->user_data = user_data;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+static unsigned long long cookie(int slot, int op)
+{
+    return ((unsigned long long)slot << 8) | op;
+}
+
+static int queue_open(struct uring *ring, int slot, int op, int dirfd,
+               const char *name, int flags, mode_t mode)
+{
+    struct io_uring_sqe *sqe = uring_next_sqe(ring);
+
+    if (!sqe)
+        return -EBUSY;
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (unsigned long)name;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+    uring_commit(ring, sqe, cookie(slot, op));
+    return 0;
+}
+
+static int queue_rw(struct uring *ring, int slot, int op, int fd,
+             char *buf, unsigned len, off64_t off)
+{
+    struct io_uring_sqe *sqe = uring_next_sqe(ring);
+
+    if (!sqe)
+        return -EBUSY;
+    sqe->opcode = op == OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = off;
+    uring_commit(ring, sqe, cookie(slot, op));
+    return 0;
+}
+
+static int queue_close(struct uring *ring, int slot, int fd)
+{
+    struct io_uring_sqe *sqe = uring_next_sqe(ring);
+
+    if (!sqe)
+        return -EBUSY;
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    uring_commit(ring, sqe, cookie(slot, OP_CLOSE));
+    return 0;
+}
+
+/**
+ * Apply ownership, mode, times and the SELinux context of the source to
+ * the destination
+ * These have no io_uring opcode; they run on the open fd just before close
+ *
+ * @param s Slot
+ *
+ * @return 0 on success, negative value on error
+ */
+static int restore_metadata(struct uring_slot *s)
+{
+    const struct file_attr *attr = s->file->attr;
+    struct timespec times[2];
+    uint32_t con;
+
+    if (con_get_fd(s->file->cons, s->fd_src, &con) < 0) {
+        LOGE("Unable to get context of %s\n", s->file->name);
+        return -1;
+    }
+    if (con_set_fd(s->file->cons, s->fd_dst, con) < 0) {
+        LOGE("Unable to set context of %s\n", s->file->name);
+        return -1;
+    }
+    if (fchown(s->fd_dst, attr->uid, attr->gid) < 0) {
+        LOGE("chown %s fail\n", s->file->name);
+        return -1;
+    }
+    if (fchmod(s->fd_dst, attr->mode) < 0) {
+        LOGE("chmod %s fail\n", s->file->name);
+        return -1;
+    }
+
+    file_attr_times(attr, times);
+    if (futimens(s->fd_dst, times) < 0) {
+        LOGE("utime on %s failed", s->file->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Finish a file: restore metadata and queue the closes
+ *
+ * @param ring Ring descriptor
+ * @param s Slot
+ * @param i Slot index
+ */
+static void finish_slot(struct uring *ring, struct uring_slot *s, int i)
+{
+    if (!s->error && restore_metadata(s) < 0)
+        s->error = -1;
+
+    s->state = SLOT_CLOSE;
+    s->inflight = 0;
+    if (s->fd_src >= 0) {
+        if (queue_close(ring, i, s->fd_src) < 0)
+            close(s->fd_src);
+        else
+            s->inflight++;
+    }
+    if (s->fd_dst >= 0) {
+        if (queue_close(ring, i, s->fd_dst) < 0)
+            close(s->fd_dst);
+        else
+            s->inflight++;
+    }
+    if (s->inflight == 0)
+        s->state = SLOT_FREE;
+}
+
+/**
+ * Advance the state machine of a slot after a completion
+ *
+ * @param ring Ring descriptor
+ * @param slots Slot array
+ * @param cqe Completion entry
+ * @param buffer_size Read size
+ * @param progress Progress callback
+ * @param arg Progress callback argument
+ */
+static void handle_cqe(struct uring *ring, struct uring_slot *slots,
+               struct io_uring_cqe *cqe, size_t buffer_size,
+               copy_progress_fn progress, void *arg)
+{
+    int i = cqe->user_data >> 8;
+    int op = cqe->user_data & 0xff;
+    struct uring_slot *s = &slots[i];
+    int res = cqe->res;
+    int ret = 0;
+
+    s->inflight--;
+
+    switch (op) {
+    case OP_OPEN_SRC:
+    case OP_OPEN_DST:
+        if (res < 0) {
+            LOGE("open %s failed\n", s->file->name);
+            s->error = res;
+        } else if (op == OP_OPEN_SRC) {
+            s->fd_src = res;
+        } else {
+            s->fd_dst = res;
+        }
+        if (s->inflight > 0)
+            return;
+        if (s->error) {
+            finish_slot(ring, s, i);
+            return;
+        }
+        s->state = SLOT_COPY;
+        ret = queue_rw(ring, i, OP_READ, s->fd_src, s->buffer, buffer_size,
+                       0);
+        break;
+
+    case OP_READ:
+        if (res < 0) {
+            LOGE("Error reading from file\n");
+            s->error = res;
+        }
+        if (res <= 0) {
+            finish_slot(ring, s, i);
+            return;
+        }
+        s->write_len = res;
+        s->write_done = 0;
+        ret = queue_rw(ring, i, OP_WRITE, s->fd_dst, s->buffer, res, s->pos);
+        break;
+
+    case OP_WRITE:
+        if (res <= 0) {
+            s->error = res < 0 ? res : -EIO;
+            finish_slot(ring, s, i);
+            return;
+        }
+        if (progress)
+            progress(res, arg);
+        s->write_done += res;
+        if (s->write_done < s->write_len) {
+            ret = queue_rw(ring, i, OP_WRITE, s->fd_dst,
+                 s->buffer + s->write_done,
+                 s->write_len - s->write_done,
+                 s->pos + s->write_done);
+        } else {
+            s->pos += s->write_len;
+            ret = queue_rw(ring, i, OP_READ, s->fd_src, s->buffer,
+                 buffer_size, s->pos);
+        }
+        break;
+
+    case OP_CLOSE:
+        if (s->inflight == 0)
+            s->state = SLOT_FREE;
+        return;
+    }
+
+    if (ret < 0) {
+        s->error = ret;
+        finish_slot(ring, s, i);
+        return;
+    }
+    s->inflight++;
+}
+
+/**
+ * Check whether io_uring can be used by the copy engine
+ *
+ * @return 1 if available, 0 otherwise
+ */
+int uring_available(void)
+{
+    struct uring ring;
+    int ret;
+
+    if (uring_init(&ring, 2) < 0)
+        return 0;
+    ret = uring_probe_ops(&ring);
+    uring_exit(&ring);
+
+    return ret;
+}
+
+/**
+ * Copy regular files with io_uring
+ * Up to URING_SLOTS files are copied at once; the first error stops new
+ * files from being started and is returned once in-flight ones drain
+ *
+ * @param files Files to copy
+ * @param nr_files Number of files
+ * @param buffer_size Per-file read size
+ * @param progress Called with the number of bytes written
+ * @param arg Progress callback argument
+ * @param start Called before each file is opened, may be NULL
+ * @param done Called once each started file is closed, may be NULL
+ * @param file_arg Argument of start and done
+ *
+ * @return 0 on success, -ENOSYS if io_uring is unusable, negative value
+ * on copy error
+ */
+int uring_copy_files(struct uring_file *files, int nr_files,
+             size_t buffer_size, copy_progress_fn progress, void *arg,
+             uring_start_fn start, uring_done_fn done, void *file_arg)
+{
+    struct uring ring;
+    struct uring_slot slots[URING_SLOTS];
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    int i, next = 0, active = 0, error = 0, ret;
+    void *buffer;
+
+    ret = uring_init(&ring, URING_ENTRIES);
+    if (ret < 0) {
+        LOGI("io_uring unavailable (%s)", strerror(-ret));
+        return -ENOSYS;
+    }
+    if (!uring_probe_ops(&ring)) {
+        LOGI("io_uring lacks required opcodes");
+        uring_exit(&ring);
+        return -ENOSYS;
+    }
+
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < URING_SLOTS; i++) {
+        if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), buffer_size)) {
+            LOGE("insufficient memory\n");
+            error = -ENOMEM;
+            goto out;
+        }
+        slots[i].buffer = buffer;
+    }
+
+    while (next < nr_files || active > 0) {
+        /* Start new files in free slots */
+        for (i = 0; i < URING_SLOTS && next < nr_files && !error; i++) {
+            struct uring_slot *s = &slots[i];
+
+            if (s->state != SLOT_FREE)
+                continue;
+
+            s->file = &files[next++];
+            if (start) {
+                ret = start(s->file, file_arg);
+                if (ret < 0) {
+                    error = ret;
+                    break;
+                }
+            }
+            s->state = SLOT_OPEN;
+            s->error = 0;
+            s->fd_src = s->fd_dst = -1;
+            s->pos = 0;
+            s->inflight = 0;
+            ret = queue_open(&ring, i, OP_OPEN_SRC, s->file->src_dirfd,
+                   s->file->name, O_RDONLY, 0);
+            if (ret == 0) {
+                s->inflight++;
+                ret = queue_open(&ring, i, OP_OPEN_DST, s->file->dst_dirfd,
+                       s->file->name, O_CREAT | O_WRONLY | O_TRUNC,
+                       s->file->attr->mode & 07777);
+            }
+            if (ret == 0)
+                s->inflight++;
+            else
+                s->error = error = ret;
+            /* A queued open finishes the slot when it completes */
+            if (s->inflight == 0) {
+                s->state = SLOT_FREE;
+                if (done)
+                    done(s->file, s->error, file_arg);
+                continue;
+            }
+            active++;
+        }
+
+        if (active == 0)
+            break;
+
+        ret = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1,
+                  IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EBUSY && errno != EAGAIN) {
+                LOGE("io_uring_enter failed: %s", strerror(errno));
+                error = -errno;
+                goto abort;
+            }
+            /* Reap the completions before submitting again */
+            ret = 0;
+        }
+        ring.to_submit -= ret;
+
+        head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            i = cqe->user_data >> 8;
+            handle_cqe(&ring, slots, cqe, buffer_size, progress, arg);
+            head++;
+
+            if (slots[i].state == SLOT_FREE) {
+                active--;
+                if (done)
+                    slots[i].error = done(slots[i].file, slots[i].error,
+                                          file_arg);
+                if (slots[i].error && !error) {
+                    LOGE("Copying %s failed\n", slots[i].file->name);
+                    error = slots[i].error;
+                }
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    goto out;
+
+abort:
+    /*
+     * Ring exit is asynchronous: requests still in flight may write
+     * into the buffers of the active slots, so those are leaked instead
+     * of freed. Their descriptors are closed, unless closes are queued.
+     */
+    for (i = 0; i < URING_SLOTS; i++) {
+        struct uring_slot *s = &slots[i];
+
+        if (s->state == SLOT_FREE)
+            continue;
+        if (s->state != SLOT_CLOSE) {
+            if (s->fd_src >= 0)
+                close(s->fd_src);
+            if (s->fd_dst >= 0)
+                close(s->fd_dst);
+        }
+        s->buffer = NULL;
+    }
+
+out:
+    uring_exit(&ring);
+    for (i = 0; i < URING_SLOTS; i++)
+        free(slots[i].buffer);
+
+    return error;
+}
+
+#else
+
+int uring_available(void)
+{
+    return 0;
+}
+
+int uring_copy_files(struct uring_file *files, int nr_files,
+             size_t buffer_size, copy_progress_fn progress, void *arg,
+             uring_start_fn start, uring_done_fn done, void *file_arg)
+{
+    return -ENOSYS;
+}
+
+#endif /* HAVE_IO_URING */
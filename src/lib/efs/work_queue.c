@@ -0,0 +1,426 @@
+/**
+ * @file   work_queue.c
+ * @author Catalin Ionita <catalin.ionita@intel.com>
+ * @date   Fri Oct 16 10:05:12 2026
+ *
+ * @brief
+ * Worker pool with per-worker deques and work stealing
+ *
+ */
+
+/**
+ * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Catalin Ionita <catalin.ionita@intel.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <efs/efs.h>
+#include <efs/file_utils.h>
+#include <efs/work_queue.h>
+
+/**
+ * Get the number of online CPUs, bounded by MAX_WORKERS
+ *
+ * @return Number of CPUs available for workers
+ */
+int get_nr_cpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        return 1;
+    if (n > MAX_WORKERS)
+        return MAX_WORKERS;
+
+    return n;
+}
+
+/**
+ * Add an item at the owner end of a deque
+ *
+ * @param dq Deque
+ * @param item Work item
+ *
+ * @return 0 on success, negative value on error
+ */
+static int deque_push(struct work_deque *dq, void *item)
+{
+    void **items;
+    int size;
+
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->tail == dq->size) {
+        if (dq->head > 0) {
+            /* Reclaim slots already taken by thieves */
+            memmove(dq->items, dq->items + dq->head,
+                (dq->tail - dq->head) * sizeof(void *));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            size = dq->size ? 2 * dq->size : DEQUE_INIT_SIZE;
+            items = realloc(dq->items, size * sizeof(void *));
+            if (!items) {
+                pthread_mutex_unlock(&dq->lock);
+                LOGE("insufficient memory\n");
+                return -1;
+            }
+            dq->items = items;
+            dq->size = size;
+        }
+    }
+
+    dq->items[dq->tail++] = item;
+    pthread_mutex_unlock(&dq->lock);
+
+    return 0;
+}
+
+/**
+ * Take the most recently pushed item; used by the deque owner
+ *
+ * @param dq Deque
+ *
+ * @return Work item or NULL if the deque is empty
+ */
+static void *deque_pop(struct work_deque *dq)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head)
+        item = dq->items[--dq->tail];
+    if (dq->tail == dq->head)
+        dq->tail = dq->head = 0;
+    pthread_mutex_unlock(&dq->lock);
+
+    return item;
+}
+
+/**
+ * Take the oldest item from another worker's deque
+ *
+ * @param dq Deque
+ *
+ * @return Work item or NULL if the deque is empty
+ */
+static void *deque_steal(struct work_deque *dq)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head)
+        item = dq->items[dq->head++];
+    if (dq->tail == dq->head)
+        dq->tail = dq->head = 0;
+    pthread_mutex_unlock(&dq->lock);
+
+    return item;
+}
+
+/**
+ * Record the first error and stop all workers
+ * Also used by a producer that fails while the workers run
+ *
+ * @param pool Worker pool
+ * @param error Error code
+ */
+void work_pool_abort(struct work_pool *pool, int error)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->aborted) {
+        pool->aborted = 1;
+        pool->error = error;
+    }
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Worker main loop: drain own deque, then steal from the others
+ * Idle workers stay until the running items can push no more work
+ *
+ * @param data Worker descriptor
+ *
+ * @return NULL
+ */
+static void *work_pool_thread(void *data)
+{
+    struct work_worker *worker = data;
+    struct work_pool *pool = worker->pool;
+    void *item;
+    int i, ret, done;
+
+    for (;;) {
+        if (work_pool_aborted(pool))
+            break;
+
+        item = deque_pop(&pool->deques[worker->id]);
+        for (i = 1; !item && i < pool->nr_workers; i++)
+            item = deque_steal(&pool->deques[(worker->id + i) %
+                             pool->nr_workers]);
+
+        if (item) {
+            pthread_mutex_lock(&pool->lock);
+            pool->queued--;
+            pool->running++;
+            /* Room for a producer waiting on the limit */
+            if (pool->limit && pool->queued == pool->limit - 1)
+                pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+
+            ret = pool->fn(item, worker->id, pool->arg);
+
+            pthread_mutex_lock(&pool->lock);
+            pool->running--;
+            if (pool->running == 0 && pool->queued <= 0)
+                pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+
+            if (ret < 0) {
+                work_pool_abort(pool, ret);
+                break;
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued <= 0 && !pool->aborted &&
+               !(pool->closed && pool->running == 0))
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        done = pool->aborted || (pool->queued <= 0 && pool->closed &&
+                     pool->running == 0);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+/**
+ * Initialize a worker pool
+ *
+ * @param pool Worker pool
+ * @param nr_workers Number of worker threads
+ * @param fn Callback invoked for every work item
+ * @param arg Opaque argument passed to fn
+ *
+ * @return 0 on success, negative value on error
+ */
+int work_pool_init(struct work_pool *pool, int nr_workers, work_fn fn,
+           void *arg)
+{
+    int i;
+
+    if (nr_workers < 1)
+        nr_workers = 1;
+    if (nr_workers > MAX_WORKERS)
+        nr_workers = MAX_WORKERS;
+
+    memset(pool, 0, sizeof(struct work_pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->nr_workers = nr_workers;
+    pool->fn = fn;
+    pool->arg = arg;
+
+    for (i = 0; i < nr_workers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+    }
+
+    return 0;
+}
+
+/**
+ * Bound the number of queued items; pushing beyond the limit waits for
+ * the workers, so the pool must be started before the limit is reached
+ *
+ * @param pool Worker pool
+ * @param limit Maximum number of queued items, 0 for no limit
+ */
+void work_pool_set_limit(struct work_pool *pool, int limit)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->limit = limit;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Queue a work item; items are spread round robin over the workers
+ * This may be called before or after work_pool_start
+ *
+ * @param pool Worker pool
+ * @param item Work item
+ *
+ * @return 0 on success, negative value on error or if a limited pool
+ * was aborted while waiting
+ */
+int work_pool_push(struct work_pool *pool, void *item)
+{
+    int ret, id;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->limit && pool->queued >= pool->limit && !pool->aborted)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    if (pool->limit && pool->aborted) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    id = pool->next;
+    pool->next = (pool->next + 1) % pool->nr_workers;
+    pthread_mutex_unlock(&pool->lock);
+
+    ret = deque_push(&pool->deques[id], item);
+    if (ret < 0)
+        return ret;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/**
+ * Start worker threads
+ *
+ * @param pool Worker pool
+ *
+ * @return 0 on success, negative value on error
+ */
+int work_pool_start(struct work_pool *pool)
+{
+    int i, ret;
+
+    for (i = 0; i < pool->nr_workers; i++) {
+        ret = pthread_create(&pool->threads[i], NULL, work_pool_thread,
+                     &pool->workers[i]);
+        if (ret != 0) {
+            LOGE("Unable to start worker %d: %s", i, strerror(ret));
+            break;
+        }
+        pool->nr_started++;
+    }
+
+    /* Items queued for a missing worker get stolen by the others */
+    if (pool->nr_started == 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Signal that no more items will be pushed and wait for the workers
+ *
+ * @param pool Worker pool
+ *
+ * @return 0 on success, first error returned by a work item otherwise
+ */
+int work_pool_wait(struct work_pool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nr_started; i++)
+        pthread_join(pool->threads[i], NULL);
+    pool->nr_started = 0;
+
+    return pool->error;
+}
+
+/**
+ * Get the number of items waiting for a worker
+ *
+ * @param pool Worker pool
+ *
+ * @return Number of queued items
+ */
+int work_pool_queued(struct work_pool *pool)
+{
+    int queued;
+
+    pthread_mutex_lock(&pool->lock);
+    queued = pool->queued;
+    pthread_mutex_unlock(&pool->lock);
+
+    return queued;
+}
+
+/**
+ * Check whether a work item failed
+ *
+ * @param pool Worker pool
+ *
+ * @return 1 if the pool was aborted, 0 otherwise
+ */
+int work_pool_aborted(struct work_pool *pool)
+{
+    int aborted;
+
+    pthread_mutex_lock(&pool->lock);
+    aborted = pool->aborted;
+    pthread_mutex_unlock(&pool->lock);
+
+    return aborted;
+}
+
+/**
+ * Release the items left in the deques of an aborted pool
+ * Must be called after work_pool_wait
+ *
+ * @param pool Worker pool
+ * @param release Callback invoked for every item left
+ */
+void work_pool_drain(struct work_pool *pool, work_release_fn release)
+{
+    void *item;
+    int i;
+
+    for (i = 0; i < pool->nr_workers; i++) {
+        while ((item = deque_pop(&pool->deques[i])))
+            release(item);
+    }
+    pool->queued = 0;
+}
+
+/**
+ * Release resources held by a worker pool
+ *
+ * @param pool Worker pool
+ */
+void work_pool_destroy(struct work_pool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nr_workers; i++) {
+        free(pool->deques[i].items);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+}
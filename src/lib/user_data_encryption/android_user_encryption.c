@@ -26,6 +26,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <openssl/crypto.h>
 #include <cutils/properties.h>
 #include <efs/efs.h>
 #include <efs/key_chain.h>
@@ -36,6 +37,7 @@
 #include <efs/mount_utils.h>
 #include <efs/android_user_encryption.h>
 #include <efs/init.h>
+#include <efs/trash.h>
 #include "cutils/android_reboot.h"
 #include "hardware_legacy/power.h"
 
@@ -125,7 +127,7 @@ static int android_encrypt_primary_data(char *password)
 {
     char data_path[MAX_PATH_LENGTH], media_path[MAX_PATH_LENGTH], buf[10];
     char lockid[32] = { 0 };
-    off64_t size = 0;
+    struct tree_scan data_scan, media_scan;
     int ret = -1;
 
     property_set("crypto.primary_user", "encrypting");
@@ -148,42 +150,50 @@ static int android_encrypt_primary_data(char *password)
     /*
      * Get total size of encrypted data  and export it to GUI via
      * efs.encrypt.size property
+     * The same scans are reused to check space and copy each storage
      */
-    ret = get_dir_size(data_path, &size);
+    memset(&data_scan, 0, sizeof(data_scan));
+    memset(&media_scan, 0, sizeof(media_scan));
+    ret = scan_tree(data_path, SCAN_ENTRIES | SCAN_SKIP_TRASH, &data_scan);
     if (ret < 0) {
         LOGE("Unable to get dir size for %s", data_path);
-        release_wake_lock(lockid);
-        return ret;
+        goto err;
     }
-    ret = get_dir_size(media_path, &size);
+    ret = scan_tree(media_path, SCAN_ENTRIES | SCAN_SKIP_TRASH, &media_scan);
     if (ret < 0) {
         LOGE("Unable to get dir size for %s", media_path);
-        release_wake_lock(lockid);
-        return ret;
+        goto err;
     }
     memset(buf, 0, sizeof(buf));
-    snprintf(buf, sizeof(buf), "%ld", size);
+    snprintf(buf, sizeof(buf), "%ld", data_scan.size + media_scan.size);
     property_set("efs.encrypt.size", buf);
 
     /* Create secure storages for /data/data and /data/media/0 */
-    ret = EFS_create(data_path, PRIMARY_USER, password);
+    ret = EFS_create_from_scan(data_path, PRIMARY_USER, password, &data_scan);
+    free_scan(&data_scan);
     if (ret < 0) {
         LOGE("Unable to create efs storage %s", data_path);
-        release_wake_lock(lockid);
-        return ret;
+        goto err;
     }
 
-    ret = EFS_create(media_path, PRIMARY_USER, password);
+    ret = EFS_create_from_scan(media_path, PRIMARY_USER, password,
+                               &media_scan);
+    free_scan(&media_scan);
     if (ret < 0) {
         LOGE("Unable to create efs storage %s", media_path);
-        release_wake_lock(lockid);
-        return ret;
+        goto err;
     }
 
     /* Restart device */
     android_reboot(ANDROID_RB_RESTART, 0, 0);
 
     return 0;
+
+err:
+    free_scan(&data_scan);
+    free_scan(&media_scan);
+    release_wake_lock(lockid);
+    return ret;
 }
 
 /**
@@ -236,7 +246,43 @@ int android_encrypt_user_data(int user, char *password)
     return 0;
 }
 
-static int android_unlock_primary_user(char *password)
+/**
+ * Move the data under a storage mount point to the trash before unlock
+ * Only a completed storage is trashed; an interrupted create or recovery
+ * still needs the plain text data it left there
+ *
+ * @param storage_path EFS path
+ *
+ * @return 0 on success, negative value on error
+ */
+static int trash_stale_data(char *storage_path)
+{
+    int ret;
+
+    ret = EFS_get_status(storage_path);
+    if (ret != STORAGE_ENCRYPTION_COMPLETED) {
+        LOGE("Storage %s is not encrypted, status %d", storage_path, ret);
+        return -1;
+    }
+
+    ret = trash_dir_content(storage_path);
+    if (ret < 0) {
+        LOGE("Error removing data from %s directory", storage_path);
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Unlock the primary user storages from init
+ *
+ * @param keys Keys of the user password; the header copy shares its salt
+ * with the data storage, so that mount reuses the checked key
+ *
+ * @return 0 on success, negative value on error
+ */
+static int android_unlock_primary_user(struct key_ctx *keys)
 {
     char storage_path[MAX_PATH_LENGTH];
     char private_dir_path[MAX_PATH_LENGTH];
@@ -251,7 +297,8 @@ static int android_unlock_primary_user(char *password)
         return ret;
 
     /* Test the user provided password */
-    ret = check_passwd(&header, password);
+    ret = check_passwd(&header, keys);
+    OPENSSL_cleanse(&header, sizeof(header));
     if (ret < 0)
         return ret;
 
@@ -286,13 +333,11 @@ static int android_unlock_primary_user(char *password)
         return 0;
     }
 
-    ret = remove_dir_content(storage_path);
-    if (ret < 0) {
-        LOGE("Error removing data from %s directory", storage_path);
+    ret = trash_stale_data(storage_path);
+    if (ret < 0)
         return ret;
-    }
 
-    ret = EFS_unlock(storage_path, password);
+    ret = EFS_unlock_with_keys(storage_path, keys);
     if (ret < 0) {
         LOGE("Error unlocking efs storage %s", storage_path);
         return ret;
@@ -307,13 +352,11 @@ static int android_unlock_primary_user(char *password)
         return 0;
     }
 
-    ret = remove_dir_content(storage_path);
-    if (ret < 0) {
-        LOGE("Error removing data from %s directory", storage_path);
+    ret = trash_stale_data(storage_path);
+    if (ret < 0)
         return ret;
-    }
 
-    ret = EFS_unlock(storage_path, password);
+    ret = EFS_unlock_with_keys(storage_path, keys);
     if (ret < 0) {
         LOGE("Error unlocking efs storage %s", storage_path);
         return ret;
@@ -330,11 +373,11 @@ static int android_unlock_primary_user(char *password)
  * Mount encrypted data for an Android user
  *
  * @param user Android user id
- * @param password Android user password
+ * @param keys Keys of the Android user password
  *
  * @return 0 on success, negative value on error
  */
-int android_unlock_user_data(int from_init, int user, char *password)
+static int unlock_user_data(int from_init, int user, struct key_ctx *keys)
 {
     char storage_path[MAX_PATH_LENGTH];
     char private_dir_path[MAX_PATH_LENGTH];
@@ -346,7 +389,7 @@ int android_unlock_user_data(int from_init, int user, char *password)
         if (from_init)
             property_set("efs.selected_user", "0");
 
-        ret = android_unlock_primary_user(password);
+        ret = android_unlock_primary_user(keys);
         return ret;
     }
 
@@ -385,13 +428,11 @@ int android_unlock_user_data(int from_init, int user, char *password)
         return 0;
     }
 
-    ret = remove_dir_content(storage_path);
-    if (ret < 0) {
-        LOGE("Error removing data from %s directory", storage_path);
+    ret = trash_stale_data(storage_path);
+    if (ret < 0)
         return ret;
-    }
 
-    ret = EFS_unlock(storage_path, password);
+    ret = EFS_unlock_with_keys(storage_path, keys);
     if (ret < 0) {
         LOGE("Error unlocking efs storage %s", storage_path);
         return ret;
@@ -405,13 +446,11 @@ int android_unlock_user_data(int from_init, int user, char *password)
         return 0;
     }
 
-    ret = remove_dir_content(storage_path);
-    if (ret < 0) {
-        LOGE("Error removing data from %s directory", storage_path);
+    ret = trash_stale_data(storage_path);
+    if (ret < 0)
         return ret;
-    }
 
-    ret = EFS_unlock(storage_path, password);
+    ret = EFS_unlock_with_keys(storage_path, keys);
     if (ret < 0) {
         LOGE("Error unlocking efs storage %s", storage_path);
         return ret;
@@ -427,13 +466,97 @@ int android_unlock_user_data(int from_init, int user, char *password)
 }
 
 /**
- * Unmount Android user data
+ * Mount encrypted data for an Android user
+ * The password is derived once for each salt of the user storages
  *
  * @param user Android user id
+ * @param password Android user password
  *
  * @return 0 on success, negative value on error
  */
-int android_lock_user_data(int user)
+int android_unlock_user_data(int from_init, int user, char *password)
+{
+    struct key_ctx keys;
+    int ret;
+
+    key_ctx_init(&keys, password);
+    ret = unlock_user_data(from_init, user, &keys);
+    key_ctx_clear(&keys);
+
+    return ret;
+}
+
+/**
+ * Mount encrypted data of a secondary user locked with a token
+ * Fails if the keys were not cached, so the caller asks for the password
+ *
+ * @param user Android user id
+ * @param token Token given to android_lock_user_data_with_token
+ *
+ * @return 0 on success, negative value on error
+ */
+int android_unlock_user_data_with_token(int user, char *token)
+{
+    char storage_path[MAX_PATH_LENGTH];
+    char private_dir_path[MAX_PATH_LENGTH];
+    int ret = -1;
+
+    LOGI("Unlock user %d with token", user);
+
+    /* The primary user data is mounted over /data by init */
+    if (user == PRIMARY_USER)
+        return -1;
+
+    memset(storage_path, 0, sizeof(storage_path));
+    sprintf(storage_path, "%s%d", ANDROID_USER_DATA_PATH, user);
+
+    ret = get_private_storage_path(private_dir_path, storage_path);
+    if (ret < 0) {
+        LOGE("Error getting private storage for %s", storage_path);
+        return ret;
+    }
+
+    ret = access(private_dir_path, F_OK);
+    if (ret < 0) {
+        LOGE("Private storage %s does not exist", private_dir_path);
+        return ret;
+    }
+
+    if (check_fs_mounted(private_dir_path) != 1) {
+        ret = trash_stale_data(storage_path);
+        if (ret < 0)
+            return ret;
+
+        ret = EFS_unlock_with_token(storage_path, token);
+        if (ret < 0)
+            return ret;
+    }
+
+    memset(storage_path, 0, sizeof(storage_path));
+    sprintf(storage_path, "%s%d", ANDROID_VIRTUAL_SDCARD_PATH, user);
+
+    if (check_fs_mounted(storage_path) == 1) {
+        LOGE("ecryptfs is already mounted on %s", storage_path);
+        return 0;
+    }
+
+    ret = trash_stale_data(storage_path);
+    if (ret < 0)
+        return ret;
+
+    return EFS_unlock_with_token(storage_path, token);
+}
+
+/**
+ * Unmount Android user data, keeping its keys for a fast unlock
+ *
+ * @param user Android user id
+ * @param token Secret for android_unlock_user_data_with_token, NULL to
+ * keep nothing
+ *
+ * @return 0 on success, negative value on error
+ */
+int android_lock_user_data_with_token(int user, char *token)
 {
     char storage_path[MAX_PATH_LENGTH];
     int ret, prio;
@@ -449,7 +572,7 @@ int android_lock_user_data(int user)
     start_time = time(NULL);
     do {    
         killProcessesWithOpenFiles(storage_path, 2);
-        ret = EFS_lock(storage_path);
+        ret = EFS_lock_with_token(storage_path, token);
     } while (ret < 0 && time(NULL) - start_time < 30);
     
     setpriority(PRIO_PROCESS, 0, prio);
@@ -468,7 +591,7 @@ int android_lock_user_data(int user)
     start_time = time(NULL);
     do {    
         killProcessesWithOpenFiles(storage_path, 2);
-        ret = EFS_lock(storage_path);
+        ret = EFS_lock_with_token(storage_path, token);
     } while (ret < 0 && time(NULL) - start_time < 30);
     
     setpriority(PRIO_PROCESS, 0, prio);
@@ -481,6 +604,18 @@ int android_lock_user_data(int user)
     return 0;
 }
 
+/**
+ * Unmount Android user data
+ *
+ * @param user Android user id
+ *
+ * @return 0 on success, negative value on error
+ */
+int android_lock_user_data(int user)
+{
+    return android_lock_user_data_with_token(user, NULL);
+}
+
 /**
  * Change password for Android user encrypted data
  *
@@ -494,26 +629,33 @@ int android_change_user_data_password(int user, char *old_password,
                       char *new_password)
 {
     char storage_path[MAX_PATH_LENGTH];
+    struct key_ctx old_keys, new_keys;
     int ret;
 
     LOGI("Change user %d passwd", user);
+    key_ctx_init(&old_keys, old_password);
+    key_ctx_init(&new_keys, new_password);
+
     memset(storage_path, 0, sizeof(storage_path));
     sprintf(storage_path, "%s%d/", ANDROID_USER_DATA_PATH, user);
-    ret = EFS_change_password(storage_path, old_password, new_password);
+    ret = EFS_change_password_with_keys(storage_path, &old_keys, &new_keys);
     if (ret < 0) {
         LOGE("Error changing efs storage pass");
-        return ret;
+        goto out;
     }
 
     memset(storage_path, 0, sizeof(storage_path));
     sprintf(storage_path, "%s%d/", ANDROID_VIRTUAL_SDCARD_PATH, user);
-    ret = EFS_change_password(storage_path, old_password, new_password);
+    ret = EFS_change_password_with_keys(storage_path, &old_keys, &new_keys);
     if (ret < 0) {
         LOGE("Error changing efs storage pass");
-        return ret;
+        goto out;
     }
 
-    return 0;
+out:
+    key_ctx_clear(&old_keys);
+    key_ctx_clear(&new_keys);
+    return ret < 0 ? ret : 0;
 }
 
 /**
@@ -739,3 +881,35 @@ int android_check_primary_user_encrypted()
 {
     return android_get_encrypted_user_status(PRIMARY_USER);
 }
+
+/**
+ * Remove the trash left under user storages by a previous run
+ * The trash of a storage is only visible while it is locked, so mounted
+ * storages are skipped; it is deleted in the background
+ */
+void android_recover_trash()
+{
+    static const char *parents[] = { ANDROID_USER_DATA_PATH,
+        ANDROID_VIRTUAL_SDCARD_PATH };
+    char path[MAX_PATH_LENGTH];
+    struct dirent *entry;
+    unsigned int i;
+    DIR *dir;
+
+    for (i = 0; i < sizeof(parents) / sizeof(parents[0]); i++) {
+        dir = opendir(parents[i]);
+        if (!dir)
+            continue;
+
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.')
+                continue;
+            snprintf(path, sizeof(path), "%s%s", parents[i], entry->d_name);
+            /* Unlocked before a restart of the service */
+            if (check_fs_mounted(path) != 0)
+                continue;
+            trash_recover(path);
+        }
+        closedir(dir);
+    }
+}
@@ -133,6 +133,18 @@ int CommandListener::EncryptedFileStorageCmd::runCommand(SocketClient *cli, int
             return 0;
         }
         rc = android_lock_user_data(atoi(argv[2]));
+    } else if (!strcmp(argv[1], "lock_user_data_with_token")) {
+        if (argc != 4) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: efs lock_user_data_with_token <userId> <token>", false);
+            return 0;
+        }
+        rc = android_lock_user_data_with_token(atoi(argv[2]), argv[3]);
+    } else if (!strcmp(argv[1], "unlock_user_data_with_token")) {
+        if (argc != 4) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: efs unlock_user_data_with_token <userId> <token>", false);
+            return 0;
+        }
+        rc = android_unlock_user_data_with_token(atoi(argv[2]), argv[3]);
     } else if (!strcmp(argv[1], "change_user_data_passwd")) {
         if (argc != 5) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: efs change_user_data_passwd <userId> <old_passwd> <new_passwd>", false);
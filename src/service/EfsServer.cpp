@@ -35,6 +35,7 @@
 #include "cutils/klog.h"
 #include "cutils/log.h"
 #include "efs/CommandListener.h"
+#include "efs/android_user_encryption.h"
 
 #define LOG_TAG "EFSNativeService"
 
@@ -44,6 +45,9 @@ int main() {
 
     SLOGI("EFSNativeService starting");
 
+    /* Finish deleting what a previous run moved to the trash */
+    android_recover_trash();
+
     cl = new CommandListener();
 
     if (cl->startListener()) {
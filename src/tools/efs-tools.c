@@ -28,14 +28,144 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <efs/efs.h>
 #include <efs/file_utils.h>
+#include <efs/copy_strategy.h>
+#include <efs/uring_copy.h>
 
 void show_help()
 {
     printf("Usage: efs-tools storage <command> <params>\n");
     printf
-        ("Posible commands\ncreate\n\t->efs-tools storage create <path> <password>\nunlock\n\t->efs-tools storage unlock <path> <password>\nlock\n\t->efs-tools storage lock <path>\nremove\n\t->efs-tools storage remove <path>\nchange password\n\t->efs-tools storage change_passwd <path> <old_password> <new_password>\nrestore\n\t->efs-tools storage restore <path> <password>\n");
+        ("Posible commands\ncreate\n\t->efs-tools storage create <path> <password>\nunlock\n\t->efs-tools storage unlock <path> <password>\nlock\n\t->efs-tools storage lock <path>\nlock with token\n\t->efs-tools storage lock_with_token <path> <token>\nunlock with token\n\t->efs-tools storage unlock_with_token <path> <token>\nremove\n\t->efs-tools storage remove <path>\nchange password\n\t->efs-tools storage change_passwd <path> <old_password> <new_password>\nrestore\n\t->efs-tools storage restore <path> <password>\n");
+}
+
+/**
+ * Copy a directory with every supported buffer size and print the
+ * throughput for each one
+ *
+ * @param src_path Directory with sample data
+ * @param dst_path Directory on the filesystem under test
+ *
+ * @return 0 on success, negative value on error
+ */
+static int bench_copy(char *src_path, char *dst_path)
+{
+    struct copy_options opts;
+    struct timeval start, stop;
+    char path[MAX_PATH_LENGTH];
+    off64_t total = 0;
+    size_t size;
+    double secs;
+    int ret;
+
+    ret = get_dir_size(src_path, &total);
+    if (ret < 0 || total == 0) {
+        printf("Unable to get size of %s\n", src_path);
+        return -1;
+    }
+
+    init_copy_options(&opts);
+    opts.method = COPY_METHOD_RW;
+
+    printf("%lld bytes, %d threads\n", (long long)total, opts.threads);
+    printf("buffer_kb\tMB/s\n");
+    for (size = MIN_COPY_BUFFER_SIZE; size <= MAX_COPY_BUFFER_SIZE; size *= 2) {
+        opts.buffer_size = size;
+        snprintf(path, sizeof(path), "%s/bench.%zu", dst_path, size);
+        ret = mkdir(path, S_IRWXU);
+        if (ret < 0) {
+            printf("mkdir %s failed\n", path);
+            return ret;
+        }
+
+        sync();
+        gettimeofday(&start, NULL);
+        ret = copy_dir_content(path, src_path, &opts);
+        /* Include writeback, where ecryptfs encrypts the pages */
+        sync();
+        gettimeofday(&stop, NULL);
+        remove_dir(path);
+        if (ret < 0) {
+            printf("copy to %s failed\n", path);
+            return ret;
+        }
+
+        secs = (stop.tv_sec - start.tv_sec) +
+            (stop.tv_usec - start.tv_usec) / 1000000.0;
+        printf("%zu\t%.1f\n", size / 1024, total / secs / (1024 * 1024));
+    }
+
+    return 0;
+}
+
+/**
+ * Copy a directory with the synchronous and the io_uring engines and
+ * print elapsed time, file rate and throughput for each
+ *
+ * @param src_path Directory with sample data, preferably many small files
+ * @param dst_path Directory on the filesystem under test
+ *
+ * @return 0 on success, negative value on error
+ */
+static int bench_engine(char *src_path, char *dst_path)
+{
+    static const char *names[] = { "sync", "io_uring" };
+    struct copy_options opts;
+    struct tree_scan scan;
+    struct timeval start, stop;
+    char path[MAX_PATH_LENGTH];
+    off64_t total;
+    int64_t files;
+    double secs;
+    int engine, ret;
+
+    ret = scan_tree(src_path, 0, &scan);
+    if (ret < 0 || scan.size == 0) {
+        printf("Unable to get size of %s\n", src_path);
+        free_scan(&scan);
+        return -1;
+    }
+    total = scan.size;
+    files = scan.files;
+    free_scan(&scan);
+
+    if (!uring_available())
+        printf("io_uring unavailable, it will fall back to sync\n");
+
+    printf("%lld bytes, %lld files\n", (long long)total, (long long)files);
+    printf("engine\tsecs\tfiles/s\tMB/s\n");
+    for (engine = COPY_ENGINE_SYNC; engine <= COPY_ENGINE_URING; engine++) {
+        init_copy_options(&opts);
+        opts.engine = engine;
+        snprintf(path, sizeof(path), "%s/bench.%s", dst_path, names[engine]);
+        ret = mkdir(path, S_IRWXU);
+        if (ret < 0) {
+            printf("mkdir %s failed\n", path);
+            return ret;
+        }
+
+        sync();
+        gettimeofday(&start, NULL);
+        ret = copy_dir_content(path, src_path, &opts);
+        sync();
+        gettimeofday(&stop, NULL);
+        remove_dir(path);
+        if (ret < 0) {
+            printf("copy to %s failed\n", path);
+            return ret;
+        }
+
+        secs = (stop.tv_sec - start.tv_sec) +
+            (stop.tv_usec - start.tv_usec) / 1000000.0;
+        printf("%s\t%.2f\t%.0f\t%.1f\n", names[engine], secs, files / secs,
+               total / secs / (1024 * 1024));
+    }
+
+    return 0;
 }
 
 int main(int argc, char *argv[])
@@ -80,6 +210,22 @@ int main(int argc, char *argv[])
             return EFS_lock(argv[3]);
         }
 
+        if (strcmp(argv[2], "lock_with_token") == 0) {
+            if (argc != 5) {
+                printf("Incorect usage of lock storage with token\n");
+                return -1;
+            }
+            return EFS_lock_with_token(argv[3], argv[4]);
+        }
+
+        if (strcmp(argv[2], "unlock_with_token") == 0) {
+            if (argc != 5) {
+                printf("Incorect usage of unlock storage with token\n");
+                return -1;
+            }
+            return EFS_unlock_with_token(argv[3], argv[4]);
+        }
+
         if (strcmp(argv[2], "change_passwd") == 0) {
             if (argc != 6) {
                 printf
@@ -122,9 +268,11 @@ int main(int argc, char *argv[])
                 printf("Incorect usage of size\n");
                 return -1;
             }
-            off_t size = 0;
-            get_dir_size(argv[3], &size);
-            printf("Dir size = %d bytes", size);
+            off64_t size = 0;
+            ret = get_dir_size(argv[3], &size);
+            if (ret < 0)
+                return ret;
+            printf("Dir size = %lld bytes\n", (long long)size);
             return 0;
         }
         if (strcmp(argv[2], "cp") == 0) {
@@ -132,8 +280,36 @@ int main(int argc, char *argv[])
                 printf("Incorect usage of copy dir content\n");
                 return -1;
             }
-            copy_dir_content(argv[3], argv[4]);
-            return 0;
+            struct copy_options opts;
+            struct copy_stats stats;
+            init_copy_options(&opts);
+            opts.threads = atoi(argv[5]);
+            opts.stats = &stats;
+            ret = copy_dir_content(argv[3], argv[4], &opts);
+            if (ret == 0)
+                printf("%lld files, %lld hard links, %lld bytes copied, "
+                       "%lld bytes of holes skipped\n",
+                       (long long)stats.files, (long long)stats.links,
+                       (long long)stats.bytes, (long long)stats.holes);
+            if (ret == 0)
+                printf("%lld contexts, %.1f ms reading, %.1f ms restoring\n",
+                       (long long)stats.contexts, stats.con_get_ns / 1e6,
+                       stats.con_set_ns / 1e6);
+            return ret;
+        }
+        if (strcmp(argv[2], "bench") == 0) {
+            if (argc != 5) {
+                printf("Incorect usage of bench\n");
+                return -1;
+            }
+            return bench_copy(argv[3], argv[4]);
+        }
+        if (strcmp(argv[2], "bench_engine") == 0) {
+            if (argc != 5) {
+                printf("Incorect usage of bench_engine\n");
+                return -1;
+            }
+            return bench_engine(argv[3], argv[4]);
         }
         if (strcmp(argv[2], "rm") == 0) {
             if (argc != 5) {
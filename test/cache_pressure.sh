@@ -0,0 +1,54 @@
+#!/bin/bash
+#  System-wide page cache pressure while a storage is created, for each
+#  copy cache policy (efs.copy.cache). /proc/meminfo is sampled every
+#  second during EFS_create; the peak Cached and the lowest MemAvailable
+#  show how much of the rest of the system was pushed out
+#
+# * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+# *
+# * Licensed under the Apache License, Version 2.0 (the "License");
+# * you may not use this file except in compliance with the License.
+# * You may obtain a copy of the License at
+# *
+# *      http://www.apache.org/licenses/LICENSE-2.0
+# *
+# * Unless required by applicable law or agreed to in writing, software
+# * distributed under the License is distributed on an "AS IS" BASIS,
+# * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# * See the License for the specific language governing permissions and
+# * limitations under the License.
+# */
+
+storage_path="/data/data/cache_storage"
+password="password"
+sample_mb=512
+
+adb shell "setenforce 0"
+
+for policy in keep drop direct; do
+	adb shell "rm -rf $storage_path /data/data/.cache_storage"
+	adb shell "mkdir -p $storage_path/small"
+	for i in 0 1 2 3; do
+		adb shell "dd if=/dev/urandom of=$storage_path/large.$i bs=1000000 count=$((sample_mb / 4))" &> /dev/null
+	done
+	adb shell "for i in \$(seq 1 2000); do dd if=/dev/urandom of=$storage_path/small/f.\$i bs=4096 count=4 2>/dev/null; done"
+
+	adb shell "setprop efs.copy.cache $policy"
+	adb shell "sync; echo 3 > /proc/sys/vm/drop_caches"
+
+	adb shell "efs-tools storage create $storage_path $password & pid=\$!; \
+		peak=0; low=0; start=\$(date +%s); \
+		while kill -0 \$pid 2>/dev/null; do \
+			cached=\$(grep '^Cached:' /proc/meminfo | tr -s ' ' | cut -d ' ' -f 2); \
+			avail=\$(grep '^MemAvailable:' /proc/meminfo | tr -s ' ' | cut -d ' ' -f 2); \
+			[ \$cached -gt \$peak ] && peak=\$cached; \
+			[ \$low -eq 0 -o \$avail -lt \$low ] && low=\$avail; \
+			sleep 1; \
+		done; \
+		echo \"$policy: \$((\$(date +%s) - start)) s, peak Cached \$((peak / 1024)) MB, lowest MemAvailable \$((low / 1024)) MB\""
+
+	adb shell "efs-tools storage remove $storage_path"
+done
+
+adb shell "setprop efs.copy.cache drop"
+adb shell "rm -rf $storage_path /data/data/.cache_storage"
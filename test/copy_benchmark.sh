@@ -0,0 +1,43 @@
+#!/bin/bash
+#  Copy throughput for each copy buffer size, measured on an unlocked
+#  secure storage so the numbers include ecryptfs encryption
+#
+# * Copyright (C) 2013 Intel Corporation, All Rights Reserved
+# *
+# * Licensed under the Apache License, Version 2.0 (the "License");
+# * you may not use this file except in compliance with the License.
+# * You may obtain a copy of the License at
+# *
+# *      http://www.apache.org/licenses/LICENSE-2.0
+# *
+# * Unless required by applicable law or agreed to in writing, software
+# * distributed under the License is distributed on an "AS IS" BASIS,
+# * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# * See the License for the specific language governing permissions and
+# * limitations under the License.
+# */
+
+sample_path="/data/data/bench_sample"
+storage_path="/data/data/bench_storage"
+password="password"
+
+adb shell "setenforce 0"
+adb shell "rm -rf $sample_path $storage_path /data/data/.bench_storage"
+adb shell "mkdir $sample_path $storage_path"
+
+# A few large media-like files and many small app-like files
+for i in 0 1 2 3; do
+	adb shell "dd if=/dev/urandom of=$sample_path/large.$i bs=1000000 count=16" &> /dev/null
+done
+adb shell "mkdir $sample_path/small"
+adb shell "for i in \$(seq 1 500); do dd if=/dev/urandom of=$sample_path/small/f.\$i bs=4096 count=2 2>/dev/null; done"
+
+adb shell "efs-tools storage create $storage_path $password"
+adb shell "efs-tools storage unlock $storage_path $password"
+
+adb shell "efs-tools utils bench $sample_path $storage_path"
+adb shell "efs-tools utils bench_engine $sample_path/small $storage_path"
+
+adb shell "efs-tools storage lock $storage_path"
+adb shell "efs-tools storage remove $storage_path"
+adb shell "rm -rf $sample_path $storage_path"
@@ -28,6 +28,9 @@ LOST_FOUND='/data/lost+found/new_folder'
 
 #this is a hardcoded key, based on the hardcoded STORAGE_PATH. if the STORAGE_PATH is changed, you should change also the value of KEY, otherwise the create/remove tests will falsely FAIL
 KEY='.keys.b318b6b72bd2dae7b992fe2cbf5c42b45914c3c9597a9b1732af6d25b5df3f6c0ad517bc67ce5d33d8b19c4f4adb910dd894cde8ffd7023eaceffa00bb395ac0'
+KEY_FILE='/data/misc/keystore/'$KEY
+#tokens are at least 16 characters long
+TOKEN='token0123456789abcdef'
 
 #declaring vars
 extratag=logs_`date +"%s"`
@@ -215,6 +218,146 @@ function remove_storage() {
 	fi
 }
 
+function set_migrate() {
+	adb shell "setprop efs.migrate $1" > /dev/null
+}
+
+function set_kdf() {
+	adb shell "setprop efs.kdf $1" > /dev/null
+	adb shell "setprop efs.kdf.target_ms $2" > /dev/null
+}
+
+function set_unlock_cache() {
+	adb shell "setprop efs.unlock.cache_timeout $1" > /dev/null
+}
+
+function check_status() {
+	test='Verify status record of '$1
+	ok1=$(adb shell efs-tools storage stat $1 | grep -c 'Storage status = '$2)
+	#the status is kept next to the key file, not in it
+	ok2=$(adb shell "test -f $KEY_FILE.status && echo found" | grep -c found)
+	#the copy journal does not outlive the encryption
+	ok3=$(adb shell "test -f $KEY_FILE.journal && echo found" | grep -c found)
+	if [[ $ok1 == "1" && $ok2 == "1" && $ok3 == "0" ]]
+	then
+		echo -e "$test - PASS"
+	else
+		echo -e "$test - FAIL"
+	fi
+	adb logcat -c
+}
+
+function resume_create_storage() {
+	test='Resume interrupted creation of secure container '$1
+	#enough data for the copy to be interrupted
+	adb shell mkdir $1/big
+	for i in 0 1 2 3 4
+	do
+		adb shell "dd if=/dev/urandom of=$1/big/test.file$i bs=1000000 count=20" &> /dev/null
+	done
+	adb shell efs-tools storage create $1 $2 > /dev/null &
+	pid=$!
+	#kill the copy once the encryption is marked in progress
+	ok0=0
+	while [[ $ok0 == "0" ]] && kill -0 $pid 2> /dev/null
+	do
+		ok0=$(adb shell efs-tools storage stat $1 | grep -c 'Storage status = 2')
+	done
+	adb shell "kill -9 \$(pidof efs-tools)" > /dev/null
+	wait $pid
+	#a reboot would drop the ecryptfs mount as well
+	adb shell umount $3 > /dev/null
+	ok0=$(adb shell efs-tools storage stat $1 | grep -c 'Storage status = 2')
+	adb logcat -c
+
+	adb shell efs-tools storage create $1 $2
+	#verify logcat
+	ok1=$(adb logcat -d > $logfolder/log_resume_create_storage.log && grep -c 'Resuming interrupted encryption of '$1 $logfolder/log_resume_create_storage.log)
+	ok2=$(grep -c 'Secure storage created for '$1 $logfolder/log_resume_create_storage.log)
+	#ENCRYPTED_STORAGE_PATH should contain the encrypted files and the big folder
+	ok3=$(adb shell ls $3 | grep -c ECRYPTFS)
+	ok4=$(adb shell ls $1 | grep -c -e txt -e big)
+	if [[ $ok0 == "1" && $ok1 == "1" && $ok2 == "1" && $ok3 == "4" && $ok4 == "0" ]]
+	then
+		echo -e "$test - PASS"
+	else
+		echo -e "$test - FAIL"
+	fi
+	adb logcat -c
+}
+
+function unlock_v1_storage() {
+	test='Unlock secure container '$1' with a v1 header'
+	#rewrite the key file in the v1 layout: keys, salt, username, signature
+	#and status
+	adb shell "dd if=$KEY_FILE of=$KEY_FILE.v1 bs=1 skip=32 count=416 2> /dev/null"
+	adb shell "printf '\003\000\000\000' >> $KEY_FILE.v1"
+	#v1 headers carry the status, there is no status record
+	adb shell "mv $KEY_FILE.v1 $KEY_FILE; rm $KEY_FILE.status"
+	ok0=$(adb shell "wc -c < $KEY_FILE" | grep -c 420)
+
+	adb shell efs-tools storage unlock $1 $2
+	#verify logcat
+	ok1=$(adb logcat -d > $logfolder/log_unlock_v1_storage.log && grep -c 'Secure storage '$1' unlocked' $logfolder/log_unlock_v1_storage.log)
+	#$STORAGE_PATH should contain the files in plain text
+	ok2=$(adb shell ls $1 | grep -c txt)
+	ok3=$(adb shell efs-tools storage stat $1 | grep -c 'Storage status = 3')
+	if [[ $ok0 == "1" && $ok1 == "1" && $ok2 == "3" && $ok3 == "1" ]]
+	then
+		echo -e "$test - PASS"
+	else
+		echo -e "$test - FAIL"
+	fi
+	adb logcat -c
+}
+
+function lock_storage_with_token() {
+	test='Lock secure container '$1' with a token'
+	adb shell efs-tools storage lock_with_token $1 $2
+	#verify logcat
+	ok1=$(adb logcat -d > $logfolder/log_lock_storage_with_token.log && grep -c 'Secure storage '$1' locked' $logfolder/log_lock_storage_with_token.log)
+	ok2=$(grep -c 'Unable to cache keys of '$1 $logfolder/log_lock_storage_with_token.log)
+	#$STORAGE_PATH should be empty
+	ok3=$(adb shell ls $1 | grep -c txt)
+	if [[ $ok1 == "1" && $ok2 == "0" && $ok3 == "0" ]]
+	then
+		echo -e "$test - PASS"
+	else
+		echo -e "$test - FAIL"
+	fi
+	adb logcat -c
+}
+
+function unlock_storage_with_token() {
+	test='Unlock secure container '$1' with a token'
+	adb shell efs-tools storage unlock_with_token $1 $2
+	if [[ $3 == "fail" ]]
+		then
+			#the cached keys are gone once used, after a plain lock or a passwd change
+			ok0=$(adb logcat -d > $logfolder/log_unlock_storage_with_token.log && grep -c 'No cached keys for '$1 $logfolder/log_unlock_storage_with_token.log)
+			ok1=$(adb shell ls $1 | grep -c txt)
+			if [[ $ok0 == "1" && $ok1 == "0" ]]
+				then
+					echo -e "$test did not succeed - no cached keys - PASS"
+				else
+					echo -e "$test did not succeed - no cached keys - FAIL"
+			fi
+
+		else
+			#verify logcat
+			ok1=$(adb logcat -d > $logfolder/log_unlock_storage_with_token.log && grep -c 'Secure storage '$1' unlocked from cache' $logfolder/log_unlock_storage_with_token.log)
+			#$STORAGE_PATH should contain the files in plain text
+			ok2=$(adb shell ls $1 | grep -c txt)
+			if [[ $ok1 == "1" && $ok2 == "3" ]]
+			then
+				echo -e "$test - PASS"
+			else
+				echo -e "$test - FAIL"
+			fi
+	fi
+	adb logcat -c
+}
+
 
 #EDC Functions
 function edc_create_storage() {
@@ -49,6 +49,63 @@ setup "/data/data/bla"
 create_storage "/data/data/bla" bla "/data/data/.bla"
 create_storage "/../../data/data/bla" test1 "/./../data/data/.bla"
 remove_storage "/../../data/data/bla" test1 "/./../data/data/.bla"
+echo 'Starting resume tests:'
+clean $STORAGE_PATH $ENCRYPTED_STORAGE_PATH
+setup $STORAGE_PATH
+resume_create_storage $STORAGE_PATH $OLD_PASS $ENCRYPTED_STORAGE_PATH
+check_status $STORAGE_PATH 3
+unlock_storage $STORAGE_PATH $OLD_PASS
+lock_storage $STORAGE_PATH
+restore_storage $STORAGE_PATH $OLD_PASS
+echo 'Starting migration tests:'
+clean $STORAGE_PATH $ENCRYPTED_STORAGE_PATH
+setup $STORAGE_PATH
+#each source is removed as soon as its copy is on disk
+set_migrate 1
+create_storage $STORAGE_PATH $OLD_PASS $ENCRYPTED_STORAGE_PATH
+check_status $STORAGE_PATH 3
+unlock_storage $STORAGE_PATH $OLD_PASS
+lock_storage $STORAGE_PATH
+restore_storage $STORAGE_PATH $OLD_PASS
+#part of the data is only encrypted when the copy is interrupted
+clean $STORAGE_PATH $ENCRYPTED_STORAGE_PATH
+setup $STORAGE_PATH
+resume_create_storage $STORAGE_PATH $OLD_PASS $ENCRYPTED_STORAGE_PATH
+check_status $STORAGE_PATH 3
+unlock_storage $STORAGE_PATH $OLD_PASS
+lock_storage $STORAGE_PATH
+restore_storage $STORAGE_PATH $OLD_PASS
+set_migrate 0
+echo 'Starting v1 header tests:'
+clean $STORAGE_PATH $ENCRYPTED_STORAGE_PATH
+setup $STORAGE_PATH
+#v1 headers have no KDF parameters and use 10000 iterations of PBKDF2-SHA1
+set_kdf pbkdf2-sha1 1
+create_storage $STORAGE_PATH $OLD_PASS $ENCRYPTED_STORAGE_PATH
+unlock_v1_storage $STORAGE_PATH $OLD_PASS
+lock_storage $STORAGE_PATH
+restore_storage $STORAGE_PATH $OLD_PASS
+set_kdf pbkdf2-sha512 250
+echo 'Starting unlock token tests:'
+clean $STORAGE_PATH $ENCRYPTED_STORAGE_PATH
+setup $STORAGE_PATH
+create_storage $STORAGE_PATH $OLD_PASS $ENCRYPTED_STORAGE_PATH
+unlock_storage $STORAGE_PATH $OLD_PASS
+set_unlock_cache 60
+lock_storage_with_token $STORAGE_PATH $TOKEN
+unlock_storage_with_token $STORAGE_PATH $TOKEN
+#a plain lock forgets the keys cached by an earlier lock
+lock_storage_with_token $STORAGE_PATH $TOKEN
+unlock_storage $STORAGE_PATH $OLD_PASS
+lock_storage $STORAGE_PATH
+unlock_storage_with_token $STORAGE_PATH $TOKEN fail
+#so does a passwd change
+unlock_storage $STORAGE_PATH $OLD_PASS
+lock_storage_with_token $STORAGE_PATH $TOKEN
+change_passwd $STORAGE_PATH $OLD_PASS $NEW_PASS
+unlock_storage_with_token $STORAGE_PATH $TOKEN fail
+set_unlock_cache 0
+restore_storage $STORAGE_PATH $NEW_PASS
 echo 'Starting native daemon integration tests'
 clean $STORAGE_PATH $ENCRYPTED_STORAGE_PATH
 setup $STORAGE_PATH